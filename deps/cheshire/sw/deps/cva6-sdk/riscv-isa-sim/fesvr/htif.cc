@@ -113,6 +113,18 @@ std::map<std::string, uint64_t> htif_t::load_payload(const std::string& payload,
         memif_t::write(taddr, len, src);
     }
 
+    void write_file(addr_t taddr, size_t len, int fd, off_t offset, const void* src) override
+    {
+      if (!htif->is_address_preloaded(taddr, len))
+        memif_t::write_file(taddr, len, fd, offset, src);
+    }
+
+    void clear(addr_t taddr, size_t len) override
+    {
+      if (!htif->is_address_preloaded(taddr, len))
+        memif_t::clear(taddr, len);
+    }
+
    private:
     htif_t* htif;
   } preload_aware_memif(this);
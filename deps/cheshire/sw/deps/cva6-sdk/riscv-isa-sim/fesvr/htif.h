@@ -78,6 +78,9 @@ class htif_t : public chunked_memif_t
   // Given an address, return symbol from addr2symbol map
   const char* get_symbol(uint64_t addr);
 
+  // stop the run loop as though the target had exited with code
+  void request_exit(int code) { exitcode = code << 1 | 1; }
+
  private:
   void parse_arguments(int argc, char ** argv);
   void register_devices();
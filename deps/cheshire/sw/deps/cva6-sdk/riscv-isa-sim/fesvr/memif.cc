@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <stdexcept>
 #include "memif.h"
 
@@ -83,6 +84,38 @@ void memif_t::write(addr_t addr, size_t len, const void* bytes)
   }
 }
 
+void memif_t::write_file(addr_t addr, size_t len, int fd, off_t offset, const void* bytes)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t head = std::min(len, (page - size_t(addr & (page-1))) & (page-1));
+  size_t mapped = (len - head) & ~(page-1);
+
+  if (mapped && (addr & (page-1)) == (offset & (page-1)) &&
+      cmemif->map_file(addr + head, mapped, fd, offset + head)) {
+    write(addr, head, bytes);
+    write(addr + head + mapped, len - head - mapped, (const char*)bytes + head + mapped);
+  } else {
+    write(addr, len, bytes);
+  }
+}
+
+void memif_t::clear(addr_t addr, size_t len)
+{
+  size_t align = cmemif->chunk_align();
+  uint8_t zeros[align];
+  memset(zeros, 0, align);
+
+  size_t head = std::min(len, (align - size_t(addr & (align-1))) & (align-1));
+  write(addr, head, zeros);
+  addr += head;
+  len -= head;
+
+  size_t tail = len & (align-1);
+  if (len > tail)
+    cmemif->clear_chunk(addr, len - tail);
+  write(addr + len - tail, tail, zeros);
+}
+
 #define MEMIF_READ_FUNC \
   if(addr & (sizeof(val)-1)) \
     throw std::runtime_error("misaligned address"); \
@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 #include "byteorder.h"
 
 typedef uint64_t reg_t;
@@ -23,6 +24,10 @@ public:
   virtual void read_chunk(addr_t taddr, size_t len, void* dst) = 0;
   virtual void write_chunk(addr_t taddr, size_t len, const void* src) = 0;
   virtual void clear_chunk(addr_t taddr, size_t len) = 0;
+  // Map len bytes of the file at offset into target memory at taddr,
+  // copy-on-write, or return false if the target can't.  Both taddr and
+  // offset are aligned to the host's page size, as is len.
+  virtual bool map_file(addr_t taddr, size_t len, int fd, off_t offset) { return false; }
 
   virtual size_t chunk_align() = 0;
   virtual size_t chunk_max_size() = 0;
@@ -43,6 +48,14 @@ public:
   virtual void read(addr_t addr, size_t len, void* bytes);
   virtual void write(addr_t addr, size_t len, const void* bytes);
 
+  // Write len bytes of a file, which are at bytes in the host's memory.
+  // The target may map the whole pages of the range straight from the
+  // file, so they are only read in when first touched; the file must then
+  // not change in place.
+  virtual void write_file(addr_t addr, size_t len, int fd, off_t offset, const void* bytes);
+  // zero a byte array
+  virtual void clear(addr_t addr, size_t len);
+
   // read and write 8-bit words
   virtual target_endian<uint8_t> read_uint8(addr_t addr);
   virtual target_endian<int8_t> read_int8(addr_t addr);
@@ -5,10 +5,16 @@
 #include <cstdint>
 #include <cstddef>
 
+class checkpoint_section_t;
+
 class abstract_device_t {
  public:
   virtual bool load(reg_t addr, size_t len, uint8_t* bytes) = 0;
   virtual bool store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
+  // save and restore the device's state in a checkpoint; devices with no
+  // state of their own needn't override these
+  virtual void save(checkpoint_section_t& cp) {}
+  virtual void restore(const checkpoint_section_t& cp) {}
   virtual ~abstract_device_t() {}
 };
 
@@ -0,0 +1,82 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_AXI_COUNTERS_H
+#define _RISCV_AXI_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// The traffic on a modelled AXI port, as Cheshire's axi_perf_counters would
+// count it, in the order of their registers.  The hardware counts cycles in
+// which a valid or ready is up; a port with no back-pressure handshakes in
+// the cycle valid rises, so valid, ready and done counts are all equal and
+// the stall counts stay zero unless a model adds them.  The transfer ids and
+// the busy count belong to the DMA engine and stay zero.
+struct axi_counters_t
+{
+  enum counter_t {
+    AW_VALID, AW_READY, AW_DONE, AW_BW, AW_STALL,
+    AR_VALID, AR_READY, AR_DONE, AR_BW, AR_STALL,
+    R_VALID, R_READY, R_DONE, R_BW, R_STALL,
+    W_VALID, W_READY, W_DONE, W_BW, W_STALL,
+    B_VALID, B_READY, B_DONE,
+    BUF_W_STALL, BUF_R_STALL,
+    NEXT_ID, COMPLETED_ID, BUSY,
+    NUM_COUNTERS
+  };
+
+  // data beats are of BEAT bytes, the width of Cheshire's AXI data bus
+  static const uint64_t BEAT = 8;
+
+  axi_counters_t() { memset(count, 0, sizeof(count)); }
+
+  // a burst reading or writing bytes
+  void read(uint64_t bytes)
+  {
+    uint64_t beats = (bytes + BEAT - 1) / BEAT;
+    handshake(AR_VALID, 1);
+    count[AR_BW] += bytes;
+    handshake(R_VALID, beats);
+    count[R_BW] += beats * BEAT;
+  }
+  void write(uint64_t bytes)
+  {
+    uint64_t beats = (bytes + BEAT - 1) / BEAT;
+    handshake(AW_VALID, 1);
+    count[AW_BW] += bytes;
+    handshake(W_VALID, beats);
+    count[W_BW] += bytes;
+    handshake(B_VALID, 1);
+  }
+
+  void print(const std::string& prefix) const
+  {
+    static const char* const names[NUM_COUNTERS] = {
+      "aw_valid_cnt", "aw_ready_cnt", "aw_done_cnt", "aw_bw", "aw_stall_cnt",
+      "ar_valid_cnt", "ar_ready_cnt", "ar_done_cnt", "ar_bw", "ar_stall_cnt",
+      "r_valid_cnt", "r_ready_cnt", "r_done_cnt", "r_bw", "r_stall_cnt",
+      "w_valid_cnt", "w_ready_cnt", "w_done_cnt", "w_bw", "w_stall_cnt",
+      "b_valid_cnt", "b_ready_cnt", "b_done_cnt",
+      "buf_w_stall_cnt", "buf_r_stall_cnt",
+      "next_id", "completed_id", "busy_cnt",
+    };
+    for (int i = 0; i < NUM_COUNTERS; i++)
+      if (count[i])
+        std::cout << prefix << " " << names[i] << ": " << count[i] << std::endl;
+  }
+
+  uint64_t count[NUM_COUNTERS];
+
+ private:
+  // valid, ready and done of a channel, in that order
+  void handshake(int valid, uint64_t n)
+  {
+    count[valid] += n;
+    count[valid + 1] += n;
+    count[valid + 2] += n;
+  }
+};
+
+#endif
@@ -0,0 +1,22 @@
+// See LICENSE for license details.
+
+#include "axi_perf.h"
+
+bool axi_perf_counters_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if ((len != 4 && len != 8) || addr % len != 0)
+    return false;
+  for (size_t i = 0; i < len; i += 4) {
+    // the register index has six bits, and those past the counters read 0
+    size_t index = ((addr + i) >> 2) & 63;
+    uint32_t val = index < axi_counters_t::NUM_COUNTERS ? counters->count[index] : 0;
+    memcpy(bytes + i, &val, 4);
+  }
+  return true;
+}
+
+bool axi_perf_counters_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  // writes are acknowledged and ignored
+  return (len == 4 || len == 8) && addr % len == 0;
+}
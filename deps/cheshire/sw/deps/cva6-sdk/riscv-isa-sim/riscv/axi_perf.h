@@ -0,0 +1,45 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_AXI_PERF_H
+#define _RISCV_AXI_PERF_H
+
+#include "cachesim.h"
+#include "abstract_device.h"
+#include "axi_counters.h"
+
+// A point of the modelled memory hierarchy whose traffic is counted, such
+// as the AXI port of a core, passing every access on unchanged
+class axi_port_t : public mem_model_t
+{
+ public:
+  axi_port_t(const char* name) : name(name), next(NULL) {}
+  ~axi_port_t() { counters.print(name); }
+  uint64_t access(uint64_t addr, size_t bytes, bool store)
+  {
+    store ? counters.write(bytes) : counters.read(bytes);
+    return next ? next->access(addr, bytes, store) : 0;
+  }
+  void set_next(mem_model_t* mem) { next = mem; }
+  const axi_counters_t& get_counters() const { return counters; }
+
+ private:
+  std::string name;
+  mem_model_t* next;
+  axi_counters_t counters;
+};
+
+// Cheshire's axi_perf_counters: the counters of a port as read-only 32-bit
+// registers, four bytes apart in the order of axi_counters_t, each holding
+// the low half of its counter
+class axi_perf_counters_t : public abstract_device_t
+{
+ public:
+  axi_perf_counters_t(const axi_counters_t* counters) : counters(counters) {}
+  bool load(reg_t addr, size_t len, uint8_t* bytes);
+  bool store(reg_t addr, size_t len, const uint8_t* bytes);
+
+ private:
+  const axi_counters_t* counters;
+};
+
+#endif
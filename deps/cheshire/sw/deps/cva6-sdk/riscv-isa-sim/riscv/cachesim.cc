@@ -2,22 +2,184 @@
 
 #include "cachesim.h"
 #include "common.h"
+#include <cctype>
 #include <cstdlib>
 #include <iostream>
 #include <iomanip>
+#include <vector>
 
-cache_sim_t::cache_sim_t(size_t _sets, size_t _ways, size_t _linesz, const char* _name)
+// Evicts the least recently used way.  Each line holds its rank in the
+// set's recency order, 0 being the most recent.
+class lru_policy_t : public repl_policy_t
+{
+ public:
+  lru_policy_t(size_t sets, size_t ways) : ways(ways), rank(sets * ways)
+  {
+    for (size_t i = 0; i < rank.size(); i++)
+      rank[i] = i % ways;
+  }
+  const char* name() const { return "lru"; }
+  repl_policy_t* clone() const { return new lru_policy_t(*this); }
+  void touch(size_t set, size_t way)
+  {
+    uint16_t* r = &rank[set * ways];
+    for (size_t i = 0; i < ways; i++)
+      if (r[i] < r[way])
+        r[i]++;
+    r[way] = 0;
+  }
+  void fill(size_t set, size_t way) { touch(set, way); }
+  size_t victim(size_t set)
+  {
+    const uint16_t* r = &rank[set * ways];
+    size_t way = 0;
+    for (size_t i = 1; i < ways; i++)
+      if (r[i] > r[way])
+        way = i;
+    return way;
+  }
+
+ private:
+  size_t ways;
+  std::vector<uint16_t> rank;
+};
+
+// Tree pseudo-LRU: each set has a binary tree of ways - 1 bits, node n
+// having children 2n and 2n+1, each bit pointing to the half to evict from.
+class plru_policy_t : public repl_policy_t
+{
+ public:
+  plru_policy_t(size_t sets, size_t ways) : ways(ways), tree(sets) {}
+  const char* name() const { return "plru"; }
+  repl_policy_t* clone() const { return new plru_policy_t(*this); }
+  void touch(size_t set, size_t way)
+  {
+    size_t node = way + ways;
+    for (; node > 1; node /= 2) {
+      if (node & 1)
+        tree[set] &= ~(uint64_t(1) << (node / 2));
+      else
+        tree[set] |= uint64_t(1) << (node / 2);
+    }
+  }
+  void fill(size_t set, size_t way) { touch(set, way); }
+  size_t victim(size_t set)
+  {
+    size_t node = 1;
+    while (node < ways)
+      node = 2 * node + ((tree[set] >> node) & 1);
+    return node - ways;
+  }
+
+ private:
+  size_t ways;
+  std::vector<uint64_t> tree;
+};
+
+// Evicts the way filled longest ago, whatever hit it since.
+class fifo_policy_t : public repl_policy_t
+{
+ public:
+  fifo_policy_t(size_t sets, size_t ways) : ways(ways), next(sets) {}
+  const char* name() const { return "fifo"; }
+  repl_policy_t* clone() const { return new fifo_policy_t(*this); }
+  void touch(size_t set, size_t way) {}
+  void fill(size_t set, size_t way) { next[set] = (way + 1) % ways; }
+  size_t victim(size_t set) { return next[set]; }
+
+ private:
+  size_t ways;
+  std::vector<uint32_t> next;
+};
+
+// Re-reference interval prediction (Jaleel et al., ISCA 2010), with 2-bit
+// predictions.  Hits predict near re-reference, and the victim is a line
+// predicted distant.  Static RRIP fills lines with a long prediction, and
+// bimodal RRIP mostly with a distant one, so that lines used once don't
+// push out the working set.
+class rrip_policy_t : public repl_policy_t
+{
+ public:
+  rrip_policy_t(size_t sets, size_t ways, bool bimodal)
+    : ways(ways), bimodal(bimodal), rrpv(sets * ways, uint8_t(RRPV_MAX)) {}
+  const char* name() const { return bimodal ? "brrip" : "srrip"; }
+  repl_policy_t* clone() const { return new rrip_policy_t(*this); }
+  void touch(size_t set, size_t way) { rrpv[set * ways + way] = 0; }
+  void fill(size_t set, size_t way)
+  {
+    bool distant = bimodal && lfsr.next() % BRRIP_LONG_ODDS != 0;
+    rrpv[set * ways + way] = distant ? RRPV_MAX : RRPV_MAX - 1;
+  }
+  size_t victim(size_t set)
+  {
+    uint8_t* r = &rrpv[set * ways];
+    while (true) {
+      for (size_t i = 0; i < ways; i++)
+        if (r[i] == RRPV_MAX)
+          return i;
+      for (size_t i = 0; i < ways; i++)
+        r[i]++;
+    }
+  }
+
+ private:
+  static const uint8_t RRPV_MAX = 3;
+  static const uint32_t BRRIP_LONG_ODDS = 32;
+  size_t ways;
+  bool bimodal;
+  std::vector<uint8_t> rrpv;
+  lfsr_t lfsr;
+};
+
+// Evicts a pseudo-random way, valid or not, as the model always has.
+class random_policy_t : public repl_policy_t
+{
+ public:
+  random_policy_t(size_t ways) : ways(ways) {}
+  const char* name() const { return "random"; }
+  repl_policy_t* clone() const { return new random_policy_t(*this); }
+  void touch(size_t set, size_t way) {}
+  void fill(size_t set, size_t way) {}
+  size_t victim(size_t set) { return lfsr.next() % ways; }
+  bool fills_invalid_first() const { return false; }
+
+ private:
+  size_t ways;
+  lfsr_t lfsr;
+};
+
+repl_policy_t* repl_policy_t::construct(const std::string& name, size_t sets, size_t ways)
+{
+  if (name == "lru")
+    return ways <= 1 << 16 ? new lru_policy_t(sets, ways) : NULL;
+  if (name == "plru")
+    return ways <= 64 && (ways & (ways-1)) == 0 ? new plru_policy_t(sets, ways) : NULL;
+  if (name == "fifo")
+    return new fifo_policy_t(sets, ways);
+  if (name == "srrip" || name == "brrip")
+    return new rrip_policy_t(sets, ways, name == "brrip");
+  if (name == "random")
+    return new random_policy_t(ways);
+  return NULL;
+}
+
+cache_sim_t::cache_sim_t(size_t _sets, size_t _ways, size_t _linesz, const char* _name,
+                         const char* policy)
 : sets(_sets), ways(_ways), linesz(_linesz), name(_name), log(false)
 {
-  init();
+  init(policy);
 }
 
 static void help()
 {
   std::cerr << "Cache configurations must be of the form" << std::endl;
-  std::cerr << "  sets:ways:blocksize" << std::endl;
+  std::cerr << "  sets:ways:blocksize[:policy][:hit:miss]" << std::endl;
   std::cerr << "where sets, ways, and blocksize are positive integers, with" << std::endl;
   std::cerr << "sets and blocksize both powers of two and blocksize at least 8." << std::endl;
+  std::cerr << "The replacement policy is one of lru (at most 65536 ways), plru" << std::endl;
+  std::cerr << "(a power of two ways, at most 64), fifo, srrip, brrip and random," << std::endl;
+  std::cerr << "the default.  A hit takes hit cycles and a miss miss cycles and" << std::endl;
+  std::cerr << "those of the refill [default 0:0]." << std::endl;
   exit(1);
 }
 
@@ -31,18 +193,39 @@ cache_sim_t* cache_sim_t::construct(const char* config, const char* name)
   size_t sets = atoi(std::string(config, wp).c_str());
   size_t ways = atoi(std::string(wp, bp).c_str());
   size_t linesz = atoi(bp);
+  std::string policy = "random";
+  uint64_t hit = 0, miss = 0;
+  const char* pp = strchr(bp, ':');
+  // the policy, if any, comes before the latencies
+  if (pp && !isdigit((unsigned char)pp[1])) {
+    const char* hp = strchr(++pp, ':');
+    policy = hp ? std::string(pp, hp) : std::string(pp);
+    pp = hp;
+  }
+  if (pp) {
+    const char* mp = strchr(++pp, ':');
+    if (!mp++) help();
+    hit = strtoull(pp, NULL, 0);
+    miss = strtoull(mp, NULL, 0);
+  }
 
-  if (ways > 4 /* empirical */ && sets == 1)
-    return new fa_cache_sim_t(ways, linesz, name);
-  return new cache_sim_t(sets, ways, linesz, name);
+  cache_sim_t* cache;
+  if (ways > 4 /* empirical */ && sets == 1 && fa_cache_sim_t::supports(policy.c_str()))
+    cache = new fa_cache_sim_t(ways, linesz, name, policy.c_str());
+  else
+    cache = new cache_sim_t(sets, ways, linesz, name, policy.c_str());
+  cache->set_latency(hit, miss);
+  return cache;
 }
 
-void cache_sim_t::init()
+void cache_sim_t::init(const char* policy_name)
 {
   if(sets == 0 || (sets & (sets-1)))
     help();
   if(linesz < 8 || (linesz & (linesz-1)))
     help();
+  if(ways == 0 || !(policy = repl_policy_t::construct(policy_name, sets, ways)))
+    help();
 
   idx_shift = 0;
   for (size_t x = linesz; x>1; x >>= 1)
@@ -56,14 +239,19 @@ void cache_sim_t::init()
   write_misses = 0;
   bytes_written = 0;
   writebacks = 0;
+  evictions = 0;
+  hit_latency = 0;
+  miss_latency = 0;
 
   miss_handler = NULL;
 }
 
 cache_sim_t::cache_sim_t(const cache_sim_t& rhs)
  : sets(rhs.sets), ways(rhs.ways), linesz(rhs.linesz),
-   idx_shift(rhs.idx_shift), name(rhs.name), log(false)
+   idx_shift(rhs.idx_shift), hit_latency(rhs.hit_latency),
+   miss_latency(rhs.miss_latency), name(rhs.name), log(false)
 {
+  policy = rhs.policy->clone();
   tags = new uint64_t[sets*ways];
   memcpy(tags, rhs.tags, sets*ways*sizeof(uint64_t));
 }
@@ -72,6 +260,7 @@ cache_sim_t::~cache_sim_t()
 {
   print_stats();
   delete [] tags;
+  delete policy;
 }
 
 void cache_sim_t::print_stats()
@@ -97,6 +286,10 @@ void cache_sim_t::print_stats()
   std::cout << name << " ";
   std::cout << "Writebacks:            " << writebacks << std::endl;
   std::cout << name << " ";
+  std::cout << "Evictions:             " << evictions << std::endl;
+  std::cout << name << " ";
+  std::cout << "Replacement Policy:    " << policy->name() << std::endl;
+  std::cout << name << " ";
   std::cout << "Miss Rate:             " << mr << '%' << std::endl;
 }
 
@@ -115,13 +308,31 @@ uint64_t* cache_sim_t::check_tag(uint64_t addr)
 uint64_t cache_sim_t::victimize(uint64_t addr)
 {
   size_t idx = (addr >> idx_shift) & (sets-1);
-  size_t way = lfsr.next() % ways;
+  size_t way = ways;
+  if (policy->fills_invalid_first())
+    for (size_t i = 0; i < ways && way == ways; i++)
+      if (!(tags[idx*ways + i] & VALID))
+        way = i;
+  if (way == ways)
+    way = policy->victim(idx);
+  policy->fill(idx, way);
   uint64_t victim = tags[idx*ways + way];
   tags[idx*ways + way] = (addr >> idx_shift) | VALID;
   return victim;
 }
 
-void cache_sim_t::access(uint64_t addr, size_t bytes, bool store)
+void cache_sim_t::touch(uint64_t addr, uint64_t* line)
+{
+  size_t idx = (addr >> idx_shift) & (sets-1);
+  policy->touch(idx, line - &tags[idx*ways]);
+}
+
+uint64_t cache_sim_t::next_level(uint64_t addr, size_t bytes, bool store)
+{
+  return miss_handler ? miss_handler->access(addr, bytes, store) : 0;
+}
+
+uint64_t cache_sim_t::access(uint64_t addr, size_t bytes, bool store)
 {
   store ? write_accesses++ : read_accesses++;
   (store ? bytes_written : bytes_read) += bytes;
@@ -131,7 +342,8 @@ void cache_sim_t::access(uint64_t addr, size_t bytes, bool store)
   {
     if (store)
       *hit_way |= DIRTY;
-    return;
+    touch(addr, hit_way);
+    return hit_latency;
   }
 
   store ? write_misses++ : read_misses++;
@@ -143,43 +355,83 @@ void cache_sim_t::access(uint64_t addr, size_t bytes, bool store)
   }
 
   uint64_t victim = victimize(addr);
+  if (victim & VALID)
+    evictions++;
 
   if ((victim & (VALID | DIRTY)) == (VALID | DIRTY))
   {
     uint64_t dirty_addr = (victim & ~(VALID | DIRTY)) << idx_shift;
-    if (miss_handler)
-      miss_handler->access(dirty_addr, linesz, true);
+    next_level(dirty_addr, linesz, true);
     writebacks++;
   }
 
-  if (miss_handler)
-    miss_handler->access(addr & ~(linesz-1), linesz, false);
+  // writebacks are buffered, so only the refill holds up the access
+  uint64_t latency = next_level(addr & ~(linesz-1), linesz, false);
 
   if (store)
     *check_tag(addr) |= DIRTY;
+  return miss_latency + latency;
 }
 
-fa_cache_sim_t::fa_cache_sim_t(size_t ways, size_t linesz, const char* name)
-  : cache_sim_t(1, ways, linesz, name)
+const uint32_t fa_cache_sim_t::NIL;
+
+fa_cache_sim_t::fa_cache_sim_t(size_t ways, size_t linesz, const char* name, const char* policy)
+  : cache_sim_t(1, ways, linesz, name, policy),
+    lru(strcmp(policy, "lru") == 0), random(strcmp(policy, "random") == 0),
+    used(0), prev(ways, NIL), next(ways, NIL), head(NIL), tail(NIL)
+{
+  slots.reserve(ways);
+}
+
+bool fa_cache_sim_t::supports(const char* policy)
 {
+  return strcmp(policy, "lru") == 0 || strcmp(policy, "fifo") == 0 ||
+         strcmp(policy, "random") == 0;
+}
+
+void fa_cache_sim_t::unlink(uint32_t slot)
+{
+  (prev[slot] == NIL ? head : next[prev[slot]]) = next[slot];
+  (next[slot] == NIL ? tail : prev[next[slot]]) = prev[slot];
+}
+
+void fa_cache_sim_t::push_front(uint32_t slot)
+{
+  prev[slot] = NIL;
+  next[slot] = head;
+  (head == NIL ? tail : prev[head]) = slot;
+  head = slot;
 }
 
 uint64_t* fa_cache_sim_t::check_tag(uint64_t addr)
 {
-  auto it = tags.find(addr >> idx_shift);
-  return it == tags.end() ? NULL : &it->second;
+  auto it = slots.find(addr >> idx_shift);
+  return it == slots.end() ? NULL : &tags[it->second];
+}
+
+void fa_cache_sim_t::touch(uint64_t addr, uint64_t* line)
+{
+  if (lru) {
+    uint32_t slot = line - tags;
+    unlink(slot);
+    push_front(slot);
+  }
 }
 
 uint64_t fa_cache_sim_t::victimize(uint64_t addr)
 {
+  uint32_t slot;
   uint64_t old_tag = 0;
-  if (tags.size() == ways)
-  {
-    auto it = tags.begin();
-    std::advance(it, lfsr.next() % ways);
-    old_tag = it->second;
-    tags.erase(it);
+  if (used < ways) {
+    slot = used++;
+  } else {
+    slot = random ? lfsr.next() % ways : tail;
+    old_tag = tags[slot];
+    slots.erase(old_tag & ~(VALID | DIRTY));
+    unlink(slot);
   }
-  tags[addr >> idx_shift] = (addr >> idx_shift) | VALID;
+  tags[slot] = (addr >> idx_shift) | VALID;
+  slots[addr >> idx_shift] = slot;
+  push_front(slot);
   return old_tag;
 }
@@ -6,7 +6,8 @@
 #include "memtracer.h"
 #include <cstring>
 #include <string>
-#include <map>
+#include <unordered_map>
+#include <vector>
 #include <cstdint>
 
 class lfsr_t
@@ -19,18 +20,55 @@ class lfsr_t
   uint32_t reg;
 };
 
-class cache_sim_t
+// Chooses the way of a set to evict.  A policy keeps a few bits of state
+// for each set or line, and is told of every hit and fill, each costing at
+// most O(ways).
+class repl_policy_t
 {
  public:
-  cache_sim_t(size_t sets, size_t ways, size_t linesz, const char* name);
+  virtual ~repl_policy_t() {}
+  virtual const char* name() const = 0;
+  virtual repl_policy_t* clone() const = 0;
+  virtual void touch(size_t set, size_t way) = 0; // on a hit
+  virtual void fill(size_t set, size_t way) = 0; // way was just refilled
+  virtual size_t victim(size_t set) = 0;
+  // whether invalid ways are filled before anything is evicted
+  virtual bool fills_invalid_first() const { return true; }
+
+  // NULL if the policy is unknown or can't manage sets of that many ways
+  static repl_policy_t* construct(const std::string& name, size_t sets, size_t ways);
+};
+
+// A level of the modelled memory hierarchy: a cache, or whatever serves
+// its misses.  access returns the cycles the request takes beyond those a
+// hit in the level above would.
+class mem_model_t
+{
+ public:
+  virtual ~mem_model_t() {}
+  virtual uint64_t access(uint64_t addr, size_t bytes, bool store) = 0;
+};
+
+class cache_sim_t : public mem_model_t
+{
+ public:
+  cache_sim_t(size_t sets, size_t ways, size_t linesz, const char* name,
+              const char* policy = "random");
   cache_sim_t(const cache_sim_t& rhs);
   virtual ~cache_sim_t();
 
-  void access(uint64_t addr, size_t bytes, bool store);
+  // a hit takes hit_latency cycles; a miss, miss_latency and those of the
+  // refill
+  uint64_t access(uint64_t addr, size_t bytes, bool store);
   void print_stats();
-  void set_miss_handler(cache_sim_t* mh) { miss_handler = mh; }
+  void set_miss_handler(mem_model_t* mh) { miss_handler = mh; }
+  void set_latency(uint64_t hit, uint64_t miss) { hit_latency = hit; miss_latency = miss; }
   void set_log(bool _log) { log = _log; }
+  const std::string& get_name() const { return name; }
+  uint64_t get_accesses() const { return read_accesses + write_accesses; }
+  uint64_t get_misses() const { return read_misses + write_misses; }
 
+  // from sets:ways:blocksize[:policy][:hit:miss]
   static cache_sim_t* construct(const char* config, const char* name);
 
  protected:
@@ -39,14 +77,21 @@ class cache_sim_t
 
   virtual uint64_t* check_tag(uint64_t addr);
   virtual uint64_t victimize(uint64_t addr);
+  // line, found by check_tag(addr), was hit
+  virtual void touch(uint64_t addr, uint64_t* line);
+  // passes a writeback or refill to the miss handler, returning its cycles
+  virtual uint64_t next_level(uint64_t addr, size_t bytes, bool store);
 
   lfsr_t lfsr;
-  cache_sim_t* miss_handler;
+  repl_policy_t* policy;
+  mem_model_t* miss_handler;
 
   size_t sets;
   size_t ways;
   size_t linesz;
   size_t idx_shift;
+  uint64_t hit_latency;
+  uint64_t miss_latency;
 
   uint64_t* tags;
   
@@ -57,28 +102,45 @@ class cache_sim_t
   uint64_t write_misses;
   uint64_t bytes_written;
   uint64_t writebacks;
+  uint64_t evictions;
 
   std::string name;
   bool log;
 
-  void init();
+  void init(const char* policy_name);
 };
 
+// A fully associative cache with LRU, FIFO or random replacement, all in
+// O(1): a hash map finds a line's slot in tags, and the slots are kept on
+// a doubly-linked list, most recently used or filled first.
 class fa_cache_sim_t : public cache_sim_t
 {
  public:
-  fa_cache_sim_t(size_t ways, size_t linesz, const char* name);
+  fa_cache_sim_t(size_t ways, size_t linesz, const char* name, const char* policy);
   uint64_t* check_tag(uint64_t addr);
   uint64_t victimize(uint64_t addr);
+  void touch(uint64_t addr, uint64_t* line);
+
+  static bool supports(const char* policy);
+
  private:
-  static bool cmp(uint64_t a, uint64_t b);
-  std::map<uint64_t, uint64_t> tags;
+  void unlink(uint32_t slot);
+  void push_front(uint32_t slot);
+
+  bool lru;
+  bool random;
+  size_t used; // slots filled so far
+  std::unordered_map<uint64_t, uint32_t> slots;
+  std::vector<uint32_t> prev, next; // list links; NIL ends the list
+  uint32_t head, tail;
+  static const uint32_t NIL = UINT32_MAX;
 };
 
 class cache_memtracer_t : public memtracer_t
 {
  public:
   cache_memtracer_t(const char* config, const char* name)
+    : enabled(true)
   {
     cache = cache_sim_t::construct(config, name);
   }
@@ -86,7 +148,7 @@ class cache_memtracer_t : public memtracer_t
   {
     delete cache;
   }
-  void set_miss_handler(cache_sim_t* mh)
+  void set_miss_handler(mem_model_t* mh)
   {
     cache->set_miss_handler(mh);
   }
@@ -94,9 +156,14 @@ class cache_memtracer_t : public memtracer_t
   {
     cache->set_log(log);
   }
+  cache_sim_t* get_cache() { return cache; }
+  // A disabled model sees no accesses.  MMUs only consult tracers when
+  // they refill their TLBs, so they must be flushed after a change.
+  void set_enabled(bool value) { enabled = value; }
 
  protected:
   cache_sim_t* cache;
+  bool enabled;
 };
 
 class icache_sim_t : public cache_memtracer_t
@@ -105,11 +172,15 @@ class icache_sim_t : public cache_memtracer_t
   icache_sim_t(const char* config) : cache_memtracer_t(config, "I$") {}
   bool interested_in_range(uint64_t begin, uint64_t end, access_type type)
   {
-    return type == FETCH;
+    return enabled && type == FETCH;
   }
   void trace(uint64_t addr, size_t bytes, access_type type)
   {
-    if (type == FETCH) cache->access(addr, bytes, false);
+    trace_stall(addr, bytes, type);
+  }
+  uint64_t trace_stall(uint64_t addr, size_t bytes, access_type type)
+  {
+    return type == FETCH ? cache->access(addr, bytes, false) : 0;
   }
 };
 
@@ -119,12 +190,41 @@ class dcache_sim_t : public cache_memtracer_t
   dcache_sim_t(const char* config) : cache_memtracer_t(config, "D$") {}
   bool interested_in_range(uint64_t begin, uint64_t end, access_type type)
   {
-    return type == LOAD || type == STORE;
+    return enabled && (type == LOAD || type == STORE);
+  }
+  void trace(uint64_t addr, size_t bytes, access_type type)
+  {
+    trace_stall(addr, bytes, type);
+  }
+  uint64_t trace_stall(uint64_t addr, size_t bytes, access_type type)
+  {
+    if (type == LOAD || type == STORE)
+      return cache->access(addr, bytes, type == STORE);
+    return 0;
+  }
+};
+
+// Sends every access straight to a memory model, as a hart without
+// caches would.
+class uncached_memtracer_t : public memtracer_t
+{
+ public:
+  uncached_memtracer_t(mem_model_t* mem) : mem(mem) {}
+  bool interested_in_range(uint64_t begin, uint64_t end, access_type type)
+  {
+    return true;
   }
   void trace(uint64_t addr, size_t bytes, access_type type)
   {
-    if (type == LOAD || type == STORE) cache->access(addr, bytes, type == STORE);
+    trace_stall(addr, bytes, type);
   }
+  uint64_t trace_stall(uint64_t addr, size_t bytes, access_type type)
+  {
+    return mem->access(addr, bytes, type == STORE);
+  }
+
+ private:
+  mem_model_t* mem;
 };
 
 #endif
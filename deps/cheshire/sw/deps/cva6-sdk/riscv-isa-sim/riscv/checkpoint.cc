@@ -0,0 +1,453 @@
+// See LICENSE for license details.
+
+#include "checkpoint.h"
+#include "sim.h"
+#include "mmu.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void checkpoint_section_t::put_bytes(const std::string& name, const void* bytes, size_t len)
+{
+  values[name] = std::string((const char*)bytes, len);
+}
+
+const std::string& checkpoint_section_t::find(const std::string& name) const
+{
+  auto it = values.find(name);
+  if (it == values.end())
+    throw std::runtime_error("checkpoint has no value for " + name);
+  return it->second;
+}
+
+void checkpoint_section_t::get_bytes(const std::string& name, void* bytes, size_t len) const
+{
+  const std::string& value = find(name);
+  if (value.size() != len)
+    throw std::runtime_error("checkpoint value for " + name + " has the wrong size");
+  memcpy(bytes, value.data(), len);
+}
+
+void checkpoint_section_t::put_string(const std::string& name, const std::string& value)
+{
+  values[name] = value;
+}
+
+std::string checkpoint_section_t::get_string(const std::string& name) const
+{
+  return find(name);
+}
+
+void checkpoint_section_t::save(const std::string& path) const
+{
+  static const char digits[] = "0123456789abcdef";
+  std::ofstream out(path);
+  for (auto& value : values) {
+    out << value.first << ' ';
+    for (unsigned char c : value.second)
+      out << digits[c >> 4] << digits[c & 15];
+    out << '\n';
+  }
+  if (!out.good())
+    throw std::runtime_error("could not write " + path);
+}
+
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+void checkpoint_section_t::load(const std::string& path)
+{
+  std::ifstream in(path);
+  if (!in.good())
+    throw std::runtime_error("could not read " + path);
+
+  values.clear();
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t space = line.find(' ');
+    if (space == std::string::npos || (line.size() - space - 1) % 2 != 0)
+      throw std::runtime_error("malformed line in " + path);
+
+    std::string bytes;
+    for (size_t i = space + 1; i < line.size(); i += 2) {
+      int hi = hex_digit(line[i]), lo = hex_digit(line[i + 1]);
+      if (hi < 0 || lo < 0)
+        throw std::runtime_error("malformed line in " + path);
+      bytes.push_back(char(hi << 4 | lo));
+    }
+    values[line.substr(0, space)] = bytes;
+  }
+}
+
+#define CHECKPOINT_STATE_FIELDS(F) \
+  F(pc) F(XPR) F(FPR) \
+  F(prv) F(v) F(misa) F(mstatus) F(mepc) F(mtval) F(mscratch) F(mtvec) \
+  F(mcause) F(minstret) F(mcycle) F(mie) F(mip) F(medeleg) F(mideleg) \
+  F(mcounteren) F(scounteren) F(sepc) F(stval) F(sscratch) F(stvec) \
+  F(satp) F(scause) \
+  F(mtval2) F(mtinst) F(hstatus) F(hideleg) F(hedeleg) F(hcounteren) \
+  F(htval) F(htinst) F(hgatp) F(vsstatus) F(vstvec) F(vsscratch) F(vsepc) \
+  F(vscause) F(vstval) F(vsatp) \
+  F(dpc) F(dscratch0) F(dscratch1) F(dcsr) F(tselect) F(mcontrol) F(tdata2) \
+  F(debug_mode) F(pmpcfg) F(pmpaddr) F(fflags) F(frm) F(serialized) \
+  F(single_step)
+
+#define CHECKPOINT_VU_FIELDS(F) \
+  F(setvl_count) F(vlmax) F(vstart) F(vxrm) F(vxsat) F(vl) F(vtype) \
+  F(vlenb) F(vma) F(vta) F(vsew) F(vflmul) F(ELEN) F(VLEN) F(vill) \
+  F(vstart_alu)
+
+void processor_t::save(checkpoint_section_t& cp)
+{
+  cp.put_string("isa", isa_string);
+#define SAVE_STATE(name) cp.put(#name, state.name);
+  CHECKPOINT_STATE_FIELDS(SAVE_STATE)
+#undef SAVE_STATE
+  cp.put("xlen", xlen);
+  cp.put("halt_request", halt_request);
+  cp.put("in_wfi", in_wfi);
+  reg_t mip_lines = state.mip_lines;
+  cp.put("mip_lines", mip_lines);
+
+#define SAVE_VU(name) cp.put("VU." #name, VU.name);
+  CHECKPOINT_VU_FIELDS(SAVE_VU)
+#undef SAVE_VU
+  cp.put_bytes("VU.reg_file", VU.reg_file, NVPR * VU.vlenb);
+}
+
+void processor_t::restore(const checkpoint_section_t& cp)
+{
+  if (cp.get_string("isa") != isa_string)
+    throw std::runtime_error("checkpoint was saved with a different ISA");
+#define RESTORE_STATE(name) cp.get(#name, state.name);
+  CHECKPOINT_STATE_FIELDS(RESTORE_STATE)
+#undef RESTORE_STATE
+  cp.get("xlen", xlen);
+  cp.get("halt_request", halt_request);
+  cp.get("in_wfi", in_wfi);
+  reg_t mip_lines;
+  cp.get("mip_lines", mip_lines);
+  state.mip_lines = mip_lines;
+
+#define RESTORE_VU(name) cp.get("VU." #name, VU.name);
+  CHECKPOINT_VU_FIELDS(RESTORE_VU)
+#undef RESTORE_VU
+  cp.get_bytes("VU.reg_file", VU.reg_file, NVPR * VU.vlenb);
+
+  // drop translations and decoded instructions of the old state
+  trigger_updated();
+}
+
+void clint_t::save(checkpoint_section_t& cp)
+{
+  cp.put("mtime", mtime);
+  for (size_t i = 0; i < procs.size(); i++)
+    cp.put("mtimecmp" + std::to_string(i), mtimecmp[i]);
+}
+
+void clint_t::restore(const checkpoint_section_t& cp)
+{
+  cp.get("mtime", mtime);
+  for (size_t i = 0; i < procs.size(); i++)
+    cp.get("mtimecmp" + std::to_string(i), mtimecmp[i]);
+}
+
+void plic_t::save(checkpoint_section_t& cp)
+{
+  cp.put_bytes("priority", priority.data(), priority.size() * sizeof(priority[0]));
+  cp.put_bytes("level", level.data(), level.size());
+  cp.put_bytes("pending", pending.data(), pending.size());
+  cp.put_bytes("claimed", claimed.data(), claimed.size());
+  for (size_t i = 0; i < contexts.size(); i++) {
+    cp.put_bytes("enable" + std::to_string(i), contexts[i].enable.data(), contexts[i].enable.size());
+    cp.put("threshold" + std::to_string(i), contexts[i].threshold);
+  }
+}
+
+void plic_t::restore(const checkpoint_section_t& cp)
+{
+  cp.get_bytes("priority", priority.data(), priority.size() * sizeof(priority[0]));
+  cp.get_bytes("level", level.data(), level.size());
+  cp.get_bytes("pending", pending.data(), pending.size());
+  cp.get_bytes("claimed", claimed.data(), claimed.size());
+  for (size_t i = 0; i < contexts.size(); i++) {
+    cp.get_bytes("enable" + std::to_string(i), contexts[i].enable.data(), contexts[i].enable.size());
+    cp.get("threshold" + std::to_string(i), contexts[i].threshold);
+  }
+}
+
+void mmio_plugin_device_t::save(checkpoint_section_t& cp)
+{
+  if (!v2 || !plugin_v2.save) {
+    fprintf(stderr, "warning: state of MMIO plugin %s is not saved in the checkpoint\n",
+            name.c_str());
+    return;
+  }
+
+  std::string state;
+  (*plugin_v2.save)(user_data, &state, [](void* state, const uint8_t* bytes, size_t len) {
+    static_cast<std::string*>(state)->append(reinterpret_cast<const char*>(bytes), len);
+  });
+  cp.put("tick_time", tick_time);
+  cp.put_string("state", state);
+}
+
+void mmio_plugin_device_t::restore(const checkpoint_section_t& cp)
+{
+  if (!v2 || !plugin_v2.save)
+    return;
+
+  cp.get("tick_time", tick_time);
+  post_tick();
+  std::string state = cp.get_string("state");
+  if (!plugin_v2.restore ||
+      !(*plugin_v2.restore)(user_data, reinterpret_cast<const uint8_t*>(state.data()), state.size()))
+    throw std::runtime_error("MMIO plugin " + name + " could not restore its state");
+}
+
+void debug_module_t::save(checkpoint_section_t& cp)
+{
+  cp.put("debug_rom_whereto", debug_rom_whereto);
+  cp.put("debug_abstract", debug_abstract);
+  cp.put_bytes("program_buffer", program_buffer, program_buffer_bytes);
+  cp.put("dmdata", dmdata);
+  cp.put_bytes("hart_state", hart_state.data(), hart_state.size() * sizeof(hart_debug_state_t));
+  cp.put("debug_rom_flags", debug_rom_flags);
+  cp.put("dmcontrol", dmcontrol);
+  cp.put("dmstatus", dmstatus);
+  cp.put("abstractcs", abstractcs);
+  cp.put("abstractauto", abstractauto);
+  cp.put("command", command);
+  cp.put("hawindowsel", hawindowsel);
+  std::string mask(hart_array_mask.begin(), hart_array_mask.end());
+  cp.put_string("hart_array_mask", mask);
+  cp.put("sbcs", sbcs);
+  cp.put("sbaddress", sbaddress);
+  cp.put("sbdata", sbdata);
+  cp.put("challenge", challenge);
+  cp.put("abstract_command_completed", abstract_command_completed);
+  cp.put("rti_remaining", rti_remaining);
+}
+
+void debug_module_t::restore(const checkpoint_section_t& cp)
+{
+  cp.get("debug_rom_whereto", debug_rom_whereto);
+  cp.get("debug_abstract", debug_abstract);
+  cp.get_bytes("program_buffer", program_buffer, program_buffer_bytes);
+  cp.get("dmdata", dmdata);
+  cp.get_bytes("hart_state", hart_state.data(), hart_state.size() * sizeof(hart_debug_state_t));
+  cp.get("debug_rom_flags", debug_rom_flags);
+  cp.get("dmcontrol", dmcontrol);
+  cp.get("dmstatus", dmstatus);
+  cp.get("abstractcs", abstractcs);
+  cp.get("abstractauto", abstractauto);
+  cp.get("command", command);
+  cp.get("hawindowsel", hawindowsel);
+  std::string mask = cp.get_string("hart_array_mask");
+  if (mask.size() != hart_array_mask.size())
+    throw std::runtime_error("checkpoint value for hart_array_mask has the wrong size");
+  hart_array_mask.assign(mask.begin(), mask.end());
+  cp.get("sbcs", sbcs);
+  cp.get("sbaddress", sbaddress);
+  cp.get("sbdata", sbdata);
+  cp.get("challenge", challenge);
+  cp.get("abstract_command_completed", abstract_command_completed);
+  cp.get("rti_remaining", rti_remaining);
+}
+
+static bool is_zero_page(const char* page)
+{
+  const uint64_t* words = (const uint64_t*)page;
+  for (size_t i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+    if (words[i])
+      return false;
+  return true;
+}
+
+// The image is a file of the region's size in which only pages holding
+// nonzero bytes are written; the others are left as holes.
+// The image is written beside the old one and renamed over it, since the
+// old one may be mapped as this very region by restore_image.
+void mem_t::save_image(const std::string& path)
+{
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    throw std::runtime_error("could not create " + tmp_path);
+
+  bool ok = ftruncate(fd, sz) == 0;
+  if (data) {
+    for (reg_t addr = 0; ok && addr < sz; addr += PGSIZE)
+      if (!is_zero_page(data + addr))
+        ok = pwrite(fd, data + addr, PGSIZE, addr) == PGSIZE;
+  } else {
+    for (auto& entry : sparse_memory_map)
+      if (ok && !is_zero_page(entry.second))
+        ok = pwrite(fd, entry.second, PGSIZE, entry.first << PGSHIFT) == PGSIZE;
+  }
+
+  if (close(fd) != 0 || !ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    throw std::runtime_error("could not write " + path);
+  }
+}
+
+// The image is mapped privately in place of the region's contents, so
+// pages are read in as they are touched and copied when first written.
+void mem_t::restore_image(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("could not read " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || reg_t(st.st_size) != sz) {
+    close(fd);
+    throw std::runtime_error(path + " does not match the size of its memory region");
+  }
+
+  bool ok = true;
+  if (data) {
+    void* res = mmap(data, sz, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, 0);
+    ok = res != MAP_FAILED;
+  } else {
+    for (auto& entry : sparse_memory_map)
+      free(entry.second);
+    sparse_memory_map.clear();
+
+    char page[PGSIZE];
+    for (off_t pos = 0; ok && reg_t(pos) < sz; pos += PGSIZE) {
+#ifdef SEEK_DATA
+      // skip the holes of an image written by save_image
+      pos = lseek(fd, pos, SEEK_DATA);
+      if (pos < 0)
+        break;
+      pos &= ~off_t(PGSIZE - 1);
+#endif
+      ok = pread(fd, page, PGSIZE, pos) == PGSIZE;
+      if (ok && !is_zero_page(page))
+        memcpy(sparse_contents(pos), page, PGSIZE);
+    }
+  }
+
+  close(fd);
+  if (!ok)
+    throw std::runtime_error("could not read " + path);
+}
+
+static std::string hex_name(const char* prefix, reg_t addr)
+{
+  std::ostringstream s;
+  s << prefix << std::hex << addr;
+  return s.str();
+}
+
+void sim_t::set_checkpoint(reg_t steps, const std::string& dir)
+{
+  checkpoint_steps = steps;
+  checkpoint_dir = dir;
+}
+
+void sim_t::set_restore(const std::string& dir)
+{
+  restore_dir = dir;
+}
+
+// Checkpoints are taken between rounds of the scheduler, when every hart
+// has run the same number of instructions and no load reservation is held.
+void sim_t::save_checkpoint(const std::string& dir)
+{
+  if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+    throw std::runtime_error("could not create " + dir);
+
+  checkpoint_section_t machine;
+  machine.put("nprocs", procs.size());
+  machine.put("steps_per_hart", steps_per_hart);
+  machine.save(dir + "/machine");
+
+  for (size_t i = 0; i < procs.size(); i++) {
+    checkpoint_section_t hart;
+    procs[i]->save(hart);
+    hart.save(dir + "/hart" + std::to_string(i));
+  }
+
+  checkpoint_section_t clint_state;
+  clint->save(clint_state);
+  clint_state.save(dir + "/clint");
+
+  if (plic) {
+    checkpoint_section_t plic_state;
+    plic->save(plic_state);
+    plic_state.save(dir + "/plic");
+  }
+
+  checkpoint_section_t debug_state;
+  debug_module.save(debug_state);
+  debug_state.save(dir + "/debug");
+
+  for (auto& dev : plugin_devices) {
+    checkpoint_section_t dev_state;
+    dev.second->save(dev_state);
+    dev_state.save(dir + "/" + hex_name("device-", dev.first));
+  }
+
+  for (auto& mem : mems)
+    mem.second->save_image(dir + "/" + hex_name("mem-", mem.first));
+}
+
+void sim_t::restore_checkpoint(const std::string& dir)
+{
+  checkpoint_section_t machine;
+  machine.load(dir + "/machine");
+  size_t saved_nprocs;
+  machine.get("nprocs", saved_nprocs);
+  if (saved_nprocs != procs.size())
+    throw std::runtime_error("checkpoint was saved with " + std::to_string(saved_nprocs) + " harts");
+  machine.get("steps_per_hart", steps_per_hart);
+  current_step = 0;
+  current_proc = 0;
+
+  for (auto& mem : mems)
+    mem.second->restore_image(dir + "/" + hex_name("mem-", mem.first));
+  debug_mmu->flush_tlb();
+
+  for (size_t i = 0; i < procs.size(); i++) {
+    checkpoint_section_t hart;
+    hart.load(dir + "/hart" + std::to_string(i));
+    procs[i]->restore(hart);
+  }
+
+  checkpoint_section_t clint_state;
+  clint_state.load(dir + "/clint");
+  clint->restore(clint_state);
+
+  if (plic) {
+    checkpoint_section_t plic_state;
+    plic_state.load(dir + "/plic");
+    plic->restore(plic_state);
+  }
+
+  checkpoint_section_t debug_state;
+  debug_state.load(dir + "/debug");
+  debug_module.restore(debug_state);
+
+  for (auto& dev : plugin_devices) {
+    checkpoint_section_t dev_state;
+    dev_state.load(dir + "/" + hex_name("device-", dev.first));
+    dev.second->restore(dev_state);
+  }
+}
@@ -0,0 +1,41 @@
+// See LICENSE for license details.
+#ifndef _RISCV_CHECKPOINT_H
+#define _RISCV_CHECKPOINT_H
+
+#include <map>
+#include <string>
+#include <type_traits>
+
+// One file of a checkpoint: named values, each stored as a line holding
+// the name and the value's bytes in hex.  Values are saved as laid out in
+// memory, so a checkpoint can only be restored by the same simulator build
+// and configuration that saved it.  Restoring a value the section lacks,
+// or one of a different size, throws std::runtime_error.
+class checkpoint_section_t
+{
+ public:
+  template<typename T> void put(const std::string& name, const T& value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be saved");
+    put_bytes(name, &value, sizeof(T));
+  }
+  template<typename T> void get(const std::string& name, T& value) const
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be restored");
+    get_bytes(name, &value, sizeof(T));
+  }
+  void put_bytes(const std::string& name, const void* bytes, size_t len);
+  void get_bytes(const std::string& name, void* bytes, size_t len) const;
+  void put_string(const std::string& name, const std::string& value);
+  std::string get_string(const std::string& name) const;
+
+  void save(const std::string& path) const;
+  void load(const std::string& path);
+
+ private:
+  const std::string& find(const std::string& name) const;
+
+  std::map<std::string, std::string> values;
+};
+
+#endif
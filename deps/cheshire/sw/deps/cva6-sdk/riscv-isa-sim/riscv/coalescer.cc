@@ -0,0 +1,199 @@
+// See LICENSE for license details.
+
+#include "coalescer.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+coalescer_t::coalescer_t(size_t depth, size_t write_burst, size_t read_burst, uint64_t window)
+  : write_burst(write_burst), read_burst(read_burst), window(window),
+    entries(depth), read_base(-1), now(0), miss_handler(NULL),
+    writes(0), merged_writes(0), reads(0), read_buffer_hits(0),
+    forwarded_reads(0), bursts(0), burst_bytes(0), full_flushes(0),
+    window_flushes(0), eviction_flushes(0), conflict_flushes(0)
+{
+  for (auto& e : entries) {
+    e.valid = false;
+    e.written.resize(write_burst / WORD);
+  }
+}
+
+coalescer_t::~coalescer_t()
+{
+  if (writes + reads == 0)
+    return;
+
+  std::cout << std::setprecision(3) << std::fixed;
+  std::cout << "CoalBuf " << "Writes:                " << writes << std::endl;
+  std::cout << "CoalBuf " << "Merged Writes:         " << merged_writes << std::endl;
+  std::cout << "CoalBuf " << "Reads:                 " << reads << std::endl;
+  std::cout << "CoalBuf " << "Read Buffer Hits:      " << read_buffer_hits << std::endl;
+  std::cout << "CoalBuf " << "Forwarded Reads:       " << forwarded_reads << std::endl;
+  std::cout << "CoalBuf " << "Bursts Written:        " << bursts << std::endl;
+  std::cout << "CoalBuf " << "Full Flushes:          " << full_flushes << std::endl;
+  std::cout << "CoalBuf " << "Window Flushes:        " << window_flushes << std::endl;
+  std::cout << "CoalBuf " << "Eviction Flushes:      " << eviction_flushes << std::endl;
+  std::cout << "CoalBuf " << "Conflict Flushes:      " << conflict_flushes << std::endl;
+  std::cout << "CoalBuf " << "Average Burst Length:  "
+            << (bursts ? double(burst_bytes) / bursts : 0.0) << " B" << std::endl;
+  std::cout << "CoalBuf " << "BUF_W_STALL Cycles:    "
+            << in.count[axi_counters_t::BUF_W_STALL] << std::endl;
+  std::cout << "CoalBuf " << "BUF_R_STALL Cycles:    "
+            << in.count[axi_counters_t::BUF_R_STALL] << std::endl;
+}
+
+static void help()
+{
+  std::cerr << "Coalescing buffer configurations must be of the form" << std::endl;
+  std::cerr << "  depth[:write_burst[:read_burst[:window]]]" << std::endl;
+  std::cerr << "where depth is the number of write entries, at least 1, and" << std::endl;
+  std::cerr << "write_burst [default 256] and read_burst [default 512] are the" << std::endl;
+  std::cerr << "bytes an entry and the read buffer hold, powers of two and at" << std::endl;
+  std::cerr << "least 8, or 0 for read_burst to pass reads through.  An entry" << std::endl;
+  std::cerr << "is written out window transactions after it is opened [default" << std::endl;
+  std::cerr << "16], or only when full or evicted if window is 0." << std::endl;
+  exit(1);
+}
+
+coalescer_t* coalescer_t::construct(const char* config)
+{
+  char* end;
+  unsigned long depth = strtoul(config, &end, 0);
+  unsigned long write_burst = 256, read_burst = 512, window = 16;
+  if (*end == ':')
+    write_burst = strtoul(end + 1, &end, 0);
+  if (*end == ':')
+    read_burst = strtoul(end + 1, &end, 0);
+  if (*end == ':')
+    window = strtoul(end + 1, &end, 0);
+
+  if (*end || depth < 1 ||
+      write_burst < WORD || (write_burst & (write_burst - 1)) ||
+      (read_burst && (read_burst < WORD || (read_burst & (read_burst - 1)))))
+    help();
+  return new coalescer_t(depth, write_burst, read_burst, window);
+}
+
+uint64_t coalescer_t::next_level(uint64_t addr, size_t bytes, bool store)
+{
+  return miss_handler ? miss_handler->access(addr, bytes, store) : 0;
+}
+
+uint64_t coalescer_t::access(uint64_t addr, size_t bytes, bool store)
+{
+  now++;
+  for (auto& e : entries) {
+    if (window && e.valid && now - e.opened >= window) {
+      flush(e);
+      window_flushes++;
+    }
+  }
+
+  // split at burst boundaries, so each piece falls in one entry and in one
+  // refill of the read buffer
+  size_t burst = read_burst ? std::min(write_burst, read_burst) : write_burst;
+  uint64_t latency = 0;
+  while (bytes) {
+    size_t n = std::min<uint64_t>(bytes, burst - addr % burst);
+    latency += store ? write(addr, n) : read(addr, n);
+    addr += n;
+    bytes -= n;
+  }
+  return latency;
+}
+
+coalescer_t::entry_t* coalescer_t::find(uint64_t base)
+{
+  for (auto& e : entries)
+    if (e.valid && e.base == base)
+      return &e;
+  return NULL;
+}
+
+uint64_t coalescer_t::flush(entry_t& e)
+{
+  size_t lo = std::find(e.written.begin(), e.written.end(), true) - e.written.begin();
+  size_t hi = e.written.rend() - std::find(e.written.rbegin(), e.written.rend(), true);
+  uint64_t bytes = (hi - lo) * WORD;
+
+  bursts++;
+  burst_bytes += bytes;
+  e.valid = false;
+  return next_level(e.base + lo * WORD, bytes, true);
+}
+
+uint64_t coalescer_t::write(uint64_t addr, size_t bytes)
+{
+  writes++;
+  in.write(bytes);
+
+  // the read buffer's copy is stale once the write reaches memory
+  if (read_base != uint64_t(-1) && addr < read_base + read_burst && addr + bytes > read_base)
+    read_base = -1;
+
+  uint64_t base = addr - addr % write_burst;
+  uint64_t stall = 0;
+  entry_t* e = find(base);
+  if (e) {
+    merged_writes++;
+  } else {
+    for (auto& slot : entries)
+      if (!slot.valid && !e)
+        e = &slot;
+    if (!e) {
+      e = &*std::min_element(entries.begin(), entries.end(),
+                             [](const entry_t& a, const entry_t& b) { return a.opened < b.opened; });
+      stall = flush(*e);
+      eviction_flushes++;
+      in.count[axi_counters_t::BUF_W_STALL] += stall;
+    }
+    e->valid = true;
+    e->base = base;
+    e->opened = now;
+    e->filled = 0;
+    std::fill(e->written.begin(), e->written.end(), false);
+  }
+
+  for (size_t i = (addr - base) / WORD; i < (addr - base + bytes + WORD - 1) / WORD; i++) {
+    if (!e->written[i]) {
+      e->written[i] = true;
+      e->filled++;
+    }
+  }
+  if (e->filled == e->written.size()) {
+    flush(*e);
+    full_flushes++;
+  }
+
+  return stall;
+}
+
+uint64_t coalescer_t::read(uint64_t addr, size_t bytes)
+{
+  reads++;
+  in.read(bytes);
+
+  uint64_t base = addr - addr % write_burst;
+  uint64_t stall = 0;
+  if (entry_t* e = find(base)) {
+    size_t first = (addr - base) / WORD, last = (addr - base + bytes + WORD - 1) / WORD;
+    if (size_t(std::count(e->written.begin() + first, e->written.begin() + last, true)) == last - first) {
+      forwarded_reads++;
+      return 0;
+    }
+    // the read must see the pending write, so it goes out first
+    stall = flush(*e);
+    conflict_flushes++;
+    in.count[axi_counters_t::BUF_R_STALL] += stall;
+  }
+
+  if (!read_burst)
+    return stall + next_level(addr, bytes, false);
+  if (read_base != uint64_t(-1) && addr >= read_base && addr + bytes <= read_base + read_burst) {
+    read_buffer_hits++;
+    return stall;
+  }
+  read_base = addr - addr % read_burst;
+  return stall + next_level(read_base, read_burst, false);
+}
@@ -0,0 +1,77 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_COALESCER_H
+#define _RISCV_COALESCER_H
+
+#include "cachesim.h"
+#include "axi_counters.h"
+#include <vector>
+
+// The coalescing buffer in front of Cheshire's HyperBus controller.  Writes
+// are gathered in depth entries, each covering an aligned burst of
+// write_burst bytes, and go out as one masked burst when the entry fills,
+// when it must make room for another, or when window transactions have
+// reached the buffer since it was opened; a zero window keeps entries open
+// until one of the others.  Reads go through a single read buffer holding
+// an aligned burst of read_burst bytes, refilled on a miss and dropped
+// when a write overlaps it; a zero read_burst passes reads straight
+// through.  A read wholly covered by a
+// pending write is forwarded from it, and one partly covered waits for
+// that write to go out first.
+//
+// The hardware counts its window in cycles.  The model sees no clock
+// between accesses, so it counts transactions instead.
+class coalescer_t : public mem_model_t
+{
+ public:
+  coalescer_t(size_t depth, size_t write_burst, size_t read_burst, uint64_t window);
+  ~coalescer_t();
+
+  uint64_t access(uint64_t addr, size_t bytes, bool store);
+  void set_miss_handler(mem_model_t* mh) { miss_handler = mh; }
+  const axi_counters_t& get_counters() const { return in; }
+
+  // from depth[:write_burst[:read_burst[:window]]]
+  static coalescer_t* construct(const char* config);
+
+ private:
+  struct entry_t {
+    bool valid;
+    uint64_t base;
+    uint64_t opened; // when, in transactions
+    size_t filled; // words written
+    std::vector<bool> written;
+  };
+
+  static const size_t WORD = 8; // bytes in a beat of the AXI data bus
+
+  uint64_t write(uint64_t addr, size_t bytes);
+  uint64_t read(uint64_t addr, size_t bytes);
+  entry_t* find(uint64_t base);
+  uint64_t flush(entry_t& e);
+  uint64_t next_level(uint64_t addr, size_t bytes, bool store);
+
+  size_t write_burst;
+  size_t read_burst;
+  uint64_t window;
+  std::vector<entry_t> entries;
+  uint64_t read_base; // of the burst in the read buffer, or -1
+  uint64_t now; // transactions so far
+  mem_model_t* miss_handler;
+
+  uint64_t writes;
+  uint64_t merged_writes;
+  uint64_t reads;
+  uint64_t read_buffer_hits;
+  uint64_t forwarded_reads;
+  uint64_t bursts;
+  uint64_t burst_bytes;
+  uint64_t full_flushes;
+  uint64_t window_flushes;
+  uint64_t eviction_flushes;
+  uint64_t conflict_flushes;
+
+  axi_counters_t in; // from the LLC, with the buffer's stalls
+};
+
+#endif
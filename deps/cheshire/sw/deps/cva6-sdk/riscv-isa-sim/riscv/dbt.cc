@@ -0,0 +1,436 @@
+// See LICENSE for license details.
+
+#include "dbt.h"
+#include "threaded.h"
+#include "processor.h"
+#include "mmu.h"
+#include <sys/mman.h>
+#include <string.h>
+#include <vector>
+
+// Register use in translated code: rbx points at the integer register file,
+// rdi at the dbt_ctx_t; rax, rcx, rdx and rsi are scratch.  The generated
+// code makes no calls, so only rbx has to be saved.
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7 };
+
+// x86 ALU opcodes, as the /r form and as the /digit of the 0x81 immediate form
+enum alu_t { ALU_ADD, ALU_OR, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+static const uint8_t alu_rr[] = { 0x01, 0x09, 0x21, 0x29, 0x31, 0x39 };
+static const uint8_t alu_ri[] = { 0, 1, 4, 5, 6, 7 };
+
+// x86 condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD };
+
+// /digit of the shift group
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+class x86_emitter_t
+{
+public:
+  x86_emitter_t(uint8_t* buf) : p(buf) {}
+
+  uint8_t* pos() const { return p; }
+
+  void byte(uint8_t b) { *p++ = b; }
+  void word(uint32_t w) { memcpy(p, &w, sizeof(w)); p += sizeof(w); }
+  void dword(uint64_t d) { memcpy(p, &d, sizeof(d)); p += sizeof(d); }
+  void modrm(int mod, int reg, int rm) { byte(mod << 6 | reg << 3 | rm); }
+
+  static bool fits_simm32(reg_t x) { return x == reg_t(int64_t(int32_t(x))); }
+
+  // reg = x[xi]; x0 reads as zero without touching memory
+  void load_x(int reg, int xi)
+  {
+    if (xi == 0) {
+      byte(0x31); modrm(3, reg, reg); // xor reg32, reg32
+    } else {
+      byte(0x48); byte(0x8B); modrm(2, reg, RBX); word(xi * sizeof(reg_t));
+    }
+  }
+
+  // x[xi] = reg; writes to x0 are dropped
+  void store_x(int reg, int xi)
+  {
+    if (xi != 0) {
+      byte(0x48); byte(0x89); modrm(2, reg, RBX); word(xi * sizeof(reg_t));
+    }
+  }
+
+  void mov_imm(int reg, reg_t imm)
+  {
+    if (fits_simm32(imm)) {
+      byte(0x48); byte(0xC7); modrm(3, 0, reg); word(imm);
+    } else {
+      byte(0x48); byte(0xB8 + reg); dword(imm);
+    }
+  }
+
+  void alu(alu_t op, int dst, int src, bool wide = true)
+  {
+    if (wide)
+      byte(0x48);
+    byte(alu_rr[op]); modrm(3, src, dst);
+  }
+
+  // immediates are 12 bits at most, so the sign-extended imm32 form suffices
+  void alu_imm(alu_t op, int dst, reg_t imm, bool wide = true)
+  {
+    if (wide)
+      byte(0x48);
+    byte(0x81); modrm(3, alu_ri[op], dst); word(imm);
+  }
+
+  void shift_imm(int op, int dst, int amount, bool wide = true)
+  {
+    if (wide)
+      byte(0x48);
+    byte(0xC1); modrm(3, op, dst); byte(amount);
+  }
+
+  // shift dst by cl; x86 masks the count to 6 bits, as RV64 does
+  void shift_cl(int op, int dst)
+  {
+    byte(0x48); byte(0xD3); modrm(3, op, dst);
+  }
+
+  void movsxd(int dst, int src) { byte(0x48); byte(0x63); modrm(3, dst, src); }
+
+  // dst = cc ? 1 : 0, after a compare
+  void setcc(int cc, int dst)
+  {
+    byte(0x0F); byte(0x90 + cc); modrm(3, 0, dst);
+    byte(0x0F); byte(0xB6); modrm(3, dst, dst); // movzx dst32, dst8
+  }
+
+  // test al, imm8
+  void test_al(uint8_t imm) { byte(0xA8); byte(imm); }
+
+  // jcc rel32 with the target patched later; returns the rel32 location
+  uint8_t* jcc(int cc)
+  {
+    byte(0x0F); byte(0x80 + cc); word(0);
+    return p - sizeof(uint32_t);
+  }
+
+  static void patch(uint8_t* rel, uint8_t* target)
+  {
+    int32_t disp = target - (rel + sizeof(uint32_t));
+    memcpy(rel, &disp, sizeof(disp));
+  }
+
+  void prologue()
+  {
+    byte(0x53); // push rbx
+    byte(0x48); byte(0x8B); modrm(0, RBX, RDI); // mov rbx, [rdi]
+  }
+
+  // return {npc, retired} in rax:rdx; npc is already in rax if npc_in_rax
+  void exit(reg_t npc, size_t retired, bool npc_in_rax = false)
+  {
+    if (!npc_in_rax)
+      mov_imm(RAX, npc);
+    byte(0xBA); word(retired); // mov edx, imm32
+    byte(0x5B); // pop rbx
+    byte(0xC3); // ret
+  }
+
+  // Translate the virtual address in rax through the software TLB.  Leaves
+  // the host offset in rdx, or branches to the returned rel32 location on a
+  // miss.  tag_offset selects the load or store tags within dbt_ctx_t.
+  uint8_t* tlb_lookup(int tag_offset, reg_t tlb_entries)
+  {
+    byte(0x48); byte(0x89); modrm(3, RAX, RSI);           // mov rsi, rax
+    shift_imm(SHIFT_SHR, RSI, PGSHIFT);                   // shr rsi, PGSHIFT
+    byte(0x89); modrm(3, RSI, RDX);                       // mov edx, esi
+    alu_imm(ALU_AND, RDX, tlb_entries - 1, false);        // and edx, mask
+    byte(0x48); byte(0x8B); modrm(1, RCX, RDI); byte(offsetof(dbt_ctx_t, tlb_context));
+    byte(0x48); byte(0x0B); modrm(0, RSI, RCX);           // or rsi, [rcx]
+    byte(0x48); byte(0x8B); modrm(1, RCX, RDI); byte(tag_offset); // mov rcx, [rdi+tags]
+    byte(0x48); byte(0x39); modrm(0, RSI, 4); byte(0xD1); // cmp [rcx+rdx*8], rsi
+    uint8_t* miss = jcc(CC_NE);
+    byte(0x48); byte(0x8B); modrm(1, RCX, RDI); byte(offsetof(dbt_ctx_t, tlb_data));
+    shift_imm(SHIFT_SHL, RDX, 4);                         // sizeof(tlb_entry_t)
+    byte(0x48); byte(0x8B); modrm(0, RDX, 4); byte(0x11); // mov rdx, [rcx+rdx]
+    return miss;
+  }
+
+private:
+  uint8_t* p;
+};
+
+dbt_t::dbt_t(processor_t* proc, mmu_t* mmu)
+  : proc(proc), size(0), used(0), blocks_translated(0)
+{
+  static_assert(sizeof(tlb_entry_t) == 16, "tlb_lookup scales by 16");
+  static_assert(mmu_t::TLB_ENTRIES <= 256 &&
+                (mmu_t::TLB_ENTRIES & (mmu_t::TLB_ENTRIES - 1)) == 0,
+                "tlb_lookup expects a power-of-2 TLB");
+
+  ctx.xpr = const_cast<reg_t*>(&proc->get_state()->XPR[0]);
+  ctx.tlb_load_tag = mmu->tlb_load_tag;
+  ctx.tlb_store_tag = mmu->tlb_store_tag;
+  ctx.tlb_data = mmu->tlb_data;
+  ctx.tlb_context = &mmu->tlb_context;
+
+  void* p = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    // run without translation rather than failing
+    buf = NULL;
+  } else {
+    buf = (uint8_t*)p;
+    size = CODE_BUFFER_SIZE;
+  }
+}
+
+dbt_t::~dbt_t()
+{
+  if (buf)
+    munmap(buf, size);
+}
+
+static int alu_of(uint8_t op)
+{
+  switch (op) {
+    case UOP_ADD: case UOP_ADDI: case UOP_ADDW: case UOP_ADDIW: return ALU_ADD;
+    case UOP_SUB: case UOP_SUBW: return ALU_SUB;
+    case UOP_AND: case UOP_ANDI: return ALU_AND;
+    case UOP_OR: case UOP_ORI: return ALU_OR;
+    case UOP_XOR: case UOP_XORI: return ALU_XOR;
+    default: return -1;
+  }
+}
+
+static int shift_of(uint8_t op)
+{
+  switch (op) {
+    case UOP_SLL: case UOP_SLLI: case UOP_SLLIW: return SHIFT_SHL;
+    case UOP_SRL: case UOP_SRLI: case UOP_SRLIW: return SHIFT_SHR;
+    case UOP_SRA: case UOP_SRAI: case UOP_SRAIW: return SHIFT_SAR;
+    default: return -1;
+  }
+}
+
+static int branch_cc(uint8_t op)
+{
+  switch (op) {
+    case UOP_BEQ: return CC_E;
+    case UOP_BNE: return CC_NE;
+    case UOP_BLT: return CC_L;
+    case UOP_BGE: return CC_GE;
+    case UOP_BLTU: return CC_B;
+    case UOP_BGEU: return CC_AE;
+    default: return -1;
+  }
+}
+
+static size_t access_size(uint8_t op)
+{
+  switch (op) {
+    case UOP_LB: case UOP_LBU: case UOP_SB: return 1;
+    case UOP_LH: case UOP_LHU: case UOP_SH: return 2;
+    case UOP_LW: case UOP_LWU: case UOP_SW: return 4;
+    default: return 8;
+  }
+}
+
+dbt_code_t dbt_t::translate(const bb_cache_entry_t* bb)
+{
+  if (!buf || full())
+    return NULL;
+
+  x86_emitter_t e(buf + used);
+  uint8_t* start = e.pos();
+  // side exits back to the interpreter, keyed by instruction index
+  std::vector<std::pair<uint8_t*, size_t>> exits;
+  reg_t align_mask = proc->pc_alignment_mask();
+
+  e.prologue();
+
+  size_t i;
+  for (i = 0; i < bb->len; i++) {
+    insn_uop_t u = decode_uop(proc, bb->data[i], bb->pc[i]);
+    reg_t pc = bb->pc[i], next_pc = pc + u.len;
+    int alu = alu_of(u.op), shift = shift_of(u.op), cc = branch_cc(u.op);
+
+    // leave the rest of the block to the interpreter
+    if (u.op == UOP_FUNC)
+      break;
+    if ((cc >= 0 || u.op == UOP_JAL) && (u.imm & ~align_mask))
+      break;
+
+    switch (u.op) {
+      case UOP_LI:
+        e.mov_imm(RAX, u.imm);
+        e.store_x(RAX, u.rd);
+        break;
+
+      case UOP_ADD: case UOP_SUB: case UOP_AND: case UOP_OR: case UOP_XOR:
+      case UOP_ADDW: case UOP_SUBW: {
+        bool w = u.op == UOP_ADDW || u.op == UOP_SUBW;
+        e.load_x(RAX, u.rs1);
+        e.load_x(RCX, u.rs2);
+        e.alu(alu_t(alu), RAX, RCX, !w);
+        if (w)
+          e.movsxd(RAX, RAX);
+        e.store_x(RAX, u.rd);
+        break;
+      }
+
+      case UOP_ADDI: case UOP_ANDI: case UOP_ORI: case UOP_XORI:
+      case UOP_ADDIW: {
+        bool w = u.op == UOP_ADDIW;
+        e.load_x(RAX, u.rs1);
+        e.alu_imm(alu_t(alu), RAX, u.imm, !w);
+        if (w)
+          e.movsxd(RAX, RAX);
+        e.store_x(RAX, u.rd);
+        break;
+      }
+
+      case UOP_SLL: case UOP_SRL: case UOP_SRA:
+        e.load_x(RAX, u.rs1);
+        e.load_x(RCX, u.rs2);
+        e.shift_cl(shift, RAX);
+        e.store_x(RAX, u.rd);
+        break;
+
+      case UOP_SLLI: case UOP_SRLI: case UOP_SRAI:
+      case UOP_SLLIW: case UOP_SRLIW: case UOP_SRAIW: {
+        bool w = u.op == UOP_SLLIW || u.op == UOP_SRLIW || u.op == UOP_SRAIW;
+        e.load_x(RAX, u.rs1);
+        e.shift_imm(shift, RAX, u.imm, !w);
+        if (w)
+          e.movsxd(RAX, RAX);
+        e.store_x(RAX, u.rd);
+        break;
+      }
+
+      case UOP_SLT: case UOP_SLTU:
+        e.load_x(RAX, u.rs1);
+        e.load_x(RCX, u.rs2);
+        e.alu(ALU_CMP, RAX, RCX);
+        e.setcc(u.op == UOP_SLT ? CC_L : CC_B, RAX);
+        e.store_x(RAX, u.rd);
+        break;
+
+      case UOP_SLTI: case UOP_SLTIU:
+        e.load_x(RAX, u.rs1);
+        e.alu_imm(ALU_CMP, RAX, u.imm);
+        e.setcc(u.op == UOP_SLTI ? CC_L : CC_B, RAX);
+        e.store_x(RAX, u.rd);
+        break;
+
+      case UOP_LB: case UOP_LBU: case UOP_LH: case UOP_LHU:
+      case UOP_LW: case UOP_LWU: case UOP_LD: {
+        size_t size = access_size(u.op);
+        e.load_x(RAX, u.rs1);
+        e.alu_imm(ALU_ADD, RAX, u.imm);
+        if (size > 1) {
+          e.test_al(size - 1);
+          exits.push_back(std::make_pair(e.jcc(CC_NE), i));
+        }
+        exits.push_back(std::make_pair(e.tlb_lookup(offsetof(dbt_ctx_t, tlb_load_tag), mmu_t::TLB_ENTRIES), i));
+        // rax = [rdx + rax], extended as the load requires
+        switch (u.op) {
+          case UOP_LB: e.byte(0x48); e.byte(0x0F); e.byte(0xBE); break;
+          case UOP_LBU: e.byte(0x0F); e.byte(0xB6); break;
+          case UOP_LH: e.byte(0x48); e.byte(0x0F); e.byte(0xBF); break;
+          case UOP_LHU: e.byte(0x0F); e.byte(0xB7); break;
+          case UOP_LW: e.byte(0x48); e.byte(0x63); break;
+          case UOP_LWU: e.byte(0x8B); break;
+          case UOP_LD: e.byte(0x48); e.byte(0x8B); break;
+        }
+        e.modrm(0, RAX, 4); e.byte(0x02);
+        e.store_x(RAX, u.rd);
+        break;
+      }
+
+      case UOP_SB: case UOP_SH: case UOP_SW: case UOP_SD: {
+        size_t size = access_size(u.op);
+        e.load_x(RAX, u.rs1);
+        e.alu_imm(ALU_ADD, RAX, u.imm);
+        if (size > 1) {
+          e.test_al(size - 1);
+          exits.push_back(std::make_pair(e.jcc(CC_NE), i));
+        }
+        exits.push_back(std::make_pair(e.tlb_lookup(offsetof(dbt_ctx_t, tlb_store_tag), mmu_t::TLB_ENTRIES), i));
+        e.load_x(RCX, u.rs2);
+        // [rdx + rax] = rcx
+        switch (u.op) {
+          case UOP_SB: e.byte(0x88); break;
+          case UOP_SH: e.byte(0x66); e.byte(0x89); break;
+          case UOP_SW: e.byte(0x89); break;
+          case UOP_SD: e.byte(0x48); e.byte(0x89); break;
+        }
+        e.modrm(0, RCX, 4); e.byte(0x02);
+        break;
+      }
+
+      case UOP_BEQ: case UOP_BNE: case UOP_BLT: case UOP_BGE:
+      case UOP_BLTU: case UOP_BGEU: {
+        e.load_x(RAX, u.rs1);
+        e.load_x(RCX, u.rs2);
+        e.alu(ALU_CMP, RAX, RCX);
+        uint8_t* taken = e.jcc(cc);
+        e.exit(next_pc, i + 1);
+        x86_emitter_t::patch(taken, e.pos());
+        e.exit(u.imm, i + 1);
+        break;
+      }
+
+      case UOP_JAL:
+        if (u.rd != 0) {
+          e.mov_imm(RCX, next_pc);
+          e.store_x(RCX, u.rd);
+        }
+        e.exit(u.imm, i + 1);
+        break;
+
+      case UOP_JALR:
+        e.load_x(RAX, u.rs1);
+        e.alu_imm(ALU_ADD, RAX, u.imm);
+        e.alu_imm(ALU_AND, RAX, reg_t(-2));
+        if (!proc->supports_extension('C')) {
+          e.test_al(2);
+          exits.push_back(std::make_pair(e.jcc(CC_NE), i));
+        }
+        if (u.rd != 0) {
+          e.mov_imm(RCX, next_pc);
+          e.store_x(RCX, u.rd);
+        }
+        e.exit(0, i + 1, true);
+        break;
+
+      default:
+        abort();
+    }
+
+    // control flow always ends the block
+    if (cc >= 0 || u.op == UOP_JAL || u.op == UOP_JALR) {
+      i++;
+      break;
+    }
+  }
+
+  if (i == 0)
+    return NULL;
+
+  const insn_uop_t last = decode_uop(proc, bb->data[i - 1], bb->pc[i - 1]);
+  bool ended_by_jump = branch_cc(last.op) >= 0 || last.op == UOP_JAL || last.op == UOP_JALR;
+  if (!ended_by_jump)
+    e.exit(i < bb->len ? bb->pc[i] : bb->pc[i - 1] + last.len, i);
+
+  // The side exits re-execute the instruction in the interpreter.
+  for (size_t j = 0; j < exits.size(); ) {
+    size_t insn = exits[j].second;
+    uint8_t* stub = e.pos();
+    e.exit(bb->pc[insn], insn);
+    for ( ; j < exits.size() && exits[j].second == insn; j++)
+      x86_emitter_t::patch(exits[j].first, stub);
+  }
+
+  used = e.pos() - buf;
+  blocks_translated++;
+  return (dbt_code_t)start;
+}
@@ -0,0 +1,73 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DBT_H
+#define _RISCV_DBT_H
+
+#include "decode.h"
+#include <stddef.h>
+
+#if defined(RISCV_ENABLE_DBT) && !defined(__x86_64__)
+# error "--enable-dbt requires an x86-64 host"
+#endif
+
+class processor_t;
+class mmu_t;
+struct bb_cache_entry_t;
+struct tlb_entry_t;
+
+// State the translated code works on directly: the integer register file
+// and the MMU's software TLB.
+struct dbt_ctx_t {
+  reg_t* xpr;
+  const reg_t* tlb_load_tag;
+  const reg_t* tlb_store_tag;
+  const tlb_entry_t* tlb_data;
+  const reg_t* tlb_context;
+};
+
+// Translated blocks return the PC to resume at and how many instructions
+// they retired.  A block leaves early, before the instruction at the
+// returned PC, whenever that instruction needs the interpreter (TLB miss,
+// misaligned access, misaligned jump target).
+struct dbt_result_t {
+  reg_t npc;
+  reg_t retired;
+};
+
+typedef dbt_result_t (*dbt_code_t)(const dbt_ctx_t*);
+
+// Translates hot basic blocks of RV64I instructions into x86-64 code.  Only
+// instructions the threaded engine lowers to uops are translated; a block
+// stops at the first one that isn't, and the interpreter takes over there.
+class dbt_t
+{
+public:
+  // a block is translated once it has been entered this many times
+  static const uint32_t HOT_THRESHOLD = 64;
+
+  dbt_t(processor_t* proc, mmu_t* mmu);
+  ~dbt_t();
+
+  // returns NULL if the block's first instruction can't be translated or
+  // the code buffer is full
+  dbt_code_t translate(const bb_cache_entry_t* bb);
+  bool full() const { return used + MAX_BLOCK_BYTES > size; }
+  void flush() { used = 0; }
+
+  const dbt_ctx_t* get_ctx() const { return &ctx; }
+
+  uint64_t get_blocks_translated() const { return blocks_translated; }
+
+private:
+  static const size_t CODE_BUFFER_SIZE = 16 << 20;
+  static const size_t MAX_BLOCK_BYTES = 4096;
+
+  processor_t* proc;
+  dbt_ctx_t ctx;
+  uint8_t* buf;
+  size_t size;
+  size_t used;
+  uint64_t blocks_translated;
+};
+
+#endif
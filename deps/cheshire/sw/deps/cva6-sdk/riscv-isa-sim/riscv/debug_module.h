@@ -128,6 +128,9 @@ class debug_module_t : public abstract_device_t
     // Called when one of the attached harts was reset.
     void proc_reset(unsigned id);
 
+    void save(checkpoint_section_t& cp);
+    void restore(const checkpoint_section_t& cp);
+
   private:
     static const unsigned datasize = 2;
     unsigned nprocs;
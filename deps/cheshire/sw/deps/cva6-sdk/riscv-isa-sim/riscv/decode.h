@@ -316,10 +316,14 @@ class wait_for_interrupt_t {};
 
 #define serialize() set_pc_and_serialize(npc)
 
+// raise a trap without throwing a C++ exception
+#define defer_trap(type, ...) return p->set_pending_trap<type>(__VA_ARGS__)
+
 /* Sentinel PC values to serialize simulator pipeline */
 #define PC_SERIALIZE_BEFORE 3
 #define PC_SERIALIZE_AFTER 5
 #define PC_SERIALIZE_WFI 7
+#define PC_TRAP 9 /* processor_t::pending_trap was set */
 #define invalid_pc(pc) ((pc) & 1)
 
 /* Convenience wrappers to simplify softfloat code sequences */
@@ -1,6 +1,14 @@
 #include "devices.h"
 #include "mmu.h"
+#include "sim.h"
 #include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+bus_t::bus_t()
+{
+  build_routes();
+}
 
 void bus_t::add_device(reg_t addr, abstract_device_t* dev)
 {
@@ -10,49 +18,92 @@ void bus_t::add_device(reg_t addr, abstract_device_t* dev)
   // iteration over this sort, which it does. (python's
   // SortedDict is a good analogy)
   devices[addr] = dev;
+  build_routes();
+}
+
+void bus_t::build_routes()
+{
+  routes.assign(2, route_t{0, NULL, NULL});
+  for (auto& x : devices)
+    routes.push_back({x.first, x.second, dynamic_cast<mem_t*>(x.second)});
+
+  route_nodes.clear();
+  route_root = build_route_entry(0, ROUTE_PAGE_SHIFT + ROUTE_LEVELS * ROUTE_BITS);
+}
+
+// Make the tree entry for the 2^bits bytes at base: a leaf if one device
+// (or none) covers all of them, otherwise a node that splits them up.
+uintptr_t bus_t::build_route_entry(reg_t base, int bits)
+{
+  reg_t last = base + ((bits < 64 ? reg_t(1) << bits : 0) - 1);
+  auto it = devices.upper_bound(base);
+  if (it == devices.end() || it->first > last) {
+    size_t route = it == devices.begin() ? ROUTE_NONE : 2 + std::distance(devices.begin(), it) - 1;
+    return (route << 1) | 1;
+  }
+  if (bits == ROUTE_PAGE_SHIFT)
+    return (ROUTE_MIXED << 1) | 1;
+
+  int child_bits = bits - ROUTE_BITS;
+  uintptr_t* node = new uintptr_t[size_t(1) << ROUTE_BITS];
+  route_nodes.emplace_back(node);
+  for (size_t i = 0; i < (size_t(1) << ROUTE_BITS); i++)
+    node[i] = build_route_entry(base + (reg_t(i) << child_bits), child_bits);
+  return (uintptr_t)node;
 }
 
 bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
 {
-  // Find the device with the base address closest to but
-  // less than addr (price-is-right search)
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
-    // Either the bus is empty, or there weren't 
-    // any items with a base address <= addr
+  route_t route = find_route(addr);
+  if (!route.dev)
     return false;
-  }
-  // Found at least one item with base address <= addr
-  // The iterator points to the device after this, so
-  // go back by one item.
-  it--;
-  return it->second->load(addr - it->first, len, bytes);
+  return route.dev->load(addr - route.base, len, bytes);
 }
 
 bool bus_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 {
-  // See comments in bus_t::load
-  auto it = devices.upper_bound(addr);
-  if (devices.empty() || it == devices.begin()) {
+  route_t route = find_route(addr);
+  if (!route.dev)
     return false;
-  }
-  it--;
-  return it->second->store(addr - it->first, len, bytes);
+  return route.dev->store(addr - route.base, len, bytes);
 }
 
 std::pair<reg_t, abstract_device_t*> bus_t::find_device(reg_t addr)
 {
-  // See comments in bus_t::load
+  route_t route = find_route(addr);
+  if (!route.dev)
+    return std::make_pair((reg_t)0, (abstract_device_t*)NULL);
+  return std::make_pair(route.base, route.dev);
+}
+
+char* bus_t::addr_to_mem(reg_t addr)
+{
+  route_t route = find_route(addr);
+  if (!route.mem || addr - route.base >= route.mem->size())
+    return NULL;
+  return route.mem->contents(addr - route.base);
+}
+
+bus_t::route_t bus_t::find_route_slow(reg_t addr)
+{
+  // Find the device with the base address closest to but
+  // less than addr (price-is-right search)
   auto it = devices.upper_bound(addr);
   if (devices.empty() || it == devices.begin()) {
-    return std::make_pair((reg_t)0, (abstract_device_t*)NULL);
+    // Either the bus is empty, or there weren't 
+    // any items with a base address <= addr
+    return routes[ROUTE_NONE];
   }
+  // Found at least one item with base address <= addr
+  // The iterator points to the device after this, so
+  // go back by one item.
   it--;
-  return std::make_pair(it->first, it->second);
+  return routes[2 + std::distance(devices.begin(), it)];
 }
 
 // Type for holding all registered MMIO plugins by name.
 using mmio_plugin_map_t = std::map<std::string, mmio_plugin_t>;
+using mmio_plugin_v2_map_t = std::map<std::string, mmio_plugin_v2_t>;
 
 // Simple singleton instance of an mmio_plugin_map_t.
 static mmio_plugin_map_t& mmio_plugin_map()
@@ -61,54 +112,284 @@ static mmio_plugin_map_t& mmio_plugin_map()
   return instance;
 }
 
+static mmio_plugin_v2_map_t& mmio_plugin_v2_map()
+{
+  static mmio_plugin_v2_map_t instance;
+  return instance;
+}
+
 void register_mmio_plugin(const char* name_cstr,
                           const mmio_plugin_t* mmio_plugin)
 {
   std::string name(name_cstr);
-  if (!mmio_plugin_map().emplace(name, *mmio_plugin).second) {
+  if (mmio_plugin_v2_map().count(name) ||
+      !mmio_plugin_map().emplace(name, *mmio_plugin).second) {
+    throw std::runtime_error("Plugin \"" + name + "\" already registered!");
+  }
+}
+
+void register_mmio_plugin_v2(const char* name_cstr,
+                             const mmio_plugin_v2_t* mmio_plugin)
+{
+  std::string name(name_cstr);
+  if (mmio_plugin->abi_version < 2 || mmio_plugin->abi_version > MMIO_PLUGIN_ABI_VERSION) {
+    throw std::runtime_error("Plugin \"" + name + "\" needs MMIO plugin ABI version " +
+                             std::to_string(mmio_plugin->abi_version));
+  }
+  if (mmio_plugin_map().count(name) ||
+      !mmio_plugin_v2_map().emplace(name, *mmio_plugin).second) {
     throw std::runtime_error("Plugin \"" + name + "\" already registered!");
   }
 }
 
 mmio_plugin_device_t::mmio_plugin_device_t(const std::string& name,
                                            const std::string& args)
-  : plugin(mmio_plugin_map().at(name)), user_data((*plugin.alloc)(args.c_str()))
+  : name(name), args(args), v2(mmio_plugin_v2_map().count(name) != 0),
+    plugin(), plugin_v2(), host(), sim(NULL), tick_time(-1), plic_source(0), tick_event(), user_data(NULL)
 {
+  if (v2)
+    plugin_v2 = mmio_plugin_v2_map().at(name);
+  else
+    plugin = mmio_plugin_map().at(name);
+
+  if (!v2)
+    user_data = (*plugin.alloc)(args.c_str());
 }
 
 mmio_plugin_device_t::~mmio_plugin_device_t()
 {
-  (*plugin.dealloc)(user_data);
+  if (!v2)
+    (*plugin.dealloc)(user_data);
+  else if (user_data)
+    (*plugin_v2.dealloc)(user_data);
+}
+
+bool mmio_plugin_device_t::attach(sim_t* sim, uint32_t plic_source)
+{
+  if (!v2 || this->sim)
+    return false;
+  if (plic_source > plic_t::PLIC_NDEV)
+    throw std::runtime_error("Plugin \"" + name + "\" has no PLIC source left");
+
+  this->sim = sim;
+  this->plic_source = plic_source;
+  host.ctx = this;
+  host.mem_ptr = host_mem_ptr;
+  host.mem_load = host_mem_load;
+  host.mem_store = host_mem_store;
+  host.set_interrupt = host_set_interrupt;
+  host.get_time = host_get_time;
+  host.schedule_tick = host_schedule_tick;
+  user_data = (*plugin_v2.alloc)(args.c_str(), &host);
+  return true;
 }
 
 bool mmio_plugin_device_t::load(reg_t addr, size_t len, uint8_t* bytes)
 {
-  return (*plugin.load)(user_data, addr, len, bytes);
+  if (v2)
+    return (*plugin_v2.load)(user_data, addr, len, bytes);
+
+  // version 1 plugins expect the accesses a hart can make
+  while (len > 0) {
+    size_t n = 8;
+    while (n > len || addr % n != 0)
+      n /= 2;
+    if (!(*plugin.load)(user_data, addr, n, bytes))
+      return false;
+    addr += n;
+    bytes += n;
+    len -= n;
+  }
+  return true;
 }
 
 bool mmio_plugin_device_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 {
-  return (*plugin.store)(user_data, addr, len, bytes);
+  if (v2)
+    return (*plugin_v2.store)(user_data, addr, len, bytes);
+
+  while (len > 0) {
+    size_t n = 8;
+    while (n > len || addr % n != 0)
+      n /= 2;
+    if (!(*plugin.store)(user_data, addr, n, bytes))
+      return false;
+    addr += n;
+    bytes += n;
+    len -= n;
+  }
+  return true;
+}
+
+void mmio_plugin_device_t::post_tick()
+{
+  sim->events.cancel(tick_event);
+  tick_event = event_queue_t::event_id_t();
+  if (tick_time == reg_t(-1))
+    return;
+
+  reg_t now = sim->clint->get_mtime();
+  reg_t delay = tick_time > now ? sim->steps_until_mtime(tick_time - now) : 0;
+  tick_event = sim->events.schedule(sim->steps_per_hart + delay, [this](reg_t) { tick(); });
+}
+
+void mmio_plugin_device_t::tick()
+{
+  tick_time = -1;
+  tick_event = event_queue_t::event_id_t();
+  if (plugin_v2.tick)
+    (*plugin_v2.tick)(user_data, sim->clint->get_mtime());
+}
+
+void* mmio_plugin_device_t::host_mem_ptr(void* ctx, reg_t addr, size_t len)
+{
+  sim_t* sim = static_cast<mmio_plugin_device_t*>(ctx)->sim;
+  if (len == 0 || addr + len - 1 < addr)
+    return NULL;
+  char* first = sim->addr_to_mem(addr);
+  char* last = sim->addr_to_mem(addr + len - 1);
+  return first && last == first + (len - 1) ? first : NULL;
+}
+
+bool mmio_plugin_device_t::host_mem_load(void* ctx, reg_t addr, size_t len, uint8_t* bytes)
+{
+  sim_t* sim = static_cast<mmio_plugin_device_t*>(ctx)->sim;
+  if (addr + len < addr)
+    return false;
+  return sim->bus.load(addr, len, bytes);
+}
+
+bool mmio_plugin_device_t::host_mem_store(void* ctx, reg_t addr, size_t len, const uint8_t* bytes)
+{
+  sim_t* sim = static_cast<mmio_plugin_device_t*>(ctx)->sim;
+  if (addr + len < addr)
+    return false;
+  return sim->bus.store(addr, len, bytes);
+}
+
+void mmio_plugin_device_t::host_set_interrupt(void* ctx, uint32_t hartid, uint32_t irq, bool level)
+{
+  auto dev = static_cast<mmio_plugin_device_t*>(ctx);
+  sim_t* sim = dev->sim;
+  if (irq >= 64)
+    return;
+
+  // the PLIC owns the external interrupt lines, so go through it, as the
+  // virtio devices do; the source stays raised while any hart's line is
+  if (dev->plic_source && (irq == IRQ_M_EXT || irq == IRQ_S_EXT)) {
+    auto line = std::make_pair(hartid, irq);
+    if (level)
+      dev->ext_raised.insert(line);
+    else
+      dev->ext_raised.erase(line);
+    sim->plic->set_interrupt_level(dev->plic_source, !dev->ext_raised.empty());
+    return;
+  }
+
+  for (auto p : sim->procs) {
+    if (p->get_id() != hartid)
+      continue;
+    p->get_state()->set_mip_line(reg_t(1) << irq, level);
+  }
+}
+
+uint64_t mmio_plugin_device_t::host_get_time(void* ctx)
+{
+  return static_cast<mmio_plugin_device_t*>(ctx)->sim->clint->get_mtime();
+}
+
+void mmio_plugin_device_t::host_schedule_tick(void* ctx, uint64_t delay)
+{
+  auto dev = static_cast<mmio_plugin_device_t*>(ctx);
+  dev->tick_time = host_get_time(ctx) + delay;
+  dev->post_tick();
 }
 
 mem_t::mem_t(reg_t size)
-  : sz(size)
+  : data(NULL), sz(size)
 {
   if (size == 0 || size % PGSIZE != 0)
     throw std::runtime_error("memory size must be a positive multiple of 4 KiB");
+
+  // Reserve the whole region without committing swap; the host provides
+  // zero pages on first touch.  Align it so huge pages can back it.
+  size_t align = HUGE_PAGE_SIZE;
+  if (size + align < size)
+    return;
+  void* res = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res == MAP_FAILED)
+    return;
+
+  uintptr_t base = ((uintptr_t)res + align - 1) & ~uintptr_t(align - 1);
+  size_t head = base - (uintptr_t)res;
+  if (head)
+    munmap(res, head);
+  munmap((char*)base + size, align - head);
+  data = (char*)base;
 }
 
 mem_t::~mem_t()
 {
+  if (data)
+    munmap(data, sz);
   for (auto& entry : sparse_memory_map)
     free(entry.second);
 }
 
+void mem_t::set_huge_pages(bool value)
+{
+#ifdef MADV_HUGEPAGE
+  if (data)
+    madvise(data, sz, value ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+}
+
+reg_t mem_t::resident_size()
+{
+  if (!data)
+    return sparse_memory_map.size() * PGSIZE;
+
+  // query a chunk at a time to bound the size of the residency vector
+  long host_page = sysconf(_SC_PAGESIZE);
+  const reg_t chunk = reg_t(1) << 30;
+  std::vector<unsigned char> vec(chunk / host_page);
+  reg_t res = 0;
+  for (reg_t off = 0; off < sz; off += chunk) {
+    reg_t len = std::min(chunk, sz - off);
+    if (mincore(data + off, len, &vec[0]) != 0)
+      return 0;
+    for (reg_t i = 0; i < (len + host_page - 1) / host_page; i++)
+      res += (vec[i] & 1) * host_page;
+  }
+  return res;
+}
+
+bool mem_t::map_file(reg_t addr, size_t len, int fd, off_t offset)
+{
+  size_t host_page = sysconf(_SC_PAGESIZE);
+  if (!data || addr + len < addr || addr + len > sz ||
+      addr % host_page != 0 || len % host_page != 0 || offset % host_page != 0)
+    return false;
+
+  void* res = mmap(data + addr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, offset);
+  return res != MAP_FAILED;
+}
+
 bool mem_t::load_store(reg_t addr, size_t len, uint8_t* bytes, bool store)
 {
   if (addr + len < addr || addr + len > sz)
     return false;
 
+  if (likely(data != NULL)) {
+    if (store)
+      memcpy(data + addr, bytes, len);
+    else
+      memcpy(bytes, data + addr, len);
+    return true;
+  }
+
   while (len > 0) {
     auto n = std::min(PGSIZE - (addr % PGSIZE), reg_t(len));
 
@@ -125,7 +406,7 @@ bool mem_t::load_store(reg_t addr, size_t len, uint8_t* bytes, bool store)
   return true;
 }
 
-char* mem_t::contents(reg_t addr) {
+char* mem_t::sparse_contents(reg_t addr) {
   reg_t ppn = addr >> PGSHIFT, pgoff = addr % PGSIZE;
   auto search = sparse_memory_map.find(ppn);
   if (search == sparse_memory_map.end()) {
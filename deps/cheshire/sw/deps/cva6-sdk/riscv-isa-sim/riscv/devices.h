@@ -4,23 +4,65 @@
 #include "decode.h"
 #include "mmio_plugin.h"
 #include "abstract_device.h"
+#include "event_queue.h"
 #include "platform.h"
 #include <map>
+#include <set>
 #include <vector>
 #include <utility>
+#include <memory>
 
 class processor_t;
+class mem_t;
+class sim_t;
 
 class bus_t : public abstract_device_t {
  public:
+  bus_t();
   bool load(reg_t addr, size_t len, uint8_t* bytes);
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
   void add_device(reg_t addr, abstract_device_t* dev);
 
   std::pair<reg_t, abstract_device_t*> find_device(reg_t addr);
+  // host address backing addr if it lies in a mem_t, else NULL
+  char* addr_to_mem(reg_t addr);
 
  private:
   std::map<reg_t, abstract_device_t*> devices;
+
+  // An address belongs to the device with the greatest base at or below
+  // it.  Rather than search the map for that on every access, a radix
+  // tree over 4 KiB pages, rebuilt by add_device, resolves it in at most
+  // ROUTE_LEVELS steps.  Tree entries are either a pointer to a child
+  // node, or, with the low bit set, a leaf holding the index of the route
+  // that covers the entry's whole range.  Pages shared by several devices
+  // get ROUTE_MIXED and fall back to the map.
+  struct route_t {
+    reg_t base;
+    abstract_device_t* dev;
+    mem_t* mem; // dev, if it's a mem_t
+  };
+  static const int ROUTE_PAGE_SHIFT = 12;
+  static const int ROUTE_BITS = 13;
+  static const int ROUTE_LEVELS = 4; // covers 64-bit addresses of 4 KiB pages
+  static const size_t ROUTE_NONE = 0;
+  static const size_t ROUTE_MIXED = 1;
+  std::vector<route_t> routes;
+  std::vector<std::unique_ptr<uintptr_t[]>> route_nodes;
+  uintptr_t route_root;
+
+  void build_routes();
+  uintptr_t build_route_entry(reg_t base, int bits);
+  route_t find_route(reg_t addr)
+  {
+    uintptr_t entry = route_root;
+    for (int shift = ROUTE_PAGE_SHIFT + (ROUTE_LEVELS - 1) * ROUTE_BITS; !(entry & 1); shift -= ROUTE_BITS)
+      entry = ((uintptr_t*)entry)[(addr >> shift) & ((1 << ROUTE_BITS) - 1)];
+    if (likely((entry >> 1) != ROUTE_MIXED))
+      return routes[entry >> 1];
+    return find_route_slow(addr);
+  }
+  route_t find_route_slow(reg_t addr);
 };
 
 class rom_device_t : public abstract_device_t {
@@ -41,12 +83,29 @@ class mem_t : public abstract_device_t {
 
   bool load(reg_t addr, size_t len, uint8_t* bytes) { return load_store(addr, len, bytes, false); }
   bool store(reg_t addr, size_t len, const uint8_t* bytes) { return load_store(addr, len, const_cast<uint8_t*>(bytes), true); }
-  char* contents(reg_t addr);
+  char* contents(reg_t addr) { return likely(data != NULL) ? data + addr : sparse_contents(addr); }
   reg_t size() { return sz; }
 
+  // ask the host to back the region with transparent huge pages
+  void set_huge_pages(bool value);
+  // bytes of the region the host currently has resident
+  reg_t resident_size();
+  // write the contents to a sparse file, or replace them with one
+  void save_image(const std::string& path);
+  void restore_image(const std::string& path);
+  // Map len bytes of a file privately over the region's contents at addr,
+  // returning false if they can't be.  addr, len and offset must be
+  // multiples of the host's page size.
+  bool map_file(reg_t addr, size_t len, int fd, off_t offset);
+
  private:
   bool load_store(reg_t addr, size_t len, uint8_t* bytes, bool store);
+  char* sparse_contents(reg_t addr);
 
+  // The region is normally one lazily-populated mapping; if it can't be
+  // reserved, pages are allocated one by one as they are first touched.
+  static const size_t HUGE_PAGE_SIZE = 2 << 20;
+  char* data;
   std::map<reg_t, char*> sparse_memory_map;
   reg_t sz;
 };
@@ -58,6 +117,12 @@ class clint_t : public abstract_device_t {
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
   size_t size() { return CLINT_SIZE; }
   void increment(reg_t inc);
+  // ticks until the next timer interrupt some hart has enabled, or 0 if
+  // none is due or time follows the host clock
+  reg_t ticks_until_interrupt();
+  reg_t get_mtime() { return mtime; }
+  void save(checkpoint_section_t& cp);
+  void restore(const checkpoint_section_t& cp);
  private:
   typedef uint64_t mtime_t;
   typedef uint64_t mtimecmp_t;
@@ -71,6 +136,40 @@ class clint_t : public abstract_device_t {
   std::vector<mtimecmp_t> mtimecmp;
 };
 
+// Platform-level interrupt controller, as in the SiFive/RISC-V PLIC
+// specification.  Sources are level-triggered; there are machine and
+// supervisor contexts for each hart.
+class plic_t : public abstract_device_t {
+ public:
+  plic_t(std::vector<processor_t*>&);
+  bool load(reg_t addr, size_t len, uint8_t* bytes);
+  bool store(reg_t addr, size_t len, const uint8_t* bytes);
+  size_t size() { return PLIC_SIZE; }
+  void set_interrupt_level(uint32_t source, bool level);
+  void save(checkpoint_section_t& cp);
+  void restore(const checkpoint_section_t& cp);
+
+  static const uint32_t PLIC_NDEV = 31;
+ private:
+  static const uint32_t PLIC_PRIO_MASK = 7;
+  struct context_t {
+    std::vector<uint8_t> enable;
+    uint32_t threshold;
+  };
+
+  uint32_t best_source(size_t ctx);
+  uint32_t claim(size_t ctx);
+  void complete(size_t ctx, uint32_t source);
+  void update();
+
+  std::vector<processor_t*>& procs;
+  std::vector<uint32_t> priority;
+  std::vector<uint8_t> level;
+  std::vector<uint8_t> pending;
+  std::vector<uint8_t> claimed; // being serviced
+  std::vector<context_t> contexts;
+};
+
 class mmio_plugin_device_t : public abstract_device_t {
  public:
   mmio_plugin_device_t(const std::string& name, const std::string& args);
@@ -78,10 +177,38 @@ class mmio_plugin_device_t : public abstract_device_t {
 
   virtual bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   virtual bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
+  virtual void save(checkpoint_section_t& cp) override;
+  virtual void restore(const checkpoint_section_t& cp) override;
+
+  // Version 2 plugins are instantiated once the simulator whose services
+  // they use exists.  With a PLIC, their external interrupts raise
+  // plic_source instead of the harts' lines.  Returns whether the plugin is
+  // a version 2 one, and so uses the source.
+  bool attach(sim_t* sim, uint32_t plic_source);
 
  private:
+  std::string name;
+  std::string args;
+  bool v2;
   mmio_plugin_t plugin;
+  mmio_plugin_v2_t plugin_v2;
+  mmio_plugin_host_t host;
+  sim_t* sim;
+  reg_t tick_time; // mtime the plugin asked to be ticked at, or -1
+  uint32_t plic_source; // or 0 without a PLIC
+  std::set<std::pair<uint32_t, uint32_t>> ext_raised; // hart ID and irq
+  event_queue_t::event_id_t tick_event;
   void* user_data;
+
+  void post_tick();
+  void tick();
+
+  static void* host_mem_ptr(void* ctx, reg_t addr, size_t len);
+  static bool host_mem_load(void* ctx, reg_t addr, size_t len, uint8_t* bytes);
+  static bool host_mem_store(void* ctx, reg_t addr, size_t len, const uint8_t* bytes);
+  static void host_set_interrupt(void* ctx, uint32_t hartid, uint32_t irq, bool level);
+  static uint64_t host_get_time(void* ctx);
+  static void host_schedule_tick(void* ctx, uint64_t delay);
 };
 
 #endif
@@ -14,7 +14,8 @@ std::string make_dts(size_t insns_per_rtc_tick, size_t cpu_hz,
                      reg_t initrd_start, reg_t initrd_end,
                      const char* bootargs,
                      std::vector<processor_t*> procs,
-                     std::vector<std::pair<reg_t, mem_t*>> mems)
+                     std::vector<std::pair<reg_t, mem_t*>> mems,
+                     const std::vector<reg_t>& virtio_bases)
 {
   std::stringstream s;
   s << std::dec <<
@@ -90,8 +91,36 @@ std::string make_dts(size_t insns_per_rtc_tick, size_t cpu_hz,
   s << std::hex << ">;\n"
          "      reg = <0x" << (clintbs >> 32) << " 0x" << (clintbs & (uint32_t)-1) <<
                      " 0x" << (clintsz >> 32) << " 0x" << (clintsz & (uint32_t)-1) << ">;\n"
-         "    };\n"
-         "  };\n"
+         "    };\n";
+  if (!virtio_bases.empty()) {
+    reg_t plicbs = PLIC_BASE;
+    reg_t plicsz = PLIC_SIZE;
+    s << "    PLIC: interrupt-controller@" << plicbs << " {\n"
+         "      compatible = \"riscv,plic0\";\n"
+         "      #address-cells = <2>;\n"
+         "      #interrupt-cells = <1>;\n"
+         "      interrupt-controller;\n"
+         "      interrupts-extended = <" << std::dec;
+    for (size_t i = 0; i < procs.size(); i++)
+      s << "&CPU" << i << "_intc 11 &CPU" << i << "_intc 9 ";
+    s << std::hex << ">;\n"
+         "      reg = <0x" << (plicbs >> 32) << " 0x" << (plicbs & (uint32_t)-1) <<
+                     " 0x" << (plicsz >> 32) << " 0x" << (plicsz & (uint32_t)-1) << ">;\n"
+         "      riscv,ndev = <" << std::dec << plic_t::PLIC_NDEV << std::hex << ">;\n"
+         "    };\n";
+  }
+  for (size_t i = 0; i < virtio_bases.size(); i++) {
+    reg_t virtiobs = virtio_bases[i];
+    reg_t virtiosz = VIRTIO_SIZE;
+    s << "    virtio_mmio@" << virtiobs << " {\n"
+         "      compatible = \"virtio,mmio\";\n"
+         "      reg = <0x" << (virtiobs >> 32) << " 0x" << (virtiobs & (uint32_t)-1) <<
+                     " 0x" << (virtiosz >> 32) << " 0x" << (virtiosz & (uint32_t)-1) << ">;\n"
+         "      interrupt-parent = <&PLIC>;\n"
+         "      interrupts = <" << std::dec << (i + 1) << std::hex << ">;\n"
+         "    };\n";
+  }
+  s <<   "  };\n"
          "  htif {\n"
          "    compatible = \"ucb,htif0\";\n"
          "  };\n"
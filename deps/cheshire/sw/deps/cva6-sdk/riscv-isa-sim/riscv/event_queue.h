@@ -0,0 +1,53 @@
+// See LICENSE for license details.
+#ifndef _RISCV_EVENT_QUEUE_H
+#define _RISCV_EVENT_QUEUE_H
+
+#include "decode.h"
+#include <functional>
+#include <map>
+#include <utility>
+
+// Events posted by devices for a given simulated time, measured in the
+// instructions each hart has been stepped.  The simulator runs the harts
+// no further than the earliest pending event before servicing the queue,
+// so events fire exactly when they are due.
+class event_queue_t
+{
+ public:
+  typedef std::function<void(reg_t now)> callback_t;
+  // Identifies a posted event; events due at the same time fire in the
+  // order they were posted.
+  typedef std::pair<reg_t, uint64_t> event_id_t;
+
+  event_queue_t() : seq(0) {}
+
+  event_id_t schedule(reg_t when, const callback_t& callback)
+  {
+    event_id_t id(when, ++seq);
+    events.emplace(id, callback);
+    return id;
+  }
+
+  // Cancelling an event that has already fired, or was never posted
+  // (an id of event_id_t()), does nothing.
+  void cancel(const event_id_t& id) { events.erase(id); }
+
+  // time of the earliest pending event, or -1 if there is none
+  reg_t next_time() const { return events.empty() ? reg_t(-1) : events.begin()->first.first; }
+
+  // Fire every event due by now, including any that those post for now.
+  void run_due(reg_t now)
+  {
+    while (!events.empty() && events.begin()->first.first <= now) {
+      callback_t callback = std::move(events.begin()->second);
+      events.erase(events.begin());
+      callback(now);
+    }
+  }
+
+ private:
+  std::map<event_id_t, callback_t> events;
+  uint64_t seq;
+};
+
+#endif
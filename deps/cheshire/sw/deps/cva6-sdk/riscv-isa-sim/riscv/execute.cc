@@ -3,6 +3,7 @@
 #include "processor.h"
 #include "mmu.h"
 #include "disasm.h"
+#include "simpoint.h"
 #include <cassert>
 
 #ifdef RISCV_ENABLE_COMMITLOG
@@ -178,6 +179,8 @@ static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
 
   try {
     npc = fetch.func(p, fetch.insn, pc);
+    if (unlikely(npc == PC_TRAP))
+      return npc; // as if the trap had been thrown
     if (npc != PC_SERIALIZE_BEFORE) {
 
 #ifdef RISCV_ENABLE_COMMITLOG
@@ -211,6 +214,179 @@ static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
   return npc;
 }
 
+#ifdef RISCV_ENABLE_THREADED_DISPATCH
+// Execute a predecoded basic block, dispatching with computed gotos.  Uops
+// work directly on operand fields extracted at decode time; anything else
+// goes through execute_insn.  As in the interpreter loop, pc and instret
+// describe the instruction in flight so that traps see identical state.
+// On return, pc holds the next PC of the last instruction executed.
+static void execute_bb_threaded(processor_t* p, const bb_cache_entry_t* bb,
+                                reg_t& pc, size_t& instret)
+{
+  static const void* const dispatch[] = {
+    #define DEFINE_UOP(name) &&uop_##name,
+    UOP_LIST(DEFINE_UOP)
+    #undef DEFINE_UOP
+  };
+
+  state_t* state = p->get_state();
+  mmu_t* mmu = p->get_mmu();
+  const insn_uop_t* u = bb->uop;
+  const insn_uop_t* end = bb->uop + bb->len;
+  reg_t npc;
+
+  #define X(reg) state->XPR[reg]
+  #define WRITE_X(reg, value) state->XPR.write(reg, value)
+  #define DISPATCH() \
+    do { \
+      if (unlikely(++u == end)) \
+        goto done; \
+      instret++; \
+      state->pc = pc = npc; \
+      goto *dispatch[u->op]; \
+    } while (0)
+  #define SEQ(stmt) \
+    do { \
+      stmt; \
+      p->update_histogram(pc); \
+      npc = pc + u->len; \
+      DISPATCH(); \
+    } while (0)
+  #define JUMP(target) \
+    do { \
+      p->check_pc_alignment(target); \
+      npc = (target); \
+    } while (0)
+  #define BRANCH(cond) \
+    do { \
+      if (cond) \
+        JUMP(u->imm); \
+      else \
+        npc = pc + u->len; \
+      p->update_histogram(pc); \
+      goto done; \
+    } while (0)
+
+  goto *dispatch[u->op];
+
+uop_FUNC:
+  npc = execute_insn(p, pc, bb->data[u - bb->uop]);
+  if (unlikely(npc != pc + u->len))
+    goto done;
+  DISPATCH();
+uop_LI:    SEQ(WRITE_X(u->rd, u->imm));
+uop_ADD:   SEQ(WRITE_X(u->rd, X(u->rs1) + X(u->rs2)));
+uop_SUB:   SEQ(WRITE_X(u->rd, X(u->rs1) - X(u->rs2)));
+uop_AND:   SEQ(WRITE_X(u->rd, X(u->rs1) & X(u->rs2)));
+uop_OR:    SEQ(WRITE_X(u->rd, X(u->rs1) | X(u->rs2)));
+uop_XOR:   SEQ(WRITE_X(u->rd, X(u->rs1) ^ X(u->rs2)));
+uop_SLL:   SEQ(WRITE_X(u->rd, X(u->rs1) << (X(u->rs2) & 0x3F)));
+uop_SRL:   SEQ(WRITE_X(u->rd, X(u->rs1) >> (X(u->rs2) & 0x3F)));
+uop_SRA:   SEQ(WRITE_X(u->rd, sreg_t(X(u->rs1)) >> (X(u->rs2) & 0x3F)));
+uop_SLT:   SEQ(WRITE_X(u->rd, sreg_t(X(u->rs1)) < sreg_t(X(u->rs2))));
+uop_SLTU:  SEQ(WRITE_X(u->rd, X(u->rs1) < X(u->rs2)));
+uop_ADDW:  SEQ(WRITE_X(u->rd, sext32(X(u->rs1) + X(u->rs2))));
+uop_SUBW:  SEQ(WRITE_X(u->rd, sext32(X(u->rs1) - X(u->rs2))));
+uop_ADDI:  SEQ(WRITE_X(u->rd, X(u->rs1) + u->imm));
+uop_ANDI:  SEQ(WRITE_X(u->rd, X(u->rs1) & u->imm));
+uop_ORI:   SEQ(WRITE_X(u->rd, X(u->rs1) | u->imm));
+uop_XORI:  SEQ(WRITE_X(u->rd, X(u->rs1) ^ u->imm));
+uop_SLTI:  SEQ(WRITE_X(u->rd, sreg_t(X(u->rs1)) < sreg_t(u->imm)));
+uop_SLTIU: SEQ(WRITE_X(u->rd, X(u->rs1) < u->imm));
+uop_SLLI:  SEQ(WRITE_X(u->rd, X(u->rs1) << u->imm));
+uop_SRLI:  SEQ(WRITE_X(u->rd, X(u->rs1) >> u->imm));
+uop_SRAI:  SEQ(WRITE_X(u->rd, sreg_t(X(u->rs1)) >> u->imm));
+uop_ADDIW: SEQ(WRITE_X(u->rd, sext32(X(u->rs1) + u->imm)));
+uop_SLLIW: SEQ(WRITE_X(u->rd, sext32(X(u->rs1) << u->imm)));
+uop_SRLIW: SEQ(WRITE_X(u->rd, sext32((uint32_t)X(u->rs1) >> u->imm)));
+uop_SRAIW: SEQ(WRITE_X(u->rd, sext32(int32_t(X(u->rs1)) >> u->imm)));
+uop_LB:    SEQ(WRITE_X(u->rd, mmu->load_int8(X(u->rs1) + u->imm)));
+uop_LBU:   SEQ(WRITE_X(u->rd, mmu->load_uint8(X(u->rs1) + u->imm)));
+uop_LH:    SEQ(WRITE_X(u->rd, mmu->load_int16(X(u->rs1) + u->imm)));
+uop_LHU:   SEQ(WRITE_X(u->rd, mmu->load_uint16(X(u->rs1) + u->imm)));
+uop_LW:    SEQ(WRITE_X(u->rd, mmu->load_int32(X(u->rs1) + u->imm)));
+uop_LWU:   SEQ(WRITE_X(u->rd, mmu->load_uint32(X(u->rs1) + u->imm)));
+uop_LD:    SEQ(WRITE_X(u->rd, mmu->load_int64(X(u->rs1) + u->imm)));
+uop_SB:    SEQ(mmu->store_uint8(X(u->rs1) + u->imm, X(u->rs2)));
+uop_SH:    SEQ(mmu->store_uint16(X(u->rs1) + u->imm, X(u->rs2)));
+uop_SW:    SEQ(mmu->store_uint32(X(u->rs1) + u->imm, X(u->rs2)));
+uop_SD:    SEQ(mmu->store_uint64(X(u->rs1) + u->imm, X(u->rs2)));
+uop_BEQ:   BRANCH(X(u->rs1) == X(u->rs2));
+uop_BNE:   BRANCH(X(u->rs1) != X(u->rs2));
+uop_BLT:   BRANCH(sreg_t(X(u->rs1)) < sreg_t(X(u->rs2)));
+uop_BGE:   BRANCH(sreg_t(X(u->rs1)) >= sreg_t(X(u->rs2)));
+uop_BLTU:  BRANCH(X(u->rs1) < X(u->rs2));
+uop_BGEU:  BRANCH(X(u->rs1) >= X(u->rs2));
+uop_JAL:
+  JUMP(u->imm);
+  WRITE_X(u->rd, pc + u->len);
+  p->update_histogram(pc);
+  goto done;
+uop_JALR: {
+  reg_t target = (X(u->rs1) + u->imm) & ~reg_t(1);
+  JUMP(target);
+  WRITE_X(u->rd, pc + u->len);
+  p->update_histogram(pc);
+  goto done;
+}
+
+done:
+  pc = npc;
+
+  #undef X
+  #undef WRITE_X
+  #undef DISPATCH
+  #undef SEQ
+  #undef JUMP
+  #undef BRANCH
+}
+
+// The commit log records every register write, which uops bypass.
+static bool threaded_dispatch_enabled(processor_t* p)
+{
+#ifdef RISCV_ENABLE_COMMITLOG
+  return !p->get_log_commits_enabled();
+#else
+  return true;
+#endif
+}
+#endif
+
+#ifdef RISCV_ENABLE_DBT
+// Translated code bypasses the commit log and the PC histogram, and
+// accesses memory in host byte order.
+static bool dbt_enabled(processor_t* p)
+{
+#ifdef RISCV_ENABLE_HISTOGRAM
+  return false;
+#endif
+#ifdef RISCV_ENABLE_COMMITLOG
+  if (p->get_log_commits_enabled())
+    return false;
+#endif
+  return p->get_mmu()->get_dbt() && !p->get_mmu()->is_target_big_endian();
+}
+#endif
+
+void processor_t::deliver_trap(trap_t& t, reg_t epc)
+{
+  take_trap(t, epc);
+
+  if (unlikely(state.single_step == state.STEP_STEPPED)) {
+    state.single_step = state.STEP_NONE;
+    enter_debug_mode(DCSR_CAUSE_STEP);
+  }
+}
+
+// Takes the trap an instruction (or take_pending_interrupt) recorded with
+// set_pending_trap; epc is the PC of the instruction that raised it.
+void processor_t::take_pending_trap(reg_t epc)
+{
+  trap_t* t = pending_trap;
+  pending_trap = NULL;
+  deliver_trap(*t, epc);
+}
+
 bool processor_t::slow_path()
 {
   return debug || state.single_step != state.STEP_NONE || state.debug_mode;
@@ -219,6 +395,12 @@ bool processor_t::slow_path()
 // fetch/decode/execute loop
 void processor_t::step(size_t n)
 {
+  if (unlikely(in_wfi)) {
+    if (is_waiting_for_interrupt())
+      return;
+    in_wfi = false;
+  }
+
   if (!state.debug_mode) {
     if (halt_request == HR_REGULAR) {
       enter_debug_mode(DCSR_CAUSE_DEBUGINT);
@@ -234,6 +416,13 @@ void processor_t::step(size_t n)
     size_t instret = 0;
     reg_t pc = state.pc;
     mmu_t* _mmu = mmu;
+#ifdef RISCV_ENABLE_THREADED_DISPATCH
+    bool threaded = threaded_dispatch_enabled(this);
+#endif
+#ifdef RISCV_ENABLE_DBT
+    bool translate = dbt_enabled(this);
+    const dbt_ctx_t* dbt_ctx = _mmu->get_dbt() ? _mmu->get_dbt()->get_ctx() : NULL;
+#endif
 
     #define advance_pc() \
      if (unlikely(invalid_pc(pc))) { \
@@ -241,6 +430,7 @@ void processor_t::step(size_t n)
          case PC_SERIALIZE_BEFORE: state.serialized = true; break; \
          case PC_SERIALIZE_AFTER: ++instret; break; \
          case PC_SERIALIZE_WFI: n = ++instret; break; \
+         case PC_TRAP: take_pending_trap(state.pc); n = instret; break; \
          default: abort(); \
        } \
        pc = state.pc; \
@@ -253,8 +443,17 @@ void processor_t::step(size_t n)
     try
     {
       take_pending_interrupt();
+      _mmu->sync_tlb_context();
 
-      if (unlikely(slow_path()))
+      if (unlikely(pending_trap != NULL))
+      {
+        // An interrupt doesn't end the hart's turn: its handler runs in
+        // the rest of it, from the instruction at which it became pending.
+        // Taking it masks it, so it can't be taken again.
+        take_pending_trap(pc);
+        continue;
+      }
+      else if (unlikely(slow_path()))
       {
         // Main simulation loop, slow path.
         while (instret < n)
@@ -273,7 +472,8 @@ void processor_t::step(size_t n)
           }
 
           insn_fetch_t fetch = mmu->load_insn(pc);
-          if (debug && !state.serialized)
+          // a fetch that faulted has no instruction to show
+          if (debug && !state.serialized && fetch.func != mmu_t::take_fetch_fault)
             disasm(fetch.insn);
           pc = execute_insn(this, pc, fetch);
           advance_pc();
@@ -282,6 +482,48 @@ void processor_t::step(size_t n)
       else while (instret < n)
       {
         // Main simulation loop, fast path.
+        if (unlikely(bbv_profiler != NULL))
+          bbv_profiler->enter_block(pc, state.minstret + instret);
+        auto bb = _mmu->access_bb_cache(pc);
+#ifdef RISCV_ENABLE_DBT
+        if (likely(bb && bb->len <= n - instret && translate)) {
+          dbt_code_t code = bb->jit;
+          if (unlikely(!code && ++bb->hits == dbt_t::HOT_THRESHOLD))
+            code = bb->jit = _mmu->translate_bb(bb);
+          if (code) {
+            // A translated block retires nothing if its first instruction
+            // needs the interpreter; let the code below handle it.
+            dbt_result_t res = code(dbt_ctx);
+            if (likely(res.retired != 0)) {
+              instret += res.retired;
+              state.pc = pc = res.npc;
+              continue;
+            }
+          }
+        }
+#endif
+#ifdef RISCV_ENABLE_THREADED_DISPATCH
+        if (likely(bb && bb->len <= n - instret && threaded)) {
+          execute_bb_threaded(this, bb, pc, instret);
+          advance_pc();
+          continue;
+        }
+#endif
+        if (likely(bb && bb->len <= n - instret)) {
+          // Run the whole predecoded block; only a trap or a serializing
+          // instruction can leave it early.
+          for (size_t i = 0; ; ) {
+            pc = execute_insn(this, pc, bb->data[i]);
+            if (++i == bb->len || unlikely(pc != bb->pc[i]))
+              break;
+            instret++;
+            state.pc = pc;
+          }
+
+          advance_pc();
+          continue;
+        }
+
         for (auto ic_entry = _mmu->access_icache(pc); ; ) {
           auto fetch = ic_entry->data;
           pc = execute_insn(this, pc, fetch);
@@ -299,13 +541,8 @@ void processor_t::step(size_t n)
     }
     catch(trap_t& t)
     {
-      take_trap(t, pc);
+      deliver_trap(t, pc);
       n = instret;
-
-      if (unlikely(state.single_step == state.STEP_STEPPED)) {
-        state.single_step = state.STEP_NONE;
-        enter_debug_mode(DCSR_CAUSE_STEP);
-      }
     }
     catch (trigger_matched_t& t)
     {
@@ -344,9 +581,17 @@ void processor_t::step(size_t n)
       // allows us to switch to other threads only once per idle loop in case
       // there is activity.
       n = ++instret;
+      in_wfi = idle_skip_enabled && !state.debug_mode;
     }
 
     state.minstret += instret;
+    if (cpi) {
+      reg_t millicycles = instret * cpi + cpi_carry;
+      state.mcycle += millicycles / 1000;
+      cpi_carry = millicycles % 1000;
+    } else {
+      state.mcycle += instret;
+    }
     n -= instret;
   }
 }
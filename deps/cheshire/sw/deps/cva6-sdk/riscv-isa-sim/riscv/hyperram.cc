@@ -0,0 +1,89 @@
+// See LICENSE for license details.
+
+#include "hyperram.h"
+#include "platform.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+hyperram_t::hyperram_t(unsigned phys, unsigned chips, unsigned latency, unsigned burst_max)
+  : phys(phys), chips(chips), latency(latency), burst_max(burst_max),
+    reads(0), writes(0), bytes_read(0), bytes_written(0), transactions(0),
+    cycles(0), chip_accesses(chips)
+{
+}
+
+hyperram_t::~hyperram_t()
+{
+  if (reads + writes == 0)
+    return;
+
+  std::cout << std::setprecision(3) << std::fixed;
+  std::cout << "HyperRAM " << "Reads:                 " << reads << std::endl;
+  std::cout << "HyperRAM " << "Writes:                " << writes << std::endl;
+  std::cout << "HyperRAM " << "Bytes Read:            " << bytes_read << std::endl;
+  std::cout << "HyperRAM " << "Bytes Written:         " << bytes_written << std::endl;
+  std::cout << "HyperRAM " << "Transactions:          " << transactions << std::endl;
+  std::cout << "HyperRAM " << "Busy Cycles:           " << cycles << std::endl;
+  for (unsigned i = 0; i < chips; i++)
+    std::cout << "HyperRAM " << "Chip " << i << " Accesses:       " << chip_accesses[i] << std::endl;
+  std::cout << "HyperRAM " << "Bandwidth:             " << double(bytes_read + bytes_written) / cycles
+            << " B/cycle" << std::endl;
+  std::cout << "HyperRAM " << "Peak Bandwidth:        " << 2 * phys << " B/cycle" << std::endl;
+}
+
+static void help()
+{
+  std::cerr << "HyperRAM configurations must be of the form" << std::endl;
+  std::cerr << "  phys:chips[:latency[:burst]]" << std::endl;
+  std::cerr << "where phys is 1 or 2, the HyperBus PHYs working side by side," << std::endl;
+  std::cerr << "chips the RAMs on each PHY, latency the initial access latency" << std::endl;
+  std::cerr << "in cycles, from 3 to 7 [default 6], and burst the longest" << std::endl;
+  std::cerr << "transaction in cycles [default 350]." << std::endl;
+  exit(1);
+}
+
+hyperram_t* hyperram_t::construct(const char* config)
+{
+  char* end;
+  unsigned long phys = strtoul(config, &end, 0);
+  if (*end++ != ':')
+    help();
+  unsigned long chips = strtoul(end, &end, 0);
+  unsigned long latency = 6, burst = 350;
+  if (*end == ':')
+    latency = strtoul(end + 1, &end, 0);
+  if (*end == ':')
+    burst = strtoul(end + 1, &end, 0);
+
+  if (*end || phys < 1 || phys > 2 || chips < 1 || latency < 3 || latency > 7 ||
+      burst < 2 || burst > UINT16_MAX)
+    help();
+  return new hyperram_t(phys, chips, latency, burst);
+}
+
+uint64_t hyperram_t::access(uint64_t addr, size_t bytes, bool store)
+{
+  if (addr < DRAM_BASE || addr - DRAM_BASE >= size())
+    return 0;
+
+  store ? writes++ : reads++;
+  (store ? bytes_written : bytes_read) += bytes;
+  chip_accesses[(addr - DRAM_BASE) / (CHIP_SIZE * phys)]++;
+
+  // each cycle moves a 16-bit word on each PHY; the burst timer ends a
+  // transaction one cycle before it runs out
+  uint64_t word = 2 * phys;
+  uint64_t words = (addr % word + bytes + word - 1) / word;
+  uint64_t taken = 0;
+  while (words) {
+    uint64_t n = std::min(words, burst_max - 1);
+    taken += CA_CYCLES + 2 * latency + n + T_CSH_CYCLES + T_READ_WRITE_RECOVERY;
+    words -= n;
+    transactions++;
+  }
+
+  cycles += taken;
+  return taken;
+}
@@ -0,0 +1,56 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_HYPERRAM_H
+#define _RISCV_HYPERRAM_H
+
+#include "cachesim.h"
+#include <vector>
+
+// Cheshire's HyperBus controller and the S27KS0641 HyperRAMs behind it, as
+// a memory model.  Each access is a HyperBus transaction, timed as the
+// controller's PHY runs it, in cycles of the system clock that also clocks
+// the PHY: three cycles of command-address, the initial access latency, one
+// cycle for each 16-bit word on each PHY in use, then chip-select high and
+// read-write recovery.  The RAMs power up in fixed-latency mode, so every
+// access waits twice the configured latency.  A transaction longer than
+// the maximum burst is split in two, each paying the overheads again.  The
+// controller serves one transaction at a time.  The RAMs fill the DRAM
+// window from DRAM_BASE; accesses anywhere else go to other slaves and take
+// none of their time.
+class hyperram_t : public mem_model_t
+{
+ public:
+  hyperram_t(unsigned phys, unsigned chips, unsigned latency, unsigned burst_max);
+  ~hyperram_t();
+
+  uint64_t access(uint64_t addr, size_t bytes, bool store);
+
+  // from phys:chips[:latency[:burst]]
+  static hyperram_t* construct(const char* config);
+
+  // the 64 Mib of an S27KS0641
+  static const uint64_t CHIP_SIZE = 8 << 20;
+  uint64_t size() const { return CHIP_SIZE * phys * chips; }
+
+ private:
+  // the controller's defaults for the configuration registers not set by
+  // construct, in cycles
+  static const uint64_t CA_CYCLES = 3;
+  static const uint64_t T_CSH_CYCLES = 1;
+  static const uint64_t T_READ_WRITE_RECOVERY = 6;
+
+  unsigned phys;
+  unsigned chips;
+  uint64_t latency;
+  uint64_t burst_max;
+
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t transactions;
+  uint64_t cycles;
+  std::vector<uint64_t> chip_accesses;
+};
+
+#endif
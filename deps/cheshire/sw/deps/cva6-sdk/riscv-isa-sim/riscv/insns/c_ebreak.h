@@ -1,2 +1,2 @@
 require_extension('C');
-throw trap_breakpoint(pc);
+defer_trap(trap_breakpoint, pc);
@@ -0,0 +1,232 @@
+// See LICENSE for license details.
+
+#include "llc.h"
+#include "arith.h"
+#include <cstdlib>
+#include <iostream>
+
+llc_sim_t::llc_sim_t(size_t sets, size_t ways, size_t linesz,
+                     uint64_t hit_latency, uint64_t miss_latency)
+  : cache_sim_t(sets, ways, linesz, "LLC$"),
+    all_ways(ways == 64 ? ~uint64_t(0) : (uint64_t(1) << ways) - 1),
+    cfg_spm(all_ways), cfg_flush(0), spm(all_ways), flushed(all_ways),
+    bypasses(0), spm_accesses(0), flushes(0), flush_writebacks(0)
+{
+  set_latency(hit_latency, miss_latency);
+}
+
+llc_sim_t::~llc_sim_t()
+{
+  if (in.count[axi_counters_t::AR_DONE] + in.count[axi_counters_t::AW_DONE] == 0)
+    return;
+
+  std::cout << name << " ";
+  std::cout << "Bypassed Accesses:     " << bypasses << std::endl;
+  std::cout << name << " ";
+  std::cout << "SPM Accesses:          " << spm_accesses << std::endl;
+  std::cout << name << " ";
+  std::cout << "Ways Flushed:          " << flushes << std::endl;
+  std::cout << name << " ";
+  std::cout << "Flush Writebacks:      " << flush_writebacks << std::endl;
+  in.print(name + " llc");
+  out.print(name + " dram");
+}
+
+static void help()
+{
+  std::cerr << "LLC configurations must be of the form" << std::endl;
+  std::cerr << "  sets:ways:blocksize[:hit:miss]" << std::endl;
+  std::cerr << "where sets, ways, and blocksize are positive integers, with" << std::endl;
+  std::cerr << "sets and blocksize both powers of two, blocksize at least 8" << std::endl;
+  std::cerr << "and at most 64 ways.  A hit takes hit cycles [default 4], and" << std::endl;
+  std::cerr << "a miss miss cycles [default 8] and those of the refill." << std::endl;
+  exit(1);
+}
+
+llc_sim_t* llc_sim_t::construct(const char* config)
+{
+  const char* wp = strchr(config, ':');
+  if (!wp++) help();
+  const char* bp = strchr(wp, ':');
+  if (!bp++) help();
+
+  size_t sets = atoi(std::string(config, wp).c_str());
+  size_t ways = atoi(std::string(wp, bp).c_str());
+  size_t linesz = atoi(bp);
+  uint64_t hit = 4, miss = 8;
+  if (const char* hp = strchr(bp, ':')) {
+    const char* mp = strchr(++hp, ':');
+    if (!mp++) help();
+    hit = strtoull(hp, NULL, 0);
+    miss = strtoull(mp, NULL, 0);
+  }
+
+  if (ways == 0 || ways > 64)
+    help();
+  return new llc_sim_t(sets, ways, linesz, hit, miss);
+}
+
+uint64_t llc_sim_t::access(uint64_t addr, size_t bytes, bool store)
+{
+  // only the ways committed as scratchpad back it
+  reg_t spm_size = sets * popcount(spm) * linesz;
+  bool to_spm = (addr >= SPM_BASE && addr < SPM_BASE + spm_size) ||
+                (addr >= SPM_UNCACHED_BASE && addr < SPM_UNCACHED_BASE + spm_size);
+  // the crossbar routes anything else around the LLC
+  if (!to_spm && (addr < OUT_BASE || addr >= OUT_END))
+    return 0;
+
+  store ? in.write(bytes) : in.read(bytes);
+  if (to_spm) {
+    spm_accesses++;
+    return hit_latency;
+  }
+  if (flushed == all_ways) {
+    bypasses++;
+    return next_level(addr, bytes, store);
+  }
+
+  return cache_sim_t::access(addr, bytes, store);
+}
+
+// Like axi_llc's eviction unit, fills an empty way if there is one and
+// otherwise evicts a pseudo-random one, but never uses a flushed way.
+uint64_t llc_sim_t::victimize(uint64_t addr)
+{
+  uint64_t* set = &tags[((addr >> idx_shift) & (sets-1)) * ways];
+  size_t way = ways;
+  for (size_t i = 0; i < ways && way == ways; i++)
+    if (!((flushed >> i) & 1) && !(set[i] & VALID))
+      way = i;
+  while (way == ways) {
+    size_t i = lfsr.next() % ways;
+    if (!((flushed >> i) & 1))
+      way = i;
+  }
+
+  uint64_t victim = set[way];
+  set[way] = (addr >> idx_shift) | VALID;
+  return victim;
+}
+
+uint64_t llc_sim_t::next_level(uint64_t addr, size_t bytes, bool store)
+{
+  store ? out.write(bytes) : out.read(bytes);
+  return cache_sim_t::next_level(addr, bytes, store);
+}
+
+void llc_sim_t::flush(uint64_t mask)
+{
+  for (size_t way = 0; way < ways; way++) {
+    if (!((mask >> way) & 1))
+      continue;
+    for (size_t idx = 0; idx < sets; idx++) {
+      uint64_t& tag = tags[idx*ways + way];
+      if ((tag & (VALID | DIRTY)) == (VALID | DIRTY)) {
+        next_level((tag & ~(VALID | DIRTY)) << idx_shift, linesz, true);
+        flush_writebacks++;
+      }
+      tag = 0;
+    }
+    flushes++;
+  }
+}
+
+void llc_sim_t::commit()
+{
+  // flushed ways are empty already
+  flush((cfg_spm | cfg_flush) & ~flushed);
+  spm = cfg_spm;
+  flushed = cfg_spm | cfg_flush;
+  cfg_flush = 0;
+}
+
+/* 00 CFG_SPM, low and high halves
+ * 08 CFG_FLUSH, low and high halves
+ * 10 COMMIT_CFG
+ * 18 FLUSHED, low and high halves
+ * 20 BIST_OUT, low and high halves
+ * 28 SET_ASSO, low and high halves
+ * 30 NUM_LINES, low and high halves
+ * 38 NUM_BLOCKS, low and high halves
+ * 40 VERSION, low and high halves
+ * 48 BIST_STATUS
+ *
+ * The model has no tag memory to test: its BIST is done at once and finds
+ * nothing.  A block is a beat of the AXI data bus.
+ */
+
+#define CFG_SPM		0x00
+#define CFG_FLUSH	0x08
+#define COMMIT_CFG	0x10
+#define FLUSHED		0x18
+#define BIST_OUT	0x20
+#define SET_ASSO	0x28
+#define NUM_LINES	0x30
+#define NUM_BLOCKS	0x38
+#define VERSION		0x40
+#define BIST_STATUS	0x48
+
+bool llc_sim_t::load_reg(reg_t addr, uint32_t* val)
+{
+  uint64_t reg;
+  switch (addr & ~reg_t(7)) {
+    case CFG_SPM: reg = cfg_spm; break;
+    case CFG_FLUSH: reg = cfg_flush; break;
+    case FLUSHED: reg = flushed; break;
+    case SET_ASSO: reg = ways; break;
+    case NUM_LINES: reg = sets; break;
+    case NUM_BLOCKS: reg = linesz / axi_counters_t::BEAT; break;
+    case COMMIT_CFG:
+    case BIST_OUT:
+    case VERSION: reg = 0; break;
+    case BIST_STATUS: reg = addr == BIST_STATUS; break;
+    default: return false;
+  }
+  *val = reg >> (addr & 4 ? 32 : 0);
+  return true;
+}
+
+bool llc_sim_t::store_reg(reg_t addr, uint32_t val)
+{
+  uint64_t* reg;
+  switch (addr & ~reg_t(7)) {
+    case CFG_SPM: reg = &cfg_spm; break;
+    case CFG_FLUSH: reg = &cfg_flush; break;
+    case COMMIT_CFG:
+      if (addr == COMMIT_CFG && (val & 1))
+        commit();
+      return true;
+    default: return addr < BIST_STATUS + 4; // read-only
+  }
+
+  int shift = addr & 4 ? 32 : 0;
+  *reg = ((*reg & ~(uint64_t(UINT32_MAX) << shift)) | (uint64_t(val) << shift)) & all_ways;
+  return true;
+}
+
+bool llc_regs_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if ((len != 4 && len != 8) || addr % len != 0)
+    return false;
+  for (size_t i = 0; i < len; i += 4) {
+    uint32_t val;
+    if (!llc->load_reg(addr + i, &val))
+      return false;
+    memcpy(bytes + i, &val, 4);
+  }
+  return true;
+}
+
+bool llc_regs_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  if ((len != 4 && len != 8) || addr % len != 0)
+    return false;
+  for (size_t i = 0; i < len; i += 4) {
+    uint32_t val;
+    memcpy(&val, bytes + i, 4);
+    if (!llc->store_reg(addr + i, val))
+      return false;
+  }
+  return true;
+}
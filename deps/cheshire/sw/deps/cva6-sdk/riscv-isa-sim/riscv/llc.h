@@ -0,0 +1,101 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_LLC_H
+#define _RISCV_LLC_H
+
+#include "cachesim.h"
+#include "abstract_device.h"
+#include "devices.h"
+#include "axi_counters.h"
+
+// Cheshire's AXI last-level cache (axi_llc).  It caches the memory behind
+// it, the LLC-out region, and any of its ways can instead serve as
+// scratchpad, which appears at SPM_BASE and, bypassing the cores' caches,
+// at SPM_UNCACHED_BASE, as large as the ways committed to it.  Software
+// configures the ways through registers at LLC_BASE: those in CFG_SPM
+// become scratchpad and those in CFG_FLUSH are written back and emptied
+// when COMMIT is written, and either kind stays out of the cache, its bit
+// set in FLUSHED, until a later commit.  As in the hardware, all ways are
+// scratchpad out of reset, so that the LLC is bypassed until software
+// commits a configuration.
+//
+// A hit takes hit_latency cycles and a miss miss_latency cycles plus those
+// of the refill.  The traffic on the ports to the cores and to memory is
+// counted as the LLC and DRAM perf counters of Cheshire would count it.
+class llc_sim_t : public cache_sim_t
+{
+ public:
+  llc_sim_t(size_t sets, size_t ways, size_t linesz,
+            uint64_t hit_latency, uint64_t miss_latency);
+  ~llc_sim_t();
+
+  uint64_t access(uint64_t addr, size_t bytes, bool store);
+
+  // the register block
+  bool load_reg(reg_t addr, uint32_t* val);
+  bool store_reg(reg_t addr, uint32_t val);
+
+  // the scratchpad with every way committed to it
+  reg_t max_spm_size() const { return sets * ways * linesz; }
+
+  const axi_counters_t& get_in_counters() const { return in; }
+  const axi_counters_t& get_out_counters() const { return out; }
+
+  // from sets:ways:blocksize[:hit:miss]
+  static llc_sim_t* construct(const char* config);
+
+  static const reg_t SPM_BASE = 0x10000000;
+  static const reg_t SPM_UNCACHED_BASE = 0x14000000;
+  static const reg_t OUT_BASE = 0x80000000;
+  static const reg_t OUT_END = 0x100000000;
+
+ protected:
+  uint64_t victimize(uint64_t addr);
+  uint64_t next_level(uint64_t addr, size_t bytes, bool store);
+
+ private:
+  void commit();
+  void flush(uint64_t mask);
+
+  uint64_t all_ways;
+  uint64_t cfg_spm;
+  uint64_t cfg_flush;
+  uint64_t spm; // ways serving as scratchpad
+  uint64_t flushed; // ways kept out of the cache
+
+  uint64_t bypasses;
+  uint64_t spm_accesses;
+  uint64_t flushes;
+  uint64_t flush_writebacks;
+
+  axi_counters_t in; // from the cores
+  axi_counters_t out; // to memory
+};
+
+// The LLC's register block, at LLC_BASE
+class llc_regs_t : public abstract_device_t
+{
+ public:
+  llc_regs_t(llc_sim_t* llc) : llc(llc) {}
+  bool load(reg_t addr, size_t len, uint8_t* bytes);
+  bool store(reg_t addr, size_t len, const uint8_t* bytes);
+
+ private:
+  llc_sim_t* llc;
+};
+
+// The scratchpad's memory, from offset in mem, seen at SPM_UNCACHED_BASE.
+// Its accesses go around the cores' caches, as I/O does.
+class llc_spm_alias_t : public abstract_device_t
+{
+ public:
+  llc_spm_alias_t(mem_t* mem, reg_t offset) : mem(mem), offset(offset) {}
+  bool load(reg_t addr, size_t len, uint8_t* bytes) { return mem->load(offset + addr, len, bytes); }
+  bool store(reg_t addr, size_t len, const uint8_t* bytes) { return mem->store(offset + addr, len, bytes); }
+
+ private:
+  mem_t* mem;
+  reg_t offset;
+};
+
+#endif
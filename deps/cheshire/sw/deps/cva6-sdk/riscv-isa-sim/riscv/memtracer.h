@@ -21,6 +21,12 @@ class memtracer_t
 
   virtual bool interested_in_range(uint64_t begin, uint64_t end, access_type type) = 0;
   virtual void trace(uint64_t addr, size_t bytes, access_type type) = 0;
+  // traces the access and returns the cycles it stalls the hart for
+  virtual uint64_t trace_stall(uint64_t addr, size_t bytes, access_type type)
+  {
+    trace(addr, bytes, type);
+    return 0;
+  }
 };
 
 class memtracer_list_t : public memtracer_t
@@ -36,8 +42,14 @@ class memtracer_list_t : public memtracer_t
   }
   void trace(uint64_t addr, size_t bytes, access_type type)
   {
+    trace_stall(addr, bytes, type);
+  }
+  uint64_t trace_stall(uint64_t addr, size_t bytes, access_type type)
+  {
+    uint64_t cycles = 0;
     for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
-      (*it)->trace(addr, bytes, type);
+      cycles += (*it)->trace_stall(addr, bytes, type);
+    return cycles;
   }
   void hook(memtracer_t* h)
   {
@@ -40,6 +40,69 @@ typedef struct {
 extern void register_mmio_plugin(const char* name_cstr,
                                  const mmio_plugin_t* mmio_plugin);
 
+// Version 2 of the plugin interface lets a device act as a bus master,
+// raise interrupts and run on a timer.  Plugins built against version 1
+// keep working unchanged.
+#define MMIO_PLUGIN_ABI_VERSION 2
+
+// Services the simulator provides to a version 2 plugin instance.  Each
+// function takes the instance's ctx as its first parameter.  Times are in
+// ticks of the CLINT's mtime.
+typedef struct {
+  void* ctx;
+
+  // Return a host pointer to the len bytes of target RAM at physical
+  // address addr, or NULL if they don't lie in one RAM region.  The
+  // pointer stays valid for the lifetime of the simulation.
+  void* (*mem_ptr)(void* ctx, reg_t addr, size_t len);
+
+  // Load or store len bytes at physical address addr, which may belong to
+  // RAM or to any device, as a single burst.  Return true on success.
+  bool (*mem_load)(void* ctx, reg_t addr, size_t len, uint8_t* bytes);
+  bool (*mem_store)(void* ctx, reg_t addr, size_t len, const uint8_t* bytes);
+
+  // Drive interrupt irq (e.g. 11 for the machine external interrupt) of
+  // the hart with the given hart ID.
+  void (*set_interrupt)(void* ctx, uint32_t hartid, uint32_t irq, bool level);
+
+  // The current time, and a request for the plugin's tick function to be
+  // called once delay ticks from now.  A later request replaces an
+  // earlier one; periodic devices make a new one from each tick.
+  uint64_t (*get_time)(void* ctx);
+  void (*schedule_tick)(void* ctx, uint64_t delay);
+} mmio_plugin_host_t;
+
+typedef struct {
+  // MMIO_PLUGIN_ABI_VERSION as the plugin was built
+  uint32_t abi_version;
+
+  // As for version 1, except that alloc also receives the simulator's
+  // services, which remain valid until dealloc.
+  void* (*alloc)(const char* args, const mmio_plugin_host_t* host);
+
+  // As for version 1, except that accesses may be of any length and
+  // alignment; bursts from other bus masters arrive in one call.  (Version
+  // 1 plugins see them split into naturally aligned pieces of at most 8
+  // bytes.)
+  bool (*load)(void*, reg_t, size_t, uint8_t*);
+  bool (*store)(void*, reg_t, size_t, const uint8_t*);
+
+  void (*dealloc)(void*);
+
+  // Called when a tick requested through the host is due, with the
+  // current time.  May be NULL if the plugin never requests ticks.
+  void (*tick)(void*, uint64_t now);
+
+  // Save the device's state for a checkpoint by passing it to put, and
+  // restore it from what was saved.  Either may be NULL, in which case
+  // the device's state isn't saved.
+  void (*save)(void*, void* cp, void (*put)(void* cp, const uint8_t* bytes, size_t len));
+  bool (*restore)(void*, const uint8_t* bytes, size_t len);
+} mmio_plugin_v2_t;
+
+extern void register_mmio_plugin_v2(const char* name_cstr,
+                                    const mmio_plugin_v2_t* mmio_plugin);
+
 #ifdef __cplusplus
 }
 
@@ -86,6 +149,74 @@ struct mmio_plugin_registration_t
     register_mmio_plugin(name.c_str(), &plugin);
   }
 };
+
+// Default behaviour for the optional parts of a C++ version 2 plugin;
+// classes registered with mmio_plugin_v2_registration_t derive from it and
+// override what they need.
+struct mmio_plugin_v2_base_t
+{
+  void tick(uint64_t now) {}
+  std::string save() { return std::string(); }
+  bool restore(const std::string& state) { return state.empty(); }
+};
+
+// Like mmio_plugin_registration_t, for classes constructed from the
+// argument string and the simulator's services.
+template <typename T>
+struct mmio_plugin_v2_registration_t
+{
+  static void* alloc(const char* args, const mmio_plugin_host_t* host)
+  {
+    return reinterpret_cast<void*>(new T(std::string(args), host));
+  }
+
+  static bool load(void* self, reg_t addr, size_t len, uint8_t* bytes)
+  {
+    return reinterpret_cast<T*>(self)->load(addr, len, bytes);
+  }
+
+  static bool store(void* self, reg_t addr, size_t len, const uint8_t* bytes)
+  {
+    return reinterpret_cast<T*>(self)->store(addr, len, bytes);
+  }
+
+  static void dealloc(void* self)
+  {
+    delete reinterpret_cast<T*>(self);
+  }
+
+  static void tick(void* self, uint64_t now)
+  {
+    reinterpret_cast<T*>(self)->tick(now);
+  }
+
+  static void save(void* self, void* cp, void (*put)(void*, const uint8_t*, size_t))
+  {
+    std::string state = reinterpret_cast<T*>(self)->save();
+    put(cp, reinterpret_cast<const uint8_t*>(state.data()), state.size());
+  }
+
+  static bool restore(void* self, const uint8_t* bytes, size_t len)
+  {
+    return reinterpret_cast<T*>(self)->restore(std::string(reinterpret_cast<const char*>(bytes), len));
+  }
+
+  mmio_plugin_v2_registration_t(const std::string& name)
+  {
+    mmio_plugin_v2_t plugin = {
+      MMIO_PLUGIN_ABI_VERSION,
+      mmio_plugin_v2_registration_t<T>::alloc,
+      mmio_plugin_v2_registration_t<T>::load,
+      mmio_plugin_v2_registration_t<T>::store,
+      mmio_plugin_v2_registration_t<T>::dealloc,
+      mmio_plugin_v2_registration_t<T>::tick,
+      mmio_plugin_v2_registration_t<T>::save,
+      mmio_plugin_v2_registration_t<T>::restore,
+    };
+
+    register_mmio_plugin_v2(name.c_str(), &plugin);
+  }
+};
 #endif // __cplusplus
 
 #endif
@@ -4,9 +4,15 @@
 #include "arith.h"
 #include "simif.h"
 #include "processor.h"
+#include <inttypes.h>
+#include <algorithm>
 
 mmu_t::mmu_t(simif_t* sim, processor_t* proc)
- : sim(sim), proc(proc),
+ : sim(sim), proc(proc), parallel(false), fetch_faulted(false),
+  walk_page_shift(0), tlb_context_victim(1),
+  tlb_context_switches(0), tlb_context_reuses(0), tlb_selective_flushes(0),
+  stlb_sets(0), stlb_ways(0), stlb_page_shifts(0),
+  tlb_misses(0), stlb_hits(0), stlb_superpage_hits(0), stlb_misses(0), page_walks(0),
 #ifdef RISCV_ENABLE_DUAL_ENDIAN
   target_big_endian(false),
 #endif
@@ -15,29 +21,416 @@ mmu_t::mmu_t(simif_t* sim, processor_t* proc)
   check_triggers_store(false),
   matched_trigger(NULL)
 {
+#ifdef RISCV_ENABLE_DBT
+  dbt = proc ? new dbt_t(proc, this) : NULL;
+#endif
+  if (proc)
+    set_stlb_size(STLB_DEFAULT_SETS, STLB_DEFAULT_WAYS);
   flush_tlb();
+  tlb_full_flushes = 0;
   yield_load_reservation();
 }
 
 mmu_t::~mmu_t()
 {
+#ifdef RISCV_ENABLE_DBT
+  delete dbt;
+#endif
 }
 
 void mmu_t::flush_icache()
 {
   for (size_t i = 0; i < ICACHE_ENTRIES; i++)
     icache[i].tag = -1;
+  for (size_t i = 0; i < BB_CACHE_ENTRIES; i++)
+    bb_cache[i].tag = -1;
+  bb_code_pages.clear();
+#ifdef RISCV_ENABLE_DBT
+  if (dbt)
+    dbt->flush();
+#endif
+}
+
+// Returns true if insn may redirect control flow or change the translation
+// or privilege context, i.e. if it should terminate a basic block.
+static bool insn_ends_bb(insn_t insn)
+{
+  insn_bits_t bits = insn.bits();
+  switch (bits & 3) {
+    case 1: // C1: c.jal/c.addiw, c.j, c.beqz, c.bnez
+      return ((bits >> 13) & 7) == 1 || ((bits >> 13) & 7) >= 5;
+    case 2: // C2: c.jr, c.jalr, c.ebreak (and c.mv/c.add)
+      return ((bits >> 13) & 7) == 4;
+    case 0:
+      return false;
+  }
+  switch (bits & 0x7f) {
+    case 0x0f: // MISC-MEM (fence.i)
+    case 0x63: // BRANCH
+    case 0x67: // JALR
+    case 0x6f: // JAL
+    case 0x73: // SYSTEM
+      return true;
+  }
+  return false;
+}
+
+bb_cache_entry_t* mmu_t::refill_bb_cache(reg_t addr, bb_cache_entry_t* entry)
+{
+  // Icache hits don't refill the ITLB, e.g. after a switch to a context
+  // that fetches the same way, so refill it here.  A fault is left to the
+  // icache path, which fetches the instruction again and takes it.  Traced
+  // fetches are left to it too, before anything is fetched, so that each
+  // is traced once.
+  reg_t vpn = addr >> PGSHIFT;
+  reg_t idx = vpn % TLB_ENTRIES;
+  if (tlb_insn_tag[idx] != (vpn | tlb_context)) {
+    translate_insn_addr(addr);
+    if (unlikely(fetch_faulted)) {
+      fetch_faulted = false;
+      icache[icache_index(addr)].tag = -1;
+      return NULL;
+    }
+    if (tlb_insn_tag[idx] != (vpn | tlb_context))
+      return NULL;
+  }
+  reg_t page_paddr = (tlb_data[idx].target_offset + addr) & ~(PGSIZE - 1);
+  if (tracer.interested_in_range(page_paddr, page_paddr + PGSIZE, FETCH))
+    return NULL;
+
+  // only the first instruction can cross into the next page
+  icache_entry_t* ic_entry = access_icache(addr);
+  if (ic_entry->tag != addr)
+    return NULL;
+
+  reg_t page_end = (vpn + 1) << PGSHIFT;
+  reg_t pc = addr;
+  entry->tag = -1;
+  entry->len = 0;
+  while (true) {
+    entry->pc[entry->len] = pc;
+    entry->data[entry->len] = ic_entry->data;
+    entry->len++;
+    pc += insn_length(ic_entry->data.insn.bits());
+
+    if (entry->len == BB_MAX_INSNS || insn_ends_bb(ic_entry->data.insn) ||
+        pc + sizeof(uint16_t) > page_end)
+      break;
+    insn_bits_t parcel = from_le(*(const uint16_t*)(tlb_data[idx].host_offset + pc));
+    if (pc + insn_length(parcel) > page_end)
+      break;
+
+    ic_entry = &icache[icache_index(pc)];
+    if (ic_entry->tag != pc && refill_icache(pc, ic_entry)->tag != pc)
+      break;
+  }
+
+  // Stores to this page must now take the slow path so they can flush us.
+  // The page may be mapped at other addresses or in other contexts, too.
+  reg_t ppn = (tlb_data[idx].target_offset + addr) >> PGSHIFT;
+  if (bb_code_pages.insert(ppn).second) {
+    for (size_t i = 0; i < TLB_ENTRIES; i++) {
+      reg_t store_vpn = tlb_store_tag[i] & TLB_VPN_MASK;
+      if (tlb_store_tag[i] != reg_t(-1) &&
+          ((store_vpn << PGSHIFT) + tlb_data[i].target_offset) >> PGSHIFT == ppn)
+        tlb_store_tag[i] = -1;
+    }
+  }
+
+#ifdef RISCV_ENABLE_THREADED_DISPATCH
+  for (size_t i = 0; i < entry->len; i++)
+    entry->uop[i] = decode_uop(proc, entry->data[i], entry->pc[i]);
+#endif
+#ifdef RISCV_ENABLE_DBT
+  entry->hits = 0;
+  entry->jit = NULL;
+#endif
+
+  entry->tag = addr;
+  return entry;
 }
 
+#ifdef RISCV_ENABLE_DBT
+dbt_code_t mmu_t::translate_bb(bb_cache_entry_t* entry)
+{
+  // When the code buffer fills up, start over rather than tracking which
+  // translations are still reachable.
+  if (dbt->full()) {
+    flush_icache();
+    return NULL;
+  }
+  return dbt->translate(entry);
+}
+#endif
+
 void mmu_t::flush_tlb()
 {
   memset(tlb_insn_tag, -1, sizeof(tlb_insn_tag));
   memset(tlb_load_tag, -1, sizeof(tlb_load_tag));
   memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
+  memset(tlb_context_valid, 0, sizeof(tlb_context_valid));
+  tlb_context = 0;
+  icache_context_valid = false;
+  max_page_shift = 0;
+  for (auto& e : stlb)
+    e.tag = -1;
+  stlb_page_shifts = 0;
+  tlb_full_flushes++;
 
   flush_icache();
 }
 
+mmu_t::tlb_context_key_t mmu_t::current_tlb_context_key()
+{
+  tlb_context_key_t key = {};
+  if (!proc)
+    return key;
+
+  // mirror the choice of mode and virt in translate()
+  const state_t* state = proc->get_state();
+  key.prv = key.data_prv = state->prv;
+  key.v = key.data_v = state->v;
+  if (!state->debug_mode && get_field(state->mstatus, MSTATUS_MPRV)) {
+    key.data_prv = get_field(state->mstatus, MSTATUS_MPP);
+    if (get_field(state->mstatus, MSTATUS_MPV) && key.data_prv != PRV_M)
+      key.data_v = true;
+  }
+
+  // drop what the walks in this context don't look at, so that e.g. M-mode
+  // code shares one context regardless of satp
+  bool uses_satp = (!key.v && key.prv != PRV_M) || (!key.data_v && key.data_prv != PRV_M);
+  bool uses_vsatp = key.v || key.data_v;
+  if (uses_satp)
+    key.satp = state->satp;
+  if (uses_vsatp) {
+    key.vsatp = state->vsatp;
+    key.hgatp = state->hgatp;
+  }
+  if (uses_satp || uses_vsatp)
+    key.status = state->mstatus & (MSTATUS_SUM | MSTATUS_MXR);
+  return key;
+}
+
+// whether fetches translate the same way in both contexts
+bool mmu_t::same_fetch_context(const tlb_context_key_t& a, const tlb_context_key_t& b)
+{
+  if (a.prv != b.prv || a.v != b.v)
+    return false;
+  if (a.v)
+    return a.vsatp == b.vsatp && a.hgatp == b.hgatp;
+  return a.prv == PRV_M || a.satp == b.satp;
+}
+
+void mmu_t::switch_tlb_context()
+{
+  tlb_context_key_t key = current_tlb_context_key();
+  tlb_context_switches++;
+
+  // The icache and basic-block cache are tagged by virtual address only.
+  if (icache_context_valid && !same_fetch_context(icache_context, key))
+    flush_icache();
+  icache_context = key;
+  icache_context_valid = true;
+
+  for (size_t i = 1; i < TLB_CONTEXTS; i++) {
+    if (tlb_context_valid[i] && tlb_context_keys[i] == key) {
+      tlb_context_reuses++;
+      tlb_context = reg_t(i) << TLB_CONTEXT_SHIFT;
+      return;
+    }
+  }
+
+  size_t ctx = tlb_context_victim;
+  tlb_context_victim = ctx % (TLB_CONTEXTS - 1) + 1;
+  if (tlb_context_valid[ctx])
+    flush_tlb_contexts(1 << ctx, false, 0);
+  tlb_context_keys[ctx] = key;
+  tlb_context_valid[ctx] = true;
+  tlb_context = reg_t(ctx) << TLB_CONTEXT_SHIFT;
+}
+
+void mmu_t::flush_tlb_contexts(uint32_t ctx_mask, bool has_vaddr, reg_t vaddr)
+{
+  reg_t vpn = (vaddr >> PGSHIFT) & TLB_VPN_MASK;
+  reg_t* tags[] = {tlb_insn_tag, tlb_load_tag, tlb_store_tag};
+  for (size_t i = 0; i < TLB_ENTRIES; i++) {
+    for (reg_t* tag : tags) {
+      size_t ctx = (tag[i] & TLB_CONTEXT_MASK) >> TLB_CONTEXT_SHIFT;
+      if (tag[i] != reg_t(-1) && ((ctx_mask >> ctx) & 1) &&
+          (!has_vaddr || ((tag[i] ^ vpn) & TLB_VPN_MASK) >> tlb_page_shift[i] == 0))
+        tag[i] = -1;
+    }
+  }
+
+  for (auto& e : stlb) {
+    size_t ctx = (e.tag & TLB_CONTEXT_MASK) >> TLB_CONTEXT_SHIFT;
+    int page_shift = e.tag >> STLB_PAGE_SHIFT_SHIFT;
+    if (e.tag != reg_t(-1) && ((ctx_mask >> ctx) & 1) &&
+        (!has_vaddr || (e.tag & TLB_VPN_MASK) == vpn >> page_shift))
+      e.tag = -1;
+  }
+}
+
+void mmu_t::set_stlb_size(size_t sets, size_t ways)
+{
+  if (sets == 0 || ways == 0)
+    sets = ways = 0;
+  assert((sets & (sets - 1)) == 0);
+  stlb_sets = sets;
+  stlb_ways = ways;
+  stlb.assign(sets * ways, stlb_entry_t{reg_t(-1), 0, 0});
+  stlb_victim.assign(sets, 0);
+  stlb_page_shifts = 0;
+}
+
+// Look up the leaf PTE for addr in the second-level TLB and re-check the
+// permissions walk() would check, since they depend on the access, not
+// just the context.  Anything out of the ordinary takes the full walk.
+bool mmu_t::stlb_lookup(reg_t addr, access_type type, bool s_mode, bool sum, bool mxr, reg_t* page)
+{
+  reg_t vpn = addr >> PGSHIFT;
+  for (uint32_t shifts = stlb_page_shifts; shifts; shifts &= shifts - 1) {
+    int page_shift = ctz(shifts);
+    reg_t tag = stlb_tag(vpn, page_shift);
+    stlb_entry_t* set = stlb_set(vpn, page_shift);
+    for (size_t w = 0; w < stlb_ways; w++) {
+      if (set[w].tag != tag)
+        continue;
+
+      reg_t pte = set[w].pte;
+      reg_t ad = PTE_A | ((type == STORE) * PTE_D);
+      if ((pte & PTE_U) ? s_mode && (type == FETCH || !sum) : !s_mode)
+        return false;
+      if (type == FETCH ? !(pte & PTE_X) :
+          type == LOAD ?  !(pte & PTE_R) && !(mxr && (pte & PTE_X)) :
+                          !((pte & PTE_R) && (pte & PTE_W)))
+        return false;
+      if ((pte & ad) != ad)
+        return false;
+
+      stlb_hits++;
+      if (page_shift)
+        stlb_superpage_hits++;
+      walk_page_shift = page_shift;
+      *page = (set[w].ppn | (vpn & ((reg_t(1) << page_shift) - 1))) << PGSHIFT;
+      return true;
+    }
+  }
+  stlb_misses++;
+  return false;
+}
+
+void mmu_t::stlb_insert(reg_t addr, reg_t page_base, reg_t pte, int page_shift)
+{
+  reg_t vpn = addr >> PGSHIFT;
+  reg_t tag = stlb_tag(vpn, page_shift);
+  stlb_entry_t* set = stlb_set(vpn, page_shift);
+  size_t way = stlb_ways;
+  for (size_t w = 0; w < stlb_ways; w++)
+    if (set[w].tag == tag)
+      way = w;
+  if (way == stlb_ways) {
+    size_t& victim = stlb_victim[(vpn >> page_shift) & (stlb_sets - 1)];
+    way = victim;
+    victim = (victim + 1) % stlb_ways;
+  }
+  set[way].tag = tag;
+  set[way].ppn = (page_base >> PGSHIFT) & ~((reg_t(1) << page_shift) - 1);
+  set[way].pte = pte;
+  stlb_page_shifts |= uint32_t(1) << page_shift;
+}
+
+// Drop the icache and basic-block cache entries an sfence of vaddr may
+// have made stale.  Their page sizes aren't recorded, so assume the largest
+// seen since the last full flush.
+void mmu_t::flush_icache_vaddr(reg_t vaddr)
+{
+  reg_t mask = ~((reg_t(1) << (PGSHIFT + max_page_shift)) - 1);
+  reg_t base = vaddr & mask;
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
+    if ((icache[i].tag & mask) == base)
+      icache[i].tag = -1;
+  for (size_t i = 0; i < BB_CACHE_ENTRIES; i++)
+    if ((bb_cache[i].tag & mask) == base)
+      bb_cache[i].tag = -1;
+}
+
+void mmu_t::flush_tlb_vma(bool virt, bool has_vaddr, reg_t vaddr, bool has_asid, reg_t asid)
+{
+  bool rv64 = proc->get_max_xlen() == 64;
+  reg_t asid_mask = rv64 ? SATP64_ASID : SATP32_ASID;
+  reg_t vmid_mask = rv64 ? HGATP64_VMID : HGATP32_VMID;
+  reg_t vmid = get_field(proc->get_state()->hgatp, vmid_mask);
+  // ASID bits satp doesn't implement are ignored (currently, all of them)
+  asid &= get_field(proc->compute_new_satp(asid_mask, 0), asid_mask);
+
+  // With virt, this applies to the VS-stage translations of the current
+  // VMID; otherwise to the HS-level ones.
+  auto affected = [&](const tlb_context_key_t& key) {
+    if (virt)
+      return (key.v || key.data_v) && get_field(key.hgatp, vmid_mask) == vmid &&
+             (!has_asid || get_field(key.vsatp, asid_mask) == asid);
+    return key.satp != 0 &&
+           (!has_asid || get_field(key.satp, asid_mask) == asid);
+  };
+
+  uint32_t ctx_mask = 0;
+  for (size_t i = 1; i < TLB_CONTEXTS; i++)
+    if (tlb_context_valid[i] && affected(tlb_context_keys[i]))
+      ctx_mask |= 1 << i;
+  flush_tlb_contexts(ctx_mask, has_vaddr, vaddr);
+
+  if (icache_context_valid && affected(icache_context)) {
+    if (has_vaddr)
+      flush_icache_vaddr(vaddr);
+    else
+      flush_icache();
+  }
+
+  if (has_vaddr || has_asid)
+    tlb_selective_flushes++;
+}
+
+void mmu_t::flush_tlb_gvma(bool has_vmid, reg_t vmid)
+{
+  reg_t vmid_mask = proc->get_max_xlen() == 64 ? HGATP64_VMID : HGATP32_VMID;
+  // hgatp implements no VMID bits, so the VMID operand is ignored
+  vmid = 0;
+
+  auto affected = [&](const tlb_context_key_t& key) {
+    return (key.v || key.data_v) && (!has_vmid || get_field(key.hgatp, vmid_mask) == vmid);
+  };
+
+  uint32_t ctx_mask = 0;
+  for (size_t i = 1; i < TLB_CONTEXTS; i++)
+    if (tlb_context_valid[i] && affected(tlb_context_keys[i]))
+      ctx_mask |= 1 << i;
+  flush_tlb_contexts(ctx_mask, false, 0);
+
+  if (icache_context_valid && affected(icache_context))
+    flush_icache();
+
+  if (has_vmid)
+    tlb_selective_flushes++;
+}
+
+void mmu_t::print_stats(FILE* out)
+{
+  int id = proc ? proc->get_id() : 0;
+  fprintf(out, "core %3d: TLB context switches:   %" PRIu64 "\n", id, tlb_context_switches);
+  fprintf(out, "core %3d: TLB contexts reused:    %" PRIu64 "\n", id, tlb_context_reuses);
+  fprintf(out, "core %3d: TLB selective fences:   %" PRIu64 "\n", id, tlb_selective_flushes);
+  fprintf(out, "core %3d: TLB full flushes:       %" PRIu64 "\n", id, tlb_full_flushes);
+  // every context switch and every selective fence used to flush the TLB
+  fprintf(out, "core %3d: TLB flushes avoided:    %" PRIu64 "\n", id,
+          tlb_context_switches + tlb_selective_flushes);
+  fprintf(out, "core %3d: TLB misses:             %" PRIu64 "\n", id, tlb_misses);
+  fprintf(out, "core %3d: STLB hits:              %" PRIu64 "\n", id, stlb_hits);
+  fprintf(out, "core %3d: STLB superpage hits:    %" PRIu64 "\n", id, stlb_superpage_hits);
+  fprintf(out, "core %3d: STLB misses:            %" PRIu64 "\n", id, stlb_misses);
+  fprintf(out, "core %3d: page table walks:       %" PRIu64 "\n", id, page_walks);
+}
+
 static void throw_access_exception(bool virt, reg_t addr, access_type type)
 {
   switch (type) {
@@ -53,6 +446,8 @@ reg_t mmu_t::translate(reg_t addr, reg_t len, access_type type, uint32_t xlate_f
   if (!proc)
     return addr;
 
+  walk_page_shift = 0;
+  tlb_misses++;
   bool mxr = get_field(proc->state.mstatus, MSTATUS_MXR);
   bool virt = (proc) ? proc->state.v : false;
   reg_t mode = proc->state.prv;
@@ -72,6 +467,8 @@ reg_t mmu_t::translate(reg_t addr, reg_t len, access_type type, uint32_t xlate_f
   }
 
   reg_t paddr = walk(addr, type, mode, virt, mxr) | (addr & (PGSIZE-1));
+  if (unlikely(fetch_faulted))
+    return paddr;
   if (!pmp_ok(paddr, len, type, mode))
     throw_access_exception(virt, addr, type);
   return paddr;
@@ -79,9 +476,14 @@ reg_t mmu_t::translate(reg_t addr, reg_t len, access_type type, uint32_t xlate_f
 
 tlb_entry_t mmu_t::fetch_slow_path(reg_t vaddr)
 {
+  sync_tlb_context();
   reg_t paddr = translate(vaddr, sizeof(fetch_temp), FETCH, 0);
 
-  if (auto host_addr = sim->addr_to_mem(paddr)) {
+  if (unlikely(fetch_faulted)) {
+    fetch_temp = 0;
+    tlb_entry_t entry = {(char*)&fetch_temp - vaddr, paddr - vaddr};
+    return entry;
+  } else if (auto host_addr = sim->addr_to_mem(paddr)) {
     return refill_tlb(vaddr, paddr, host_addr, FETCH);
   } else {
     if (!mmio_load(paddr, sizeof fetch_temp, (uint8_t*)&fetch_temp))
@@ -149,7 +551,7 @@ void mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, uint32_t xlate
   if (auto host_addr = sim->addr_to_mem(paddr)) {
     memcpy(bytes, host_addr, len);
     if (tracer.interested_in_range(paddr, paddr + PGSIZE, LOAD))
-      tracer.trace(paddr, len, LOAD);
+      trace_access(paddr, len, LOAD);
     else
       refill_tlb(addr, paddr, host_addr, LOAD);
   } else if (!mmio_load(paddr, len, bytes)) {
@@ -177,8 +579,10 @@ void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, uint32_
 
   if (auto host_addr = sim->addr_to_mem(paddr)) {
     memcpy(host_addr, bytes, len);
+    if (unlikely(!bb_code_pages.empty()) && bb_code_pages.count(paddr >> PGSHIFT))
+      flush_icache();
     if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE))
-      tracer.trace(paddr, len, STORE);
+      trace_access(paddr, len, STORE);
     else
       refill_tlb(addr, paddr, host_addr, STORE);
   } else if (!mmio_store(paddr, len, bytes)) {
@@ -188,8 +592,9 @@ void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, uint32_
 
 tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type)
 {
+  sync_tlb_context();
   reg_t idx = (vaddr >> PGSHIFT) % TLB_ENTRIES;
-  reg_t expected_tag = vaddr >> PGSHIFT;
+  reg_t expected_tag = (vaddr >> PGSHIFT) | tlb_context;
 
   if ((tlb_load_tag[idx] & ~TLB_CHECK_TRIGGERS) != expected_tag)
     tlb_load_tag[idx] = -1;
@@ -205,12 +610,17 @@ tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_
 
   if (pmp_homogeneous(paddr & ~reg_t(PGSIZE - 1), PGSIZE)) {
     if (type == FETCH) tlb_insn_tag[idx] = expected_tag;
-    else if (type == STORE) tlb_store_tag[idx] = expected_tag;
+    else if (type == STORE) {
+      // keep stores to pages holding cached basic blocks on the slow path
+      if (bb_code_pages.empty() || !bb_code_pages.count(paddr >> PGSHIFT))
+        tlb_store_tag[idx] = expected_tag;
+    }
     else tlb_load_tag[idx] = expected_tag;
   }
 
   tlb_entry_t entry = {host_addr - vaddr, paddr - vaddr};
   tlb_data[idx] = entry;
+  tlb_page_shift[idx] = walk_page_shift;
   return entry;
 }
 
@@ -392,6 +802,16 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode, bool virt, bool mxr)
   if (masked_msbs != 0 && masked_msbs != mask)
     vm.levels = 0;
 
+  // The second-level TLB only holds single-stage translations.
+  bool use_stlb = !virt && vm.levels != 0 && !stlb.empty();
+  if (use_stlb) {
+    reg_t page;
+    sync_tlb_context();
+    if (stlb_lookup(addr, type, s_mode, sum, mxr, &page))
+      return page;
+  }
+  page_walks++;
+
   reg_t base = vm.ptbase;
   for (int i = vm.levels - 1; i >= 0; i--) {
     int ptshift = i * vm.idxbits;
@@ -443,12 +863,20 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode, bool virt, bool mxr)
                         | (vpn & ((reg_t(1) << napot_bits) - 1))
                         | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
       reg_t phys = page_base | (addr & page_mask);
+      walk_page_shift = std::max(ptshift, napot_bits);
+      max_page_shift = std::max(max_page_shift, walk_page_shift);
+      if (use_stlb)
+        stlb_insert(addr, page_base, pte | ad, walk_page_shift);
       return s2xlate(addr, phys, type, type, virt, mxr) & ~page_mask;
     }
   }
 
   switch (type) {
-    case FETCH: throw trap_instruction_page_fault(virt, addr, 0, 0);
+    case FETCH:
+      // taken without unwinding, as the step loop does its own traps
+      fetch_faulted = true;
+      proc->set_pending_trap<trap_instruction_page_fault>(virt, addr, 0, 0);
+      return 0;
     case LOAD: throw trap_load_page_fault(virt, addr, 0, 0);
     case STORE: throw trap_store_page_fault(virt, addr, 0, 0);
     default: abort();
@@ -11,8 +11,11 @@
 #include "processor.h"
 #include "memtracer.h"
 #include "byteorder.h"
+#include "threaded.h"
+#include "dbt.h"
 #include <stdlib.h>
 #include <vector>
+#include <unordered_set>
 
 // virtual memory configuration
 #define PGSHIFT 12
@@ -32,11 +35,36 @@ struct icache_entry_t {
   insn_fetch_t data;
 };
 
+// a run of predecoded instructions that ends at a control-flow instruction,
+// at the end of a page, or after BB_MAX_INSNS instructions
+const size_t BB_MAX_INSNS = 16;
+
+struct bb_cache_entry_t {
+  reg_t tag;
+  size_t len;
+  reg_t pc[BB_MAX_INSNS];
+  insn_fetch_t data[BB_MAX_INSNS];
+#ifdef RISCV_ENABLE_THREADED_DISPATCH
+  insn_uop_t uop[BB_MAX_INSNS];
+#endif
+#ifdef RISCV_ENABLE_DBT
+  uint32_t hits;
+  dbt_code_t jit;
+#endif
+};
+
 struct tlb_entry_t {
   char* host_offset;
   reg_t target_offset;
 };
 
+// an entry of the second-level TLB: a leaf PTE of any page size
+struct stlb_entry_t {
+  reg_t tag;
+  reg_t ppn;  // of the first base page the leaf maps
+  reg_t pte;
+};
+
 class trigger_matched_t
 {
   public:
@@ -103,12 +131,13 @@ public:
         else return misaligned_load(addr, sizeof(type##_t)); \
       } \
       reg_t vpn = addr >> PGSHIFT; \
+      reg_t tag = vpn | tlb_context; \
       size_t size = sizeof(type##_t); \
-      if (likely(tlb_load_tag[vpn % TLB_ENTRIES] == vpn)) { \
+      if (likely(tlb_load_tag[vpn % TLB_ENTRIES] == tag)) { \
         if (proc) READ_MEM(addr, size); \
         return from_target(*(target_endian<type##_t>*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr)); \
       } \
-      if (unlikely(tlb_load_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) { \
+      if (unlikely(tlb_load_tag[vpn % TLB_ENTRIES] == (tag | TLB_CHECK_TRIGGERS))) { \
         type##_t data = from_target(*(target_endian<type##_t>*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr)); \
         if (!matched_trigger) { \
           matched_trigger = trigger_exception(OPERATION_LOAD, addr, data); \
@@ -167,12 +196,13 @@ public:
       if (unlikely(addr & (sizeof(type##_t)-1))) \
         return misaligned_store(addr, val, sizeof(type##_t)); \
       reg_t vpn = addr >> PGSHIFT; \
+      reg_t tag = vpn | tlb_context; \
       size_t size = sizeof(type##_t); \
-      if (likely(tlb_store_tag[vpn % TLB_ENTRIES] == vpn)) { \
+      if (likely(tlb_store_tag[vpn % TLB_ENTRIES] == tag)) { \
         if (proc) WRITE_MEM(addr, val, size); \
         *(target_endian<type##_t>*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr) = to_target(val); \
       } \
-      else if (unlikely(tlb_store_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) { \
+      else if (unlikely(tlb_store_tag[vpn % TLB_ENTRIES] == (tag | TLB_CHECK_TRIGGERS))) { \
         if (!matched_trigger) { \
           matched_trigger = trigger_exception(OPERATION_STORE, addr, val); \
           if (matched_trigger) \
@@ -196,6 +226,15 @@ public:
     type##_t amo_##type(reg_t addr, op f) { \
       try { \
         auto lhs = load_##type(addr, true); \
+        if (unlikely(parallel) && !target_big_endian) { \
+          if (type##_t* host_addr = store_host_addr<type##_t>(addr)) { \
+            /* retry until no other hart wrote in between */ \
+            while (!__atomic_compare_exchange_n(host_addr, &lhs, f(lhs), false, \
+                                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {} \
+            if (proc) WRITE_MEM(addr, f(lhs), sizeof(type##_t)); \
+            return lhs; \
+          } \
+        } \
         store_##type(addr, f(lhs)); \
         return lhs; \
       } catch (trap_load_address_misaligned& t) { \
@@ -244,17 +283,48 @@ public:
   store_func(uint32, guest_store, RISCV_XLATE_VIRT)
   store_func(uint64, guest_store, RISCV_XLATE_VIRT)
 
+  // template for functions that perform a store-conditional; returns
+  // whether the store took place
+  #define store_conditional_func(type) \
+    bool store_conditional_##type(reg_t addr, type##_t val) { \
+      bool have_reservation = check_load_reservation(addr, sizeof(type##_t)); \
+      if (have_reservation && unlikely(parallel) && !target_big_endian) { \
+        if (type##_t* host_addr = store_host_addr<type##_t>(addr)) { \
+          /* fail if another hart wrote the location since the LR */ \
+          type##_t expected = load_reservation_value; \
+          have_reservation = __atomic_compare_exchange_n(host_addr, &expected, val, false, \
+                                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+          if (have_reservation && proc) WRITE_MEM(addr, val, sizeof(type##_t)); \
+          return have_reservation; \
+        } \
+      } \
+      if (have_reservation) \
+        store_##type(addr, val); \
+      return have_reservation; \
+    }
+
   // perform an atomic memory operation at an aligned address
   amo_func(uint32)
   amo_func(uint64)
 
+  // perform a store-conditional at an aligned address
+  store_conditional_func(uint32)
+  store_conditional_func(uint64)
+
+  // When harts run on separate host threads (see sim_t::set_parallel), AMOs
+  // and SCs to ordinary memory are carried out with host atomics so that
+  // they stay atomic with respect to the other harts.
+  void set_parallel(bool value) { parallel = value; }
+
   inline void yield_load_reservation()
   {
     load_reservation_address = (reg_t)-1;
   }
 
-  inline void acquire_load_reservation(reg_t vaddr)
+  // value is what the LR returned; a parallel SC checks memory against it
+  inline void acquire_load_reservation(reg_t vaddr, reg_t value)
   {
+    load_reservation_value = value;
     reg_t paddr = translate(vaddr, 1, LOAD, 0);
     if (auto host_addr = sim->addr_to_mem(paddr))
       load_reservation_address = refill_tlb(vaddr, paddr, host_addr, LOAD).target_offset + vaddr;
@@ -292,6 +362,29 @@ public:
       throw trap_store_access_fault((proc) ? proc->state.v : false, vaddr, 0, 0); // disallow SC to I/O space
   }
 
+  // Returns the host address backing a store to addr, or NULL if the store
+  // must take the slow path (MMIO, code pages, traced or triggered pages).
+  template<typename T> T* store_host_addr(reg_t addr)
+  {
+    reg_t vpn = addr >> PGSHIFT;
+    if (tlb_store_tag[vpn % TLB_ENTRIES] != (vpn | tlb_context)) {
+      reg_t paddr = translate(addr, sizeof(T), STORE, 0);
+      auto host_addr = sim->addr_to_mem(paddr);
+      if (host_addr)
+        refill_tlb(addr, paddr, host_addr, STORE);
+      if (tlb_store_tag[vpn % TLB_ENTRIES] != (vpn | tlb_context)) {
+        // stores to pages holding cached basic blocks need only drop them
+        if (host_addr && !check_triggers_store && bb_code_pages.count(paddr >> PGSHIFT) &&
+            !tracer.interested_in_range(paddr, paddr + PGSIZE, STORE)) {
+          flush_icache();
+          return (T*)host_addr;
+        }
+        return NULL;
+      }
+    }
+    return (T*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr);
+  }
+
   static const reg_t ICACHE_ENTRIES = 1024;
 
   inline size_t icache_index(reg_t addr)
@@ -299,6 +392,11 @@ public:
     return (addr / PC_ALIGN) % ICACHE_ENTRIES;
   }
 
+  static reg_t take_fetch_fault(processor_t* p, insn_t insn, reg_t pc)
+  {
+    return PC_TRAP;
+  }
+
   inline icache_entry_t* refill_icache(reg_t addr, icache_entry_t* entry)
   {
     auto tlb_entry = translate_insn_addr(addr);
@@ -319,6 +417,14 @@ public:
       insn |= (insn_bits_t)from_le(*(const uint16_t*)translate_insn_addr_to_host(addr + 2)) << 16;
     }
 
+    if (unlikely(fetch_faulted)) {
+      fetch_faulted = false;
+      entry->tag = -1;
+      entry->next = entry;
+      entry->data = {take_fetch_fault, 0};
+      return entry;
+    }
+
     insn_fetch_t fetch = {proc->decode_insn(insn), insn};
     entry->tag = addr;
     entry->next = &icache[icache_index(addr + length)];
@@ -327,7 +433,7 @@ public:
     reg_t paddr = tlb_entry.target_offset + addr;;
     if (tracer.interested_in_range(paddr, paddr + 1, FETCH)) {
       entry->tag = -1;
-      tracer.trace(paddr, length, FETCH);
+      trace_access(paddr, length, FETCH);
     }
     return entry;
   }
@@ -346,9 +452,62 @@ public:
     return refill_icache(addr, &entry)->data;
   }
 
+  static const reg_t BB_CACHE_ENTRIES = 512;
+
+  inline size_t bb_cache_index(reg_t addr)
+  {
+    return (addr / PC_ALIGN) % BB_CACHE_ENTRIES;
+  }
+
+  // returns NULL if the block at addr can't be cached (e.g. traced fetches)
+  inline bb_cache_entry_t* access_bb_cache(reg_t addr)
+  {
+    bb_cache_entry_t* entry = &bb_cache[bb_cache_index(addr)];
+    if (likely(entry->tag == addr))
+      return entry;
+    return refill_bb_cache(addr, entry);
+  }
+
+#ifdef RISCV_ENABLE_DBT
+  dbt_t* get_dbt() { return dbt; }
+  dbt_code_t translate_bb(bb_cache_entry_t* entry);
+#endif
+
   void flush_tlb();
   void flush_icache();
 
+  // Called whenever state that translate() depends on (privilege, satp,
+  // vsatp, hgatp, mstatus.MPRV/MPP/MPV/SUM/MXR) may have changed.  Cached
+  // translations are kept; the next TLB refill, or sync_tlb_context(),
+  // switches to the matching translation context.
+  void tlb_context_changed() { tlb_context = 0; }
+
+  // Instruction fetches go through the icache without consulting the TLB,
+  // so the fetch loop must pick up a context change before it fetches.
+  inline void sync_tlb_context()
+  {
+    if (unlikely(tlb_context == 0))
+      switch_tlb_context();
+  }
+
+  // sfence.vma and hfence.vvma: invalidate the translations of vaddr (of all
+  // addresses if !has_vaddr) in address space asid (in all if !has_asid).
+  // virt selects the VS-stage translations of the current VMID.
+  void flush_tlb_vma(bool virt, bool has_vaddr, reg_t vaddr, bool has_asid, reg_t asid);
+  // hfence.gvma: invalidate the guest translations of vmid (of all VMIDs if
+  // !has_vmid).  Guest-physical addresses aren't tracked, so the operand in
+  // rs1 doesn't narrow the flush.
+  void flush_tlb_gvma(bool has_vmid, reg_t vmid);
+
+  // Misses in the direct-mapped TLB look in a set-associative second-level
+  // TLB of sets x ways leaf PTEs before walking the page tables.  Superpage
+  // leaves take a single entry.  Zero sets or ways disable it.
+  static const size_t STLB_DEFAULT_SETS = 256;
+  static const size_t STLB_DEFAULT_WAYS = 4;
+  void set_stlb_size(size_t sets, size_t ways);
+
+  void print_stats(FILE* out);
+
   void register_memtracer(memtracer_t*);
 
   int is_dirty_enabled()
@@ -397,12 +556,37 @@ private:
   simif_t* sim;
   processor_t* proc;
   memtracer_list_t tracer;
+  // traces an access, charging the hart the cycles the memory models stall
+  // it for
+  void trace_access(reg_t paddr, reg_t len, access_type type)
+  {
+    reg_t stall = tracer.trace_stall(paddr, len, type);
+    if (proc)
+      proc->get_state()->mcycle += stall;
+  }
   reg_t load_reservation_address;
+  reg_t load_reservation_value;
+  bool parallel;
   uint16_t fetch_temp;
+  // An instruction page fault is pending in the hart's trap slot, and the
+  // fetch reads zeros until refill_icache stands in an instruction that
+  // takes it.
+  bool fetch_faulted;
 
   // implement an instruction cache for simulator performance
   icache_entry_t icache[ICACHE_ENTRIES];
 
+  // implement a basic-block cache on top of the instruction cache.  Physical
+  // pages holding cached blocks are tracked so that stores to them flush it.
+  bb_cache_entry_t bb_cache[BB_CACHE_ENTRIES];
+  std::unordered_set<reg_t> bb_code_pages;
+  bb_cache_entry_t* refill_bb_cache(reg_t addr, bb_cache_entry_t* entry);
+
+#ifdef RISCV_ENABLE_DBT
+  // translated code for hot blocks; NULL for MMUs without a hart
+  dbt_t* dbt;
+#endif
+
   // implement a TLB for simulator performance
   static const reg_t TLB_ENTRIES = 256;
   // If a TLB tag has TLB_CHECK_TRIGGERS set, then the MMU must check for a
@@ -412,6 +596,81 @@ private:
   reg_t tlb_insn_tag[TLB_ENTRIES];
   reg_t tlb_load_tag[TLB_ENTRIES];
   reg_t tlb_store_tag[TLB_ENTRIES];
+  // log2 of the number of base pages the leaf PTE behind each entry maps,
+  // so that sfence.vma of one address also drops the rest of a superpage.
+  // walk() leaves the value for the translation it just did in
+  // walk_page_shift; max_page_shift bounds it since the last full flush.
+  uint8_t tlb_page_shift[TLB_ENTRIES];
+  reg_t walk_page_shift;
+  reg_t max_page_shift;
+
+  // TLB tags hold a VPN ORed with the translation context the entry was
+  // filled under, so entries of other address spaces and privilege modes
+  // survive context switches.  Context 0 is never assigned: while the
+  // current context is unknown, tlb_context is 0 and every lookup misses.
+  static const int TLB_CONTEXT_SHIFT = 52;
+  static const size_t TLB_CONTEXTS = 16;
+  static const reg_t TLB_CONTEXT_MASK = reg_t(TLB_CONTEXTS - 1) << TLB_CONTEXT_SHIFT;
+  static const reg_t TLB_VPN_MASK = (reg_t(1) << TLB_CONTEXT_SHIFT) - 1;
+
+  // everything besides the address that translate() and walk() depend on
+  struct tlb_context_key_t {
+    reg_t prv, v;           // for fetches
+    reg_t data_prv, data_v; // for loads and stores, after MPRV
+    reg_t status;           // mstatus.SUM and MXR
+    reg_t satp, vsatp, hgatp;
+    bool operator==(const tlb_context_key_t& rhs) const {
+      return prv == rhs.prv && v == rhs.v && data_prv == rhs.data_prv &&
+             data_v == rhs.data_v && status == rhs.status && satp == rhs.satp &&
+             vsatp == rhs.vsatp && hgatp == rhs.hgatp;
+    }
+  };
+
+  reg_t tlb_context;
+  tlb_context_key_t tlb_context_keys[TLB_CONTEXTS];
+  bool tlb_context_valid[TLB_CONTEXTS];
+  size_t tlb_context_victim;
+  // the fetch side of the context the icache was filled under
+  tlb_context_key_t icache_context;
+  bool icache_context_valid;
+
+  tlb_context_key_t current_tlb_context_key();
+  static bool same_fetch_context(const tlb_context_key_t& a, const tlb_context_key_t& b);
+  void switch_tlb_context();
+  void flush_tlb_contexts(uint32_t ctx_mask, bool has_vaddr, reg_t vaddr);
+  void flush_icache_vaddr(reg_t vaddr);
+
+  uint64_t tlb_context_switches;
+  uint64_t tlb_context_reuses;
+  uint64_t tlb_selective_flushes;
+  uint64_t tlb_full_flushes;
+
+  // second-level TLB: stlb_sets sets of stlb_ways entries.  Tags hold the
+  // VPN shifted right by the entry's page shift, the context, and the
+  // page shift itself, so one lookup per page size present suffices.
+  static const int STLB_PAGE_SHIFT_SHIFT = 56;
+  std::vector<stlb_entry_t> stlb;
+  std::vector<size_t> stlb_victim;
+  size_t stlb_sets;
+  size_t stlb_ways;
+  uint32_t stlb_page_shifts;  // bit n set if an entry with page shift n exists
+
+  inline reg_t stlb_tag(reg_t vpn, int page_shift)
+  {
+    return (vpn >> page_shift) | tlb_context | (reg_t(page_shift) << STLB_PAGE_SHIFT_SHIFT);
+  }
+  inline stlb_entry_t* stlb_set(reg_t vpn, int page_shift)
+  {
+    return &stlb[((vpn >> page_shift) & (stlb_sets - 1)) * stlb_ways];
+  }
+  bool stlb_lookup(reg_t addr, access_type type, bool s_mode, bool sum, bool mxr, reg_t* page);
+  void stlb_insert(reg_t addr, reg_t page_base, reg_t pte, int page_shift);
+
+  uint64_t tlb_misses;
+  uint64_t stlb_hits;
+  uint64_t stlb_superpage_hits;
+  uint64_t stlb_misses;
+  uint64_t page_walks;
 
   // finish translation on a TLB miss and update the TLB
   tlb_entry_t refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type);
@@ -435,15 +694,15 @@ private:
   // ITLB lookup
   inline tlb_entry_t translate_insn_addr(reg_t addr) {
     reg_t vpn = addr >> PGSHIFT;
-    if (likely(tlb_insn_tag[vpn % TLB_ENTRIES] == vpn))
+    if (likely(tlb_insn_tag[vpn % TLB_ENTRIES] == (vpn | tlb_context)))
       return tlb_data[vpn % TLB_ENTRIES];
     tlb_entry_t result;
-    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] != (vpn | TLB_CHECK_TRIGGERS))) {
+    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] != (vpn | tlb_context | TLB_CHECK_TRIGGERS))) {
       result = fetch_slow_path(addr);
     } else {
       result = tlb_data[vpn % TLB_ENTRIES];
     }
-    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) {
+    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] == (vpn | tlb_context | TLB_CHECK_TRIGGERS))) {
       target_endian<uint16_t>* ptr = (target_endian<uint16_t>*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr);
       int match = proc->trigger_match(OPERATION_EXECUTE, addr, from_target(*ptr));
       if (match >= 0) {
@@ -487,6 +746,7 @@ private:
   trigger_matched_t *matched_trigger;
 
   friend class processor_t;
+  friend class dbt_t;
 };
 
 struct vm_info {
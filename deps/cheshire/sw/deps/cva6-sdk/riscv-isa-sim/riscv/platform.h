@@ -3,8 +3,16 @@
 #define _RISCV_PLATFORM_H
 
 #define DEFAULT_RSTVEC     0x00001000
+#define LLC_BASE           0x03001000
+#define LLC_SIZE           0x00001000
+#define PERF_COUNTER_BASE  0x03009000
+#define PERF_COUNTER_SIZE  0x00001000
 #define CLINT_BASE         0x02000000
 #define CLINT_SIZE         0x000c0000
+#define PLIC_BASE          0x0c000000
+#define PLIC_SIZE          0x01000000
+#define VIRTIO_BASE        0x18000000
+#define VIRTIO_SIZE        0x00001000
 #define EXT_IO_BASE        0x40000000
 #define DRAM_BASE          0x80000000
 
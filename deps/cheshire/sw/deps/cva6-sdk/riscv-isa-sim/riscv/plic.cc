@@ -0,0 +1,148 @@
+#include "devices.h"
+#include "processor.h"
+
+plic_t::plic_t(std::vector<processor_t*>& procs)
+  : procs(procs), priority(PLIC_NDEV + 1), level(PLIC_NDEV + 1),
+    pending(PLIC_NDEV + 1), claimed(PLIC_NDEV + 1), contexts(procs.size() * 2)
+{
+  for (size_t i = 0; i < contexts.size(); i++)
+    contexts[i].enable.resize(PLIC_NDEV + 1);
+}
+
+/* 000000 priority of source 0 (reserved)
+ * 000004 priority of source 1
+ * 001000 pending sources 0-31
+ * 002000 enabled sources 0-31, context 0
+ * 002080 enabled sources 0-31, context 1
+ * 200000 threshold, context 0
+ * 200004 claim/complete, context 0
+ * 201000 threshold, context 1
+ *
+ * Contexts 2n and 2n+1 are the machine and supervisor external
+ * interrupts of hart n.  Accesses are of whole 32-bit registers.
+ */
+
+#define PRIORITY_BASE	0x0
+#define PENDING_BASE	0x1000
+#define ENABLE_BASE	0x2000
+#define ENABLE_STRIDE	0x80
+#define CONTEXT_BASE	0x200000
+#define CONTEXT_STRIDE	0x1000
+
+bool plic_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if (len != 4 || addr % 4 != 0)
+    return false;
+
+  uint32_t val = 0;
+  if (addr >= PRIORITY_BASE && addr < PRIORITY_BASE + 4 * (PLIC_NDEV + 1)) {
+    val = priority[(addr - PRIORITY_BASE) / 4];
+  } else if (addr == PENDING_BASE) {
+    for (size_t i = 1; i <= PLIC_NDEV; i++)
+      val |= uint32_t(pending[i]) << i;
+  } else if (addr >= ENABLE_BASE && addr < ENABLE_BASE + ENABLE_STRIDE * contexts.size()) {
+    size_t ctx = (addr - ENABLE_BASE) / ENABLE_STRIDE;
+    if ((addr - ENABLE_BASE) % ENABLE_STRIDE == 0)
+      for (size_t i = 1; i <= PLIC_NDEV; i++)
+        val |= uint32_t(contexts[ctx].enable[i]) << i;
+  } else if (addr >= CONTEXT_BASE && addr < CONTEXT_BASE + CONTEXT_STRIDE * contexts.size()) {
+    size_t ctx = (addr - CONTEXT_BASE) / CONTEXT_STRIDE;
+    reg_t offset = (addr - CONTEXT_BASE) % CONTEXT_STRIDE;
+    if (offset == 0)
+      val = contexts[ctx].threshold;
+    else if (offset == 4)
+      val = claim(ctx);
+  } else {
+    return false;
+  }
+
+  memcpy(bytes, &val, 4);
+  return true;
+}
+
+bool plic_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  if (len != 4 || addr % 4 != 0)
+    return false;
+
+  uint32_t val;
+  memcpy(&val, bytes, 4);
+  if (addr >= PRIORITY_BASE && addr < PRIORITY_BASE + 4 * (PLIC_NDEV + 1)) {
+    size_t source = (addr - PRIORITY_BASE) / 4;
+    if (source != 0)
+      priority[source] = val & PLIC_PRIO_MASK;
+  } else if (addr == PENDING_BASE) {
+    // pending bits are read-only
+  } else if (addr >= ENABLE_BASE && addr < ENABLE_BASE + ENABLE_STRIDE * contexts.size()) {
+    size_t ctx = (addr - ENABLE_BASE) / ENABLE_STRIDE;
+    if ((addr - ENABLE_BASE) % ENABLE_STRIDE == 0)
+      for (size_t i = 1; i <= PLIC_NDEV; i++)
+        contexts[ctx].enable[i] = (val >> i) & 1;
+  } else if (addr >= CONTEXT_BASE && addr < CONTEXT_BASE + CONTEXT_STRIDE * contexts.size()) {
+    size_t ctx = (addr - CONTEXT_BASE) / CONTEXT_STRIDE;
+    reg_t offset = (addr - CONTEXT_BASE) % CONTEXT_STRIDE;
+    if (offset == 0)
+      contexts[ctx].threshold = val & PLIC_PRIO_MASK;
+    else if (offset == 4)
+      complete(ctx, val);
+  } else {
+    return false;
+  }
+
+  update();
+  return true;
+}
+
+void plic_t::set_interrupt_level(uint32_t source, bool value)
+{
+  if (source == 0 || source > PLIC_NDEV)
+    return;
+
+  level[source] = value;
+  // a source that is being serviced becomes pending again on completion
+  if (value && !claimed[source])
+    pending[source] = true;
+  update();
+}
+
+uint32_t plic_t::best_source(size_t ctx)
+{
+  uint32_t best = 0;
+  uint32_t best_priority = contexts[ctx].threshold;
+  for (uint32_t i = 1; i <= PLIC_NDEV; i++) {
+    if (pending[i] && contexts[ctx].enable[i] && priority[i] > best_priority) {
+      best = i;
+      best_priority = priority[i];
+    }
+  }
+  return best;
+}
+
+uint32_t plic_t::claim(size_t ctx)
+{
+  uint32_t source = best_source(ctx);
+  if (source) {
+    pending[source] = false;
+    claimed[source] = true;
+  }
+  update();
+  return source;
+}
+
+void plic_t::complete(size_t ctx, uint32_t source)
+{
+  if (source == 0 || source > PLIC_NDEV || !contexts[ctx].enable[source])
+    return;
+
+  claimed[source] = false;
+  if (level[source])
+    pending[source] = true;
+}
+
+void plic_t::update()
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->get_state()->set_mip_line(MIP_MEIP, best_source(2 * i) != 0);
+    procs[i]->get_state()->set_mip_line(MIP_SEIP, best_source(2 * i + 1) != 0);
+  }
+}
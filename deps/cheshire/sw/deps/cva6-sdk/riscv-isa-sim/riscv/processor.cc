@@ -26,9 +26,13 @@ processor_t::processor_t(const char* isa, const char* priv, const char* varch,
                          simif_t* sim, uint32_t id, bool halt_on_reset,
                          FILE* log_file)
   : debug(false), halt_request(HR_NONE), sim(sim), id(id), xlen(0),
-  histogram_enabled(false), log_commits_enabled(false),
+  histogram_enabled(false), tlb_stats_enabled(false),
+  idle_skip_enabled(false), in_wfi(false), cpi(0), cpi_carry(0),
+  bbv_profiler(NULL),
+  log_commits_enabled(false),
   log_file(log_file), halt_on_reset(halt_on_reset),
-  extension_table(256, false), impl_table(256, false), last_pc(1), executions(1)
+  extension_table(256, false), impl_table(256, false), pending_trap(NULL),
+  last_pc(1), executions(1)
 {
   VU.p = this;
 
@@ -66,6 +70,16 @@ processor_t::~processor_t()
   }
 #endif
 
+  if (tlb_stats_enabled)
+    mmu->print_stats(log_file);
+
+  if (cpi) {
+    fprintf(log_file, "core %3d: instructions:           %" PRIu64 "\n", id, state.minstret);
+    fprintf(log_file, "core %3d: cycles:                 %" PRIu64 "\n", id, state.mcycle);
+    fprintf(log_file, "core %3d: CPI:                    %.3f\n", id,
+            state.minstret ? double(state.mcycle) / state.minstret : 0.0);
+  }
+
   delete mmu;
   delete disassembler;
 }
@@ -329,8 +343,10 @@ void state_t::reset(reg_t max_isa)
   mtvec = 0;
   mcause = 0;
   minstret = 0;
+  mcycle = 0;
   mie = 0;
   mip = 0;
+  mip_lines = 0;
   medeleg = 0;
   mideleg = 0;
   mcounteren = 0;
@@ -467,6 +483,8 @@ void processor_t::enable_log_commits()
 void processor_t::reset()
 {
   state.reset(max_isa);
+  mmu->tlb_context_changed();
+  in_wfi = false;
 #ifdef RISCV_ENABLE_DUAL_ENDIAN
   if (mmu->is_target_big_endian())
     state.mstatus |= MSTATUS_UBE | MSTATUS_SBE | MSTATUS_MBE;
@@ -561,13 +579,19 @@ void processor_t::set_mmu_capability(int cap)
 }
 
 void processor_t::take_interrupt(reg_t pending_interrupts)
+{
+  if (reg_t cause = interrupt_cause(pending_interrupts))
+    throw trap_t(cause);
+}
+
+reg_t processor_t::interrupt_cause(reg_t pending_interrupts)
 {
   reg_t enabled_interrupts, deleg, status, mie, m_enabled;
   reg_t hsie, hs_enabled, vsie, vs_enabled;
 
   // Do nothing if no pending interrupts
   if (!pending_interrupts) {
-    return;
+    return 0;
   }
 
   // M-ints have higher priority over HS-ints and VS-ints
@@ -616,8 +640,22 @@ void processor_t::take_interrupt(reg_t pending_interrupts)
     else
       abort();
 
-    throw trap_t(((reg_t)1 << (max_xlen-1)) | ctz(enabled_interrupts));
+    return ((reg_t)1 << (max_xlen-1)) | ctz(enabled_interrupts);
   }
+
+  return 0;
+}
+
+// Cancels what the instruction writing mcycle adds to it when it retires,
+// so that the written value reads back.  With a base CPI that is its cpi
+// thousandths, which a carry of minus them cancels in the step loop's
+// wrapping arithmetic; any older fraction of a cycle is dropped.
+void processor_t::uncharge_cycles()
+{
+  if (cpi)
+    cpi_carry = -cpi;
+  else
+    state.mcycle--;
 }
 
 static int xlen_to_uxl(int xlen)
@@ -644,7 +682,7 @@ reg_t processor_t::legalize_privilege(reg_t prv)
 
 void processor_t::set_privilege(reg_t prv)
 {
-  mmu->flush_tlb();
+  mmu->tlb_context_changed();
   state.prv = legalize_privilege(prv);
 }
 
@@ -657,9 +695,9 @@ void processor_t::set_virt(bool virt)
 
   if (state.v != virt) {
     /*
-     * Ideally, we should flush TLB here but we don't need it because
-     * set_virt() is always used in conjucter with set_privilege() and
-     * set_privilege() will flush TLB unconditionally.
+     * Ideally, we should switch TLB context here but we don't need it
+     * because set_virt() is always used in conjucter with set_privilege()
+     * and set_privilege() will switch TLB context unconditionally.
      */
     mask = SSTATUS_VS_MASK;
     mask |= (supports_extension('V') ? SSTATUS_VS : 0);
@@ -935,7 +973,7 @@ void processor_t::set_csr(int which, reg_t val)
           (MSTATUS_MPP | MSTATUS_MPRV
            | (has_page ? (MSTATUS_MXR | MSTATUS_SUM) : 0)
            | MSTATUS_MXR))
-        mmu->flush_tlb();
+        mmu->tlb_context_changed();
 
       bool has_fs = supports_extension('S') || supports_extension('F')
                   || supports_extension('V');
@@ -977,7 +1015,7 @@ void processor_t::set_csr(int which, reg_t val)
       break;
     }
     case CSR_MIP: {
-      reg_t mask = (supervisor_ints | hypervisor_ints) & (MIP_SSIP | MIP_STIP | vssip_int);
+      reg_t mask = (supervisor_ints | hypervisor_ints) & (MIP_SSIP | MIP_STIP | MIP_SEIP | vssip_int);
       state.mip = (state.mip & ~mask) | (val & mask);
       break;
     }
@@ -1001,7 +1039,6 @@ void processor_t::set_csr(int which, reg_t val)
       break;
     }
     case CSR_MINSTRET:
-    case CSR_MCYCLE:
       if (xlen == 32)
         state.minstret = (state.minstret >> 32 << 32) | (val & 0xffffffffU);
       else
@@ -1013,10 +1050,20 @@ void processor_t::set_csr(int which, reg_t val)
       state.minstret--;
       break;
     case CSR_MINSTRETH:
-    case CSR_MCYCLEH:
       state.minstret = (val << 32) | (state.minstret << 32 >> 32);
       state.minstret--; // See comment above.
       break;
+    case CSR_MCYCLE:
+      if (xlen == 32)
+        state.mcycle = (state.mcycle >> 32 << 32) | (val & 0xffffffffU);
+      else
+        state.mcycle = val;
+      uncharge_cycles(); // See comment above.
+      break;
+    case CSR_MCYCLEH:
+      state.mcycle = (val << 32) | (state.mcycle << 32 >> 32);
+      uncharge_cycles(); // See comment above.
+      break;
     case CSR_SCOUNTEREN:
       state.scounteren = val;
       break;
@@ -1056,7 +1103,7 @@ void processor_t::set_csr(int which, reg_t val)
         val = 0;
 
       if (satp_valid(val)) {
-        mmu->flush_tlb();
+        mmu->tlb_context_changed();
 
         if (state.v)
           state.vsatp = compute_new_satp(val, state.vsatp);
@@ -1121,6 +1168,8 @@ void processor_t::set_csr(int which, reg_t val)
       mask &= max_isa;
 
       state.misa = (val & mask) | (state.misa & ~mask);
+      // predecoded instructions may depend on the enabled extensions
+      mmu->flush_icache();
 
       // update the forced bits in MIDELEG and other CSRs
       if (supports_extension('H'))
@@ -1193,7 +1242,7 @@ void processor_t::set_csr(int which, reg_t val)
       state.htinst = val;
       break;
     case CSR_HGATP: {
-      mmu->flush_tlb();
+      mmu->tlb_context_changed();
 
       reg_t mask;
       if (max_xlen == 32) {
@@ -1243,7 +1292,7 @@ void processor_t::set_csr(int which, reg_t val)
       if (!supports_impl(IMPL_MMU))
         val = 0;
 
-      mmu->flush_tlb();
+      mmu->tlb_context_changed();
       state.vsatp = compute_new_satp(val, state.vsatp);
       break;
     case CSR_TSELECT:
@@ -1496,22 +1545,26 @@ reg_t processor_t::get_csr(int which, insn_t insn, bool write, bool peek)
         goto throw_illegal;
       if (!ctr_v_ok)
         goto throw_virtual;
-      ret(state.minstret);
+      ret(which == CSR_CYCLE ? state.mcycle : state.minstret);
     case CSR_MINSTRET:
-    case CSR_MCYCLE:
       ret(state.minstret);
+    case CSR_MCYCLE:
+      ret(state.mcycle);
     case CSR_INSTRETH:
     case CSR_CYCLEH:
       if (!ctr_ok || xlen != 32)
         goto throw_illegal;
       if (!ctr_v_ok)
         goto throw_virtual;
-      ret(state.minstret >> 32);
+      ret((which == CSR_CYCLEH ? state.mcycle : state.minstret) >> 32);
     case CSR_MINSTRETH:
-    case CSR_MCYCLEH:
       if (xlen == 32)
         ret(state.minstret >> 32);
       break;
+    case CSR_MCYCLEH:
+      if (xlen == 32)
+        ret(state.mcycle >> 32);
+      break;
     case CSR_SCOUNTEREN: ret(state.scounteren);
     case CSR_MCOUNTEREN:
       if (!supports_extension('U'))
@@ -1531,9 +1584,9 @@ reg_t processor_t::get_csr(int which, insn_t insn, bool write, bool peek)
     }
     case CSR_SIP: {
       if (state.v) {
-        ret((state.mip & state.hideleg & MIP_VS_MASK) >> 1);
+        ret((state.get_mip() & state.hideleg & MIP_VS_MASK) >> 1);
       } else {
-        ret(state.mip & state.mideleg & ~MIP_HS_MASK);
+        ret(state.get_mip() & state.mideleg & ~MIP_HS_MASK);
       }
     }
     case CSR_SIE: {
@@ -1598,7 +1651,12 @@ reg_t processor_t::get_csr(int which, insn_t insn, bool write, bool peek)
       if (xlen == 32)
         ret((state.mstatus >> 32) & (MSTATUSH_SBE | MSTATUSH_MBE));
       break;
-    case CSR_MIP: ret(state.mip);
+    case CSR_MIP:
+      // csrrs and csrrc write back what they read, so they must see only
+      // the software-writable SEIP bit, not the PLIC's line ORed into it.
+      if (write)
+        ret(state.mip | (state.mip_lines & ~MIP_SEIP));
+      ret(state.get_mip());
     case CSR_MIE: ret(state.mie);
     case CSR_MEPC: ret(state.mepc & pc_alignment_mask());
     case CSR_MSCRATCH: ret(state.mscratch);
@@ -1633,8 +1691,8 @@ reg_t processor_t::get_csr(int which, insn_t insn, bool write, bool peek)
     case CSR_HCOUNTEREN: ret(state.hcounteren);
     case CSR_HGEIE: ret(0);
     case CSR_HTVAL: ret(state.htval);
-    case CSR_HIP: ret(state.mip & MIP_HS_MASK);
-    case CSR_HVIP: ret(state.mip & MIP_VS_MASK);
+    case CSR_HIP: ret(state.get_mip() & MIP_HS_MASK);
+    case CSR_HVIP: ret(state.get_mip() & MIP_VS_MASK);
     case CSR_HTINST: ret(state.htinst);
     case CSR_HGATP: {
       if (!state.v && get_field(state.mstatus, MSTATUS_TVM))
@@ -1654,7 +1712,7 @@ reg_t processor_t::get_csr(int which, insn_t insn, bool write, bool peek)
     case CSR_VSEPC: ret(state.vsepc & pc_alignment_mask());
     case CSR_VSCAUSE: ret(state.vscause);
     case CSR_VSTVAL: ret(state.vstval);
-    case CSR_VSIP: ret((state.mip & state.hideleg & MIP_VS_MASK) >> 1);
+    case CSR_VSIP: ret((state.get_mip() & state.hideleg & MIP_VS_MASK) >> 1);
     case CSR_VSATP: ret(state.vsatp);
     case CSR_TSELECT: ret(state.tselect);
     case CSR_TDATA1:
@@ -1791,32 +1849,12 @@ reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc)
 
 insn_func_t processor_t::decode_insn(insn_t insn)
 {
-  // look up opcode in hash table
-  size_t idx = insn.bits() % OPCODE_CACHE_SIZE;
-  insn_desc_t desc = opcode_cache[idx];
-
-  if (unlikely(insn.bits() != desc.match || !(xlen == 64 ? desc.rv64 : desc.rv32))) {
-    // fall back to linear search
-    int cnt = 0;
-    insn_desc_t* p = &instructions[0];
-    while ((insn.bits() & p->mask) != p->match || !(xlen == 64 ? p->rv64 : p->rv32))
-      p++, cnt++;
-    desc = *p;
-
-    if (p->mask != 0 && p > &instructions[0]) {
-      if (p->match != (p-1)->match && p->match != (p+1)->match) {
-        // move to front of opcode list to reduce miss penalty
-        while (--p >= &instructions[0])
-          *(p+1) = *p;
-        instructions[0] = desc;
-      }
-    }
-
-    opcode_cache[idx] = desc;
-    opcode_cache[idx].match = insn.bits();
-  }
-
-  return xlen == 64 ? desc.rv64 : desc.rv32;
+  // every level tests new bits, so this is bounded by the instruction width
+  const decode_node_t* tree = &decode_tree[xlen == 64][0];
+  const decode_node_t* node = tree;
+  while (node->bits)
+    node = &tree[node->child + ((insn.bits() >> node->shift) & ((insn_bits_t(1) << node->bits) - 1))];
+  return node->func;
 }
 
 void processor_t::register_insn(insn_desc_t desc)
@@ -1824,6 +1862,58 @@ void processor_t::register_insn(insn_desc_t desc)
   instructions.push_back(desc);
 }
 
+// Fill in tree[node] to decode the candidates, which are in priority order
+// and agree with the instruction on the bits already tested.  A leaf is
+// reached once the first candidate is fully tested.  Otherwise, switch on
+// a run of untested bits that the first candidate decodes and as many of
+// the following ones as possible also do, so they all get split apart.
+static void build_decode_node(std::vector<decode_node_t>& tree, size_t node,
+                              const std::vector<const insn_desc_t*>& cands,
+                              insn_bits_t tested, bool rv64, int max_bits)
+{
+  if (cands.empty()) {
+    tree[node] = {&illegal_instruction, 0, 0, 0};
+    return;
+  }
+
+  const insn_desc_t* first = cands[0];
+  insn_bits_t common = first->mask & ~tested;
+  if (common == 0) {
+    tree[node] = {rv64 ? first->rv64 : first->rv32, 0, 0, 0};
+    return;
+  }
+
+  for (auto c : cands)
+    if (common & c->mask)
+      common &= c->mask;
+
+  int shift = 0, bits = 0;
+  for (int lo = 0; lo < int(8 * sizeof(insn_bits_t)); lo++) {
+    int len = 0;
+    while (lo + len < int(8 * sizeof(insn_bits_t)) && ((common >> (lo + len)) & 1))
+      len++;
+    if (len > bits)
+      shift = lo, bits = len;
+    lo += len;
+  }
+  bits = std::min(bits, max_bits);
+
+  insn_bits_t field = ((insn_bits_t(1) << bits) - 1) << shift;
+  size_t child = tree.size();
+  tree[node] = {nullptr, uint32_t(child), uint8_t(shift), uint8_t(bits)};
+  tree.resize(child + (size_t(1) << bits));
+
+  std::vector<const insn_desc_t*> subset;
+  for (size_t i = 0; i < (size_t(1) << bits); i++) {
+    insn_bits_t value = insn_bits_t(i) << shift;
+    subset.clear();
+    for (auto c : cands)
+      if (((value ^ c->match) & c->mask & field) == 0)
+        subset.push_back(c);
+    build_decode_node(tree, child + i, subset, tested | field, rv64, max_bits);
+  }
+}
+
 void processor_t::build_opcode_map()
 {
   struct cmp {
@@ -1835,8 +1925,15 @@ void processor_t::build_opcode_map()
   };
   std::sort(instructions.begin(), instructions.end(), cmp());
 
-  for (size_t i = 0; i < OPCODE_CACHE_SIZE; i++)
-    opcode_cache[i] = {0, 0, &illegal_instruction, &illegal_instruction};
+  // the first matching instruction in sorted order wins
+  for (int rv64 = 0; rv64 < 2; rv64++) {
+    std::vector<const insn_desc_t*> cands;
+    for (auto& insn : instructions)
+      if (rv64 ? insn.rv64 : insn.rv32)
+        cands.push_back(&insn);
+    decode_tree[rv64].assign(1, decode_node_t());
+    build_decode_node(decode_tree[rv64], 0, cands, 0, rv64, DECODE_FIELD_BITS);
+  }
 }
 
 void processor_t::register_extension(extension_t* x)
@@ -1892,7 +1989,7 @@ bool processor_t::load(reg_t addr, size_t len, uint8_t* bytes)
     case 0:
       if (len <= 4) {
         memset(bytes, 0, len);
-        bytes[0] = get_field(state.mip, MIP_MSIP);
+        bytes[0] = get_field(state.mip_lines, MIP_MSIP);
         return true;
       }
       break;
@@ -1907,7 +2004,7 @@ bool processor_t::store(reg_t addr, size_t len, const uint8_t* bytes)
   {
     case 0:
       if (len <= 4) {
-        state.mip = set_field(state.mip, MIP_MSIP, bytes[0]);
+        state.set_mip_line(MIP_MSIP, bytes[0] & 1);
         return true;
       }
       break;
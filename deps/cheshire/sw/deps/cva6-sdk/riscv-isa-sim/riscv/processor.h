@@ -11,6 +11,9 @@
 #include <unordered_map>
 #include <map>
 #include <cassert>
+#include <new>
+#include <atomic>
+#include <type_traits>
 #include "debug_rom_defines.h"
 #include "entropy_source.h"
 
@@ -22,6 +25,7 @@ class simif_t;
 class trap_t;
 class extension_t;
 class disassembler_t;
+class bbv_profiler_t;
 
 struct insn_desc_t
 {
@@ -31,6 +35,17 @@ struct insn_desc_t
   insn_func_t rv64;
 };
 
+// A node of the instruction decode tree: interior nodes switch on the
+// instruction bits [shift, shift+bits) to pick one of 2^bits children
+// starting at index child; leaves (bits == 0) hold the decoded function.
+struct decode_node_t
+{
+  insn_func_t func;
+  uint32_t child;
+  uint8_t shift;
+  uint8_t bits;
+};
+
 // regnum, data
 typedef std::unordered_map<reg_t, freg_t> commit_log_reg_t;
 
@@ -171,8 +186,22 @@ struct state_t
   reg_t mtvec;
   reg_t mcause;
   reg_t minstret;
+  reg_t mcycle;
   reg_t mie;
   reg_t mip;
+  // Interrupt lines driven by devices, which may run on other harts' threads
+  // with --parallel.  They are kept apart from the bits the hart writes
+  // itself, so that neither loses the other's updates, and read as set in
+  // mip.
+  std::atomic<reg_t> mip_lines;
+  reg_t get_mip() const { return mip | mip_lines; }
+  void set_mip_line(reg_t mask, bool level)
+  {
+    if (level)
+      mip_lines |= mask;
+    else
+      mip_lines &= ~mask;
+  }
   reg_t medeleg;
   reg_t mideleg;
   uint32_t mcounteren;
@@ -278,12 +307,30 @@ public:
 
   void set_debug(bool value);
   void set_histogram(bool value);
+  void set_tlb_stats(bool value) { tlb_stats_enabled = value; }
+  // When true, wfi stalls the hart until an interrupt it has enabled is
+  // pending, rather than being treated as a nop.
+  void set_idle_skip(bool value) { idle_skip_enabled = value; }
+  // Charge each instruction millicycles thousandths of a cycle in mcycle,
+  // on top of the memory models' stalls, and report the cycles on exit.
+  // Zero, the default, charges one cycle and reports nothing.
+  void set_cpi(reg_t millicycles) { cpi = millicycles; }
+  // report each basic block entered to profiler, or to nothing if NULL
+  void set_bbv_profiler(bbv_profiler_t* profiler) { bbv_profiler = profiler; }
+  bool is_waiting_for_interrupt()
+  {
+    return in_wfi && !(state.get_mip() & state.mie) && halt_request == HR_NONE;
+  }
 #ifdef RISCV_ENABLE_COMMITLOG
   void enable_log_commits();
   bool get_log_commits_enabled() const { return log_commits_enabled; }
 #endif
   void reset();
   void step(size_t n); // run for n cycles
+  // save or restore the architectural state; restore() expects a hart
+  // built with the same ISA and vector configuration
+  void save(checkpoint_section_t& cp);
+  void restore(const checkpoint_section_t& cp);
   void set_csr(int which, reg_t val);
   uint32_t get_id() const { return id; }
   reg_t get_csr(int which, insn_t insn, bool write, bool peek = 0);
@@ -317,6 +364,14 @@ public:
     if (unlikely(pc & ~pc_alignment_mask()))
       throw trap_instruction_address_misaligned(pc, 0, 0);
   }
+  // Raise a trap of type T without throwing: the instruction returns the
+  // PC_TRAP this yields, and step() takes the recorded trap as if it had
+  // caught it.
+  template<class T, class... Args> reg_t set_pending_trap(Args... args) {
+    static_assert(sizeof(T) <= sizeof(pending_trap_storage), "trap too large");
+    pending_trap = new (&pending_trap_storage) T(args...);
+    return PC_TRAP;
+  }
   reg_t legalize_privilege(reg_t);
   void set_privilege(reg_t);
   void set_virt(bool);
@@ -443,6 +498,13 @@ private:
   reg_t max_isa;
   std::string isa_string;
   bool histogram_enabled;
+  bool tlb_stats_enabled;
+  bool idle_skip_enabled;
+  bool in_wfi;
+  reg_t cpi; // in thousandths of a cycle, or 0
+  reg_t cpi_carry; // thousandths charged to no cycle yet
+  void uncharge_cycles(); // for a write to mcycle
+  bbv_profiler_t* bbv_profiler;
   bool log_commits_enabled;
   FILE *log_file;
   bool halt_on_reset;
@@ -454,12 +516,23 @@ private:
   std::vector<insn_desc_t> instructions;
   std::map<reg_t,uint64_t> pc_histogram;
 
-  static const size_t OPCODE_CACHE_SIZE = 8191;
-  insn_desc_t opcode_cache[OPCODE_CACHE_SIZE];
+  // decode trees for RV32 and RV64, rebuilt whenever instructions change
+  static const int DECODE_FIELD_BITS = 8;
+  std::vector<decode_node_t> decode_tree[2];
 
-  void take_pending_interrupt() { take_interrupt(state.mip & state.mie); }
+  // at most one trap is pending; traps are trivially destructible
+  trap_t* pending_trap;
+  std::aligned_storage<sizeof(mem_trap_t), alignof(mem_trap_t)>::type pending_trap_storage;
+
+  void take_pending_interrupt() {
+    if (reg_t cause = interrupt_cause(state.get_mip() & state.mie))
+      set_pending_trap<trap_t>(cause);
+  }
+  reg_t interrupt_cause(reg_t mask); // cause of first enabled interrupt, or 0
   void take_interrupt(reg_t mask); // take first enabled interrupt in mask
   void take_trap(trap_t& t, reg_t epc); // take an exception
+  void take_pending_trap(reg_t epc);
+  void deliver_trap(trap_t& t, reg_t epc); // take_trap, then honor single-step
   void disasm(insn_t insn); // disassemble and print an instruction
   int paddr_bits();
 
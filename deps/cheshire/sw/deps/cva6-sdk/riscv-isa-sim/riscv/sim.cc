@@ -4,6 +4,7 @@
 #include "mmu.h"
 #include "dts.h"
 #include "remote_bitbang.h"
+#include "virtio.h"
 #include "byteorder.h"
 #include "platform.h"
 #include <fstream>
@@ -47,9 +48,23 @@ sim_t::sim_t(const char* isa, const char* priv, const char* varch,
     start_pc(start_pc),
     dtb_file(dtb_file ? dtb_file : ""),
     dtb_enabled(dtb_enabled),
+    map_elf(false),
     log_file(log_path),
     current_step(0),
     current_proc(0),
+    steps_per_hart(0),
+    round_steps(0),
+    checkpoint_steps(0),
+    bbv_interval(0),
+    bbv_next(0),
+    sampler(NULL),
+    stopping(false),
+    parallel_quantum(0),
+    parallel_deterministic(false),
+    idle_skip(false),
+    hart_generation(0),
+    harts_running(0),
+    hart_threads_exit(false),
     debug(false),
     histogram_enabled(false),
     log(false),
@@ -61,8 +76,11 @@ sim_t::sim_t(const char* isa, const char* priv, const char* varch,
   for (auto& x : mems)
     bus.add_device(x.first, x.second);
 
-  for (auto& x : plugin_devices)
+  for (auto& x : plugin_devices) {
     bus.add_device(x.first, x.second);
+    if (dynamic_cast<virtio_device_t*>(x.second))
+      virtio_bases.push_back(x.first);
+  }
 
   debug_module.add_device(&bus);
 
@@ -84,6 +102,20 @@ sim_t::sim_t(const char* isa, const char* priv, const char* varch,
 
   make_dtb();
 
+  // virtio devices interrupt through the PLIC, sources numbered from 1
+  if (!virtio_bases.empty()) {
+    if (virtio_bases.size() > plic_t::PLIC_NDEV) {
+      std::cerr << "at most " << plic_t::PLIC_NDEV << " virtio devices are supported\n";
+      exit(1);
+    }
+    plic.reset(new plic_t(procs));
+    bus.add_device(PLIC_BASE, plic.get());
+    uint32_t irq = 1;
+    for (auto& x : plugin_devices)
+      if (auto dev = dynamic_cast<virtio_device_t*>(x.second))
+        dev->attach(this, irq++);
+  }
+
   void *fdt = (void *)dtb.c_str();
   //handle clic
   clint.reset(new clint_t(procs, CPU_HZ / INSNS_PER_RTC_TICK, real_time_clint));
@@ -94,6 +126,13 @@ sim_t::sim_t(const char* isa, const char* priv, const char* varch,
     bus.add_device(clint_base, clint.get());
   }
 
+  // version 2 plugins take the PLIC sources after the virtio devices'
+  uint32_t plic_source = plic ? virtio_bases.size() + 1 : 0;
+  for (auto& x : plugin_devices)
+    if (auto dev = dynamic_cast<mmio_plugin_device_t*>(x.second))
+      if (dev->attach(this, plic_source) && plic_source)
+        plic_source++;
+
   //per core attribute
   int cpu_offset = 0, rc;
   size_t cpu_idx = 0;
@@ -153,6 +192,16 @@ sim_t::sim_t(const char* isa, const char* priv, const char* varch,
 
 sim_t::~sim_t()
 {
+  if (!hart_threads.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(hart_lock);
+      hart_threads_exit = true;
+      hart_generation++;
+    }
+    hart_start.notify_all();
+    for (auto& t : hart_threads)
+      t.join();
+  }
   for (size_t i = 0; i < procs.size(); i++)
     delete procs[i];
   delete debug_mmu;
@@ -168,15 +217,22 @@ void sim_t::main()
   if (!debug && log)
     set_procs_debug(true);
 
+  // the hooks see the start of the run as the end of a round, too
+  stopping = end_of_round();
   while (!done())
   {
+    if (stopping) {
+      request_exit(0);
+      host->switch_to();
+      continue;
+    }
+
     if (debug || ctrlc_pressed)
       interactive();
+    else if (parallel_quantum && !log)
+      step_parallel();
     else
       step(INTERLEAVE);
-    if (remote_bitbang) {
-      remote_bitbang->tick();
-    }
   }
 }
 
@@ -184,29 +240,197 @@ int sim_t::run()
 {
   host = context_t::current();
   target.init(sim_thread_main, this);
-  return htif_t::run();
+  int exit_code = htif_t::run();
+
+  if (bbv_recorder) {
+    try {
+      bbv_recorder->finish();
+    } catch (std::exception& e) {
+      std::cerr << e.what() << "\n";
+    }
+  }
+
+  return exit_code;
+}
+
+// Called between rounds of the scheduler, when every hart has been
+// stepped steps_per_hart times.
+bool sim_t::end_of_round()
+{
+  if (bbv_recorder) {
+    for (; steps_per_hart >= bbv_next; bbv_next += bbv_interval)
+      bbv_recorder->end_interval();
+  }
+
+  if (sampler && sampler->end_of_round(steps_per_hart, procs))
+    return true;
+
+  if (checkpoint_steps && steps_per_hart >= checkpoint_steps) {
+    try {
+      save_checkpoint(checkpoint_dir);
+    } catch (std::exception& e) {
+      std::cerr << "could not save checkpoint: " << e.what() << "\n";
+      exit(1);
+    }
+    checkpoint_steps = 0;
+    return true;
+  }
+
+  return false;
 }
 
 void sim_t::step(size_t n)
 {
   for (size_t i = 0, steps = 0; i < n; i += steps)
   {
-    steps = std::min(n - i, INTERLEAVE - current_step);
+    if (current_step == 0 && current_proc == 0)
+      round_steps = round_length(INTERLEAVE);
+    steps = std::min(n - i, round_steps - current_step);
     procs[current_proc]->step(steps);
 
     current_step += steps;
-    if (current_step == INTERLEAVE)
+    if (current_step == round_steps)
     {
       current_step = 0;
       procs[current_proc]->get_mmu()->yield_load_reservation();
       if (++current_proc == procs.size()) {
         current_proc = 0;
-        clint->increment(INTERLEAVE / INSNS_PER_RTC_TICK);
+        advance_time(round_steps);
+        if (idle_skip)
+          skip_idle_time();
+        stopping = end_of_round();
       }
 
       host->switch_to();
+      if (stopping)
+        return;
+    }
+  }
+}
+
+reg_t sim_t::round_length(reg_t max_steps)
+{
+  reg_t next = events.next_time();
+  reg_t timer = clint->ticks_until_interrupt();
+  if (timer)
+    next = std::min(next, steps_per_hart + steps_until_mtime(timer));
+  // events due now were serviced when the last round ended
+  return next > steps_per_hart ? std::min(max_steps, next - steps_per_hart) : max_steps;
+}
+
+void sim_t::advance_time(reg_t steps)
+{
+  reg_t ticks = (steps_per_hart + steps) / INSNS_PER_RTC_TICK - steps_per_hart / INSNS_PER_RTC_TICK;
+  steps_per_hart += steps;
+  clint->increment(ticks);
+  events.run_due(steps_per_hart);
+}
+
+reg_t sim_t::steps_until_mtime(reg_t ticks)
+{
+  return ticks * INSNS_PER_RTC_TICK - steps_per_hart % INSNS_PER_RTC_TICK;
+}
+
+void sim_t::set_remote_bitbang(remote_bitbang_t* remote_bitbang)
+{
+  this->remote_bitbang = remote_bitbang;
+  if (remote_bitbang)
+    events.schedule(steps_per_hart + INTERLEAVE, [this](reg_t now) { tick_remote_bitbang(now); });
+}
+
+void sim_t::tick_remote_bitbang(reg_t now)
+{
+  remote_bitbang->tick();
+  events.schedule(now + INTERLEAVE, [this](reg_t now) { tick_remote_bitbang(now); });
+}
+
+void sim_t::set_parallel(size_t quantum, bool deterministic)
+{
+  parallel_quantum = procs.size() > 1 ? quantum : 0;
+  parallel_deterministic = deterministic;
+  for (auto p : procs)
+    p->get_mmu()->set_parallel(parallel_quantum != 0 && !deterministic);
+}
+
+void sim_t::hart_thread_main(size_t id)
+{
+  uint64_t generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(hart_lock);
+      hart_start.wait(lock, [&]{ return hart_generation != generation; });
+      generation = hart_generation;
+      if (hart_threads_exit)
+        return;
     }
+
+    procs[id]->step(round_steps);
+
+    std::lock_guard<std::mutex> lock(hart_lock);
+    if (--harts_running == 0)
+      hart_done.notify_one();
+  }
+}
+
+void sim_t::step_parallel()
+{
+  if (parallel_deterministic) {
+    round_steps = round_length(parallel_quantum);
+    for (auto p : procs)
+      p->step(round_steps);
+    end_parallel_round();
+    return;
+  }
+
+  // Hart 0 runs on the simulation thread, the others on their own threads.
+  if (hart_threads.empty())
+    for (size_t i = 1; i < procs.size(); i++)
+      hart_threads.emplace_back(&sim_t::hart_thread_main, this, i);
+
+  {
+    std::lock_guard<std::mutex> lock(hart_lock);
+    harts_running = procs.size() - 1;
+    hart_generation++;
+    round_steps = round_length(parallel_quantum);
+  }
+  hart_start.notify_all();
+
+  procs[0]->step(round_steps);
+
+  {
+    std::unique_lock<std::mutex> lock(hart_lock);
+    hart_done.wait(lock, [&]{ return harts_running == 0; });
   }
+  end_parallel_round();
+}
+
+void sim_t::end_parallel_round()
+{
+  // All harts are stopped, so the rest of the machine can be updated
+  // without further locking.
+  for (auto p : procs)
+    p->get_mmu()->yield_load_reservation();
+  advance_time(round_steps);
+  if (idle_skip)
+    skip_idle_time();
+  stopping = end_of_round();
+
+  host->switch_to();
+}
+
+// With every hart stalled in wfi, the rounds until the next timer
+// interrupt or device event would do nothing but advance mtime.  Advance
+// it to that point at once; the interrupt is raised as usual.  With
+// nothing pending, time goes on a round at a time.
+void sim_t::skip_idle_time()
+{
+  for (auto p : procs)
+    if (!p->is_waiting_for_interrupt())
+      return;
+
+  if (events.next_time() == reg_t(-1) && !clint->ticks_until_interrupt())
+    return;
+  advance_time(round_length(reg_t(-1)));
 }
 
 void sim_t::set_debug(bool value)
@@ -222,6 +446,42 @@ void sim_t::set_histogram(bool value)
   }
 }
 
+void sim_t::set_tlb_stats(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_tlb_stats(value);
+  }
+}
+
+void sim_t::set_idle_skip(bool value)
+{
+  idle_skip = value;
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_idle_skip(value);
+  }
+}
+
+void sim_t::set_cpi(reg_t millicycles)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_cpi(millicycles);
+  }
+}
+
+void sim_t::set_bbv(reg_t interval, const std::string& path, size_t max_k)
+{
+  bbv_recorder.reset(new bbv_recorder_t(path, max_k, procs));
+  bbv_interval = interval;
+  bbv_next = steps_per_hart + interval;
+}
+
+void sim_t::set_tlb_size(size_t sets, size_t ways)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->get_mmu()->set_stlb_size(sets, ways);
+  }
+}
+
 void sim_t::configure_log(bool enable_log, bool enable_commitlog)
 {
   log = enable_log;
@@ -257,6 +517,9 @@ bool sim_t::mmio_load(reg_t addr, size_t len, uint8_t* bytes)
 {
   if (addr + len < addr || !paddr_ok(addr + len - 1))
     return false;
+  std::unique_lock<std::mutex> lock(mmio_lock, std::defer_lock);
+  if (parallel_quantum)
+    lock.lock();
   return bus.load(addr, len, bytes);
 }
 
@@ -264,6 +527,9 @@ bool sim_t::mmio_store(reg_t addr, size_t len, const uint8_t* bytes)
 {
   if (addr + len < addr || !paddr_ok(addr + len - 1))
     return false;
+  std::unique_lock<std::mutex> lock(mmio_lock, std::defer_lock);
+  if (parallel_quantum)
+    lock.lock();
   return bus.store(addr, len, bytes);
 }
 
@@ -281,7 +547,8 @@ void sim_t::make_dtb()
 
     dtb = strstream.str();
   } else {
-    dts = make_dts(INSNS_PER_RTC_TICK, CPU_HZ, initrd_start, initrd_end, bootargs, procs, mems);
+    dts = make_dts(INSNS_PER_RTC_TICK, CPU_HZ, initrd_start, initrd_end, bootargs, procs, mems,
+                   virtio_bases);
     dtb = dts_compile(dts);
   }
 }
@@ -336,7 +603,8 @@ void sim_t::set_rom()
 
     dtb = strstream.str();
   } else {
-    dts = make_dts(INSNS_PER_RTC_TICK, CPU_HZ, initrd_start, initrd_end, bootargs, procs, mems);
+    dts = make_dts(INSNS_PER_RTC_TICK, CPU_HZ, initrd_start, initrd_end, bootargs, procs, mems,
+                   virtio_bases);
     dtb = dts_compile(dts);
   }
 
@@ -351,11 +619,7 @@ void sim_t::set_rom()
 char* sim_t::addr_to_mem(reg_t addr) {
   if (!paddr_ok(addr))
     return NULL;
-  auto desc = bus.find_device(addr);
-  if (auto mem = dynamic_cast<mem_t*>(desc.second))
-    if (addr - desc.first < mem->size())
-      return mem->contents(addr - desc.first);
-  return NULL;
+  return bus.addr_to_mem(addr);
 }
 
 const char* sim_t::get_symbol(uint64_t addr)
@@ -365,6 +629,20 @@ const char* sim_t::get_symbol(uint64_t addr)
 
 // htif
 
+void sim_t::start()
+{
+  htif_t::start();
+
+  if (!restore_dir.empty()) {
+    try {
+      restore_checkpoint(restore_dir);
+    } catch (std::exception& e) {
+      std::cerr << "could not restore checkpoint: " << e.what() << "\n";
+      exit(1);
+    }
+  }
+}
+
 void sim_t::reset()
 {
   if (dtb_enabled)
@@ -376,19 +654,78 @@ void sim_t::idle()
   target.switch_to();
 }
 
+char* sim_t::chunk_to_mem(addr_t taddr, size_t len)
+{
+  char* first = addr_to_mem(taddr);
+  char* last = addr_to_mem(taddr + len - 1);
+  return first && last == first + (len - 1) ? first : NULL;
+}
+
+// Chunks are copied a page at a time straight to or from the host memory
+// backing them.  Only pages that aren't plain memory go through the debug
+// MMU, a doubleword at a time.
 void sim_t::read_chunk(addr_t taddr, size_t len, void* dst)
 {
-  assert(len == 8);
-  auto data = debug_mmu->to_target(debug_mmu->load_uint64(taddr));
-  memcpy(dst, &data, sizeof data);
+  assert(len % chunk_align() == 0);
+  for (size_t pos = 0; pos < len; ) {
+    size_t this_len = std::min(len - pos, size_t(PGSIZE - (taddr + pos) % PGSIZE));
+    if (char* host_addr = chunk_to_mem(taddr + pos, this_len)) {
+      memcpy((char*)dst + pos, host_addr, this_len);
+      pos += this_len;
+      continue;
+    }
+    for (size_t end = pos + this_len; pos < end; pos += 8) {
+      auto data = debug_mmu->to_target(debug_mmu->load_uint64(taddr + pos));
+      memcpy((char*)dst + pos, &data, sizeof data);
+    }
+  }
 }
 
 void sim_t::write_chunk(addr_t taddr, size_t len, const void* src)
 {
-  assert(len == 8);
-  target_endian<uint64_t> data;
-  memcpy(&data, src, sizeof data);
-  debug_mmu->store_uint64(taddr, debug_mmu->from_target(data));
+  assert(len % chunk_align() == 0);
+  for (size_t pos = 0; pos < len; ) {
+    size_t this_len = std::min(len - pos, size_t(PGSIZE - (taddr + pos) % PGSIZE));
+    if (char* host_addr = chunk_to_mem(taddr + pos, this_len)) {
+      memcpy(host_addr, (const char*)src + pos, this_len);
+      pos += this_len;
+      continue;
+    }
+    for (size_t end = pos + this_len; pos < end; pos += 8) {
+      target_endian<uint64_t> data;
+      memcpy(&data, (const char*)src + pos, sizeof data);
+      debug_mmu->store_uint64(taddr + pos, debug_mmu->from_target(data));
+    }
+  }
+}
+
+void sim_t::clear_chunk(addr_t taddr, size_t len)
+{
+  assert(len % chunk_align() == 0);
+  for (size_t pos = 0; pos < len; ) {
+    size_t this_len = std::min(len - pos, size_t(PGSIZE - (taddr + pos) % PGSIZE));
+    if (char* host_addr = chunk_to_mem(taddr + pos, this_len)) {
+      // Pages of RAM that were never written read as zero without being
+      // allocated; checking first keeps them that way.
+      if (host_addr[0] != 0 || memcmp(host_addr, host_addr + 1, this_len - 1) != 0)
+        memset(host_addr, 0, this_len);
+      pos += this_len;
+      continue;
+    }
+    for (size_t end = pos + this_len; pos < end; pos += 8)
+      debug_mmu->store_uint64(taddr + pos, 0);
+  }
+}
+
+// With --map-elf, segments of the program are mapped from the file into
+// RAM, and read in as the harts touch them.
+bool sim_t::map_file(addr_t taddr, size_t len, int fd, off_t offset)
+{
+  if (!map_elf || !chunk_to_mem(taddr, len))
+    return false;
+  auto desc = bus.find_device(taddr);
+  mem_t* mem = dynamic_cast<mem_t*>(desc.second);
+  return mem && mem->map_file(taddr - desc.first, len, fd, offset);
 }
 
 void sim_t::set_target_endianness(memif_endianness_t endianness)
@@ -5,19 +5,25 @@
 
 #include "debug_module.h"
 #include "devices.h"
+#include "event_queue.h"
 #include "log_file.h"
 #include "processor.h"
 #include "simif.h"
+#include "simpoint.h"
 
 #include <fesvr/htif.h>
 #include <fesvr/context.h>
 #include <vector>
 #include <string>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <sys/types.h>
 
 class mmu_t;
 class remote_bitbang_t;
+class virtio_device_t;
 
 // this class encapsulates the processors and memory in a RISC-V machine.
 class sim_t : public htif_t, public simif_t
@@ -37,6 +43,49 @@ public:
   int run();
   void set_debug(bool value);
   void set_histogram(bool value);
+  void set_tlb_stats(bool value);
+  void set_tlb_size(size_t sets, size_t ways);
+
+  // Stall harts in wfi until an interrupt is pending, and when all of them
+  // are, skip ahead to the next timer interrupt or device event.  Time stops
+  // exactly where the harts would have woken, so the simulated timeline is
+  // the same as if the idle instructions had been run.
+  void set_idle_skip(bool value);
+
+  // Time mcycle with a base CPI, in thousandths of a cycle; see
+  // processor_t::set_cpi.
+  void set_cpi(reg_t millicycles);
+
+  // Run each hart on its own host thread.  Harts synchronize every quantum
+  // instructions, at which point the CLINT advances, load reservations are
+  // dropped and HTIF is serviced, just as after a round of the serial
+  // scheduler.  A quantum of 0 selects the serial scheduler.  An SC checks
+  // only that memory still holds the value its LR read, so it misses an
+  // ABA sequence on another hart.  A deterministic run steps the harts in
+  // hart order on the simulation thread instead, each for the quantum,
+  // with the usual reservations, so that it can be replayed exactly.
+  void set_parallel(size_t quantum, bool deterministic);
+
+  // Save a checkpoint to dir once every hart has run at least steps
+  // instructions, then exit.  The checkpoint is taken at the end of a
+  // scheduler round, so harts may run up to a round further.
+  void set_checkpoint(reg_t steps, const std::string& dir);
+  // Restore the checkpoint in dir after loading the program.  The
+  // simulator must be configured as it was when the checkpoint was saved.
+  void set_restore(const std::string& dir);
+
+  // Map the program's segments from its file copy-on-write, so they are
+  // read in only as the harts touch them, rather than copying them.
+  // Pages not yet touched come from the file as it is then, so it must not
+  // be changed or truncated in place while the simulation runs.
+  void set_map_elf(bool value) { map_elf = value; }
+
+  // Write a basic-block vector for every interval instructions each hart
+  // runs, and pick up to max_k simulation points from them at the end.
+  void set_bbv(reg_t interval, const std::string& path, size_t max_k);
+  // Let sampler enable the cache models only around its simulation
+  // points, and stop once it has measured them all.
+  void set_sampler(simpoint_sampler_t* sampler) { this->sampler = sampler; }
 
   // Configure logging
   //
@@ -47,9 +96,7 @@ public:
   void configure_log(bool enable_log, bool enable_commitlog);
 
   void set_procs_debug(bool value);
-  void set_remote_bitbang(remote_bitbang_t* remote_bitbang) {
-    this->remote_bitbang = remote_bitbang;
-  }
+  void set_remote_bitbang(remote_bitbang_t* remote_bitbang);
   const char* get_dts() { if (dts.empty()) reset(); return dts.c_str(); }
   processor_t* get_core(size_t i) { return procs.at(i); }
   unsigned nprocs() const { return procs.size(); }
@@ -70,8 +117,11 @@ private:
   std::string dtb;
   std::string dtb_file;
   bool dtb_enabled;
+  bool map_elf;
   std::unique_ptr<rom_device_t> boot_rom;
   std::unique_ptr<clint_t> clint;
+  std::unique_ptr<plic_t> plic; // only with virtio devices
+  std::vector<reg_t> virtio_bases;
   bus_t bus;
   log_file_t log_file;
 
@@ -82,6 +132,50 @@ private:
   static const size_t CPU_HZ = 1000000000; // 1GHz CPU
   size_t current_step;
   size_t current_proc;
+  reg_t steps_per_hart; // instructions each hart has been stepped
+
+  // Device timing.  Each round runs the harts up to the next pending
+  // event or timer interrupt, but no further than INTERLEAVE (or the
+  // parallel quantum) instructions.
+  event_queue_t events;
+  reg_t round_steps; // length of the current round
+  reg_t round_length(reg_t max_steps);
+  void advance_time(reg_t steps); // end a round of the given length
+  reg_t steps_until_mtime(reg_t ticks); // steps until mtime has advanced by ticks
+  void tick_remote_bitbang(reg_t now);
+
+  // checkpoints
+  reg_t checkpoint_steps; // 0 if no checkpoint is to be saved
+  std::string checkpoint_dir;
+  std::string restore_dir;
+  void save_checkpoint(const std::string& dir);
+  void restore_checkpoint(const std::string& dir);
+
+  // sampled simulation
+  std::unique_ptr<bbv_recorder_t> bbv_recorder;
+  reg_t bbv_interval;
+  reg_t bbv_next; // steps_per_hart at which the current interval ends
+  simpoint_sampler_t* sampler;
+
+  bool end_of_round(); // returns true to stop the simulation
+  bool stopping; // end_of_round stopped the simulation
+
+  // parallel scheduler state
+  void step_parallel(); // run every hart for one quantum
+  void end_parallel_round();
+  void skip_idle_time(); // fast-forward to the next event if all harts wait
+  void hart_thread_main(size_t id);
+  size_t parallel_quantum;
+  bool parallel_deterministic; // harts take turns on this thread
+  bool idle_skip;
+  std::vector<std::thread> hart_threads;
+  std::mutex hart_lock;
+  std::condition_variable hart_start;
+  std::condition_variable hart_done;
+  uint64_t hart_generation; // bumped to start each quantum
+  size_t harts_running;
+  bool hart_threads_exit;
+  std::mutex mmio_lock; // devices aren't thread-safe
   bool debug;
   bool histogram_enabled; // provide a histogram of PCs
   bool log;
@@ -125,6 +219,8 @@ private:
   friend class processor_t;
   friend class mmu_t;
   friend class debug_module_t;
+  friend class mmio_plugin_device_t;
+  friend class virtio_device_t;
 
   // htif
   friend void sim_thread_main(void*);
@@ -132,12 +228,18 @@ private:
 
   context_t* host;
   context_t target;
+  void start() override;
   void reset();
   void idle();
   void read_chunk(addr_t taddr, size_t len, void* dst);
   void write_chunk(addr_t taddr, size_t len, const void* src);
+  void clear_chunk(addr_t taddr, size_t len);
+  bool map_file(addr_t taddr, size_t len, int fd, off_t offset);
+  // host memory backing len bytes at taddr, or NULL if they aren't in one
+  // RAM region
+  char* chunk_to_mem(addr_t taddr, size_t len);
   size_t chunk_align() { return 8; }
-  size_t chunk_max_size() { return 8; }
+  size_t chunk_max_size() { return 1 << 20; }
   void set_target_endianness(memif_endianness_t endianness);
   memif_endianness_t get_target_endianness() const;
 
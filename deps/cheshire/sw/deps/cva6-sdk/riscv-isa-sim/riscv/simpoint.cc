@@ -0,0 +1,385 @@
+// See LICENSE for license details.
+
+#include "simpoint.h"
+#include "cachesim.h"
+#include "processor.h"
+#include "mmu.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <inttypes.h>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <stdexcept>
+
+bbv_recorder_t::bbv_recorder_t(const std::string& path, size_t max_k,
+                               const std::vector<processor_t*>& procs)
+  : path(path), max_k(max_k)
+{
+  file = fopen(path.c_str(), "w");
+  if (!file)
+    throw std::runtime_error("could not open " + path);
+
+  for (auto p : procs) {
+    profilers.emplace_back(new bbv_profiler_t);
+    p->set_bbv_profiler(profilers.back().get());
+  }
+}
+
+bbv_recorder_t::~bbv_recorder_t()
+{
+  if (file)
+    fclose(file);
+}
+
+void bbv_recorder_t::end_interval()
+{
+  record(collect());
+}
+
+bbv_t bbv_recorder_t::collect()
+{
+  std::map<size_t, uint64_t> counts;
+  std::unordered_map<reg_t, uint64_t> hart_counts;
+  for (auto& profiler : profilers) {
+    profiler->take_counts(hart_counts);
+    for (auto& block : hart_counts) {
+      size_t id = block_ids.emplace(block.first, block_ids.size() + 1).first->second;
+      counts[id] += block.second;
+    }
+  }
+
+  return bbv_t(counts.begin(), counts.end());
+}
+
+void bbv_recorder_t::record(const bbv_t& bbv)
+{
+  fputc('T', file);
+  for (auto& block : bbv)
+    fprintf(file, ":%zu:%" PRIu64 " ", block.first, block.second);
+  fputc('\n', file);
+  intervals.push_back(bbv);
+}
+
+void bbv_recorder_t::finish()
+{
+  // the last interval is usually partial; keep it unless it's empty
+  bbv_t last = collect();
+  if (!last.empty())
+    record(last);
+  fclose(file);
+  file = NULL;
+
+  std::ofstream simpoints(path + ".simpoints"), weights(path + ".weights");
+  std::vector<simpoint_t> points = pick_simpoints(intervals, max_k);
+  for (size_t i = 0; i < points.size(); i++) {
+    simpoints << points[i].interval << ' ' << i << '\n';
+    weights << points[i].weight << ' ' << i << '\n';
+  }
+  if (!simpoints.good() || !weights.good())
+    throw std::runtime_error("could not write simulation points for " + path);
+}
+
+// SimPoint projects vectors to 15 dimensions; clustering is barely
+// affected, and k-means gets much cheaper.
+static const size_t PROJECTED_DIMS = 15;
+static const int KMEANS_SEEDS = 5;
+static const int KMEANS_MAX_ITERATIONS = 100;
+
+typedef std::vector<double> point_t;
+
+static double distance2(const point_t& a, const point_t& b)
+{
+  double d = 0;
+  for (size_t i = 0; i < a.size(); i++)
+    d += (a[i] - b[i]) * (a[i] - b[i]);
+  return d;
+}
+
+// a fixed random value in [-1, 1) for each block and dimension
+static double projection(size_t id, size_t dim)
+{
+  uint64_t x = id * PROJECTED_DIMS + dim + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return double(x >> 11) / double(uint64_t(1) << 52) - 1.0;
+}
+
+struct clustering_t {
+  std::vector<point_t> centroids;
+  std::vector<size_t> cluster;
+  double distortion;
+};
+
+static clustering_t kmeans(const std::vector<point_t>& points, size_t k, uint64_t seed)
+{
+  std::mt19937_64 rng(seed);
+  auto uniform = [&]() { return double(rng() >> 11) / double(uint64_t(1) << 53); };
+
+  // k-means++ seeding
+  clustering_t c;
+  c.centroids.push_back(points[rng() % points.size()]);
+  std::vector<double> nearest(points.size(), std::numeric_limits<double>::max());
+  while (c.centroids.size() < k) {
+    double total = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+      nearest[i] = std::min(nearest[i], distance2(points[i], c.centroids.back()));
+      total += nearest[i];
+    }
+    size_t pick = 0;
+    double r = uniform() * total;
+    for (; pick + 1 < points.size() && r >= nearest[pick]; pick++)
+      r -= nearest[pick];
+    c.centroids.push_back(points[pick]);
+  }
+
+  c.cluster.assign(points.size(), 0);
+  for (int iter = 0; iter < KMEANS_MAX_ITERATIONS; iter++) {
+    bool changed = iter == 0;
+    c.distortion = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+      size_t best = 0;
+      double best_d = std::numeric_limits<double>::max();
+      for (size_t j = 0; j < k; j++) {
+        double d = distance2(points[i], c.centroids[j]);
+        if (d < best_d)
+          best = j, best_d = d;
+      }
+      changed |= c.cluster[i] != best;
+      c.cluster[i] = best;
+      c.distortion += best_d;
+    }
+    if (!changed)
+      break;
+
+    std::vector<size_t> sizes(k);
+    for (auto& centroid : c.centroids)
+      centroid.assign(PROJECTED_DIMS, 0);
+    for (size_t i = 0; i < points.size(); i++) {
+      sizes[c.cluster[i]]++;
+      for (size_t d = 0; d < PROJECTED_DIMS; d++)
+        c.centroids[c.cluster[i]][d] += points[i][d];
+    }
+    for (size_t j = 0; j < k; j++)
+      for (size_t d = 0; d < PROJECTED_DIMS; d++)
+        c.centroids[j][d] /= std::max(sizes[j], size_t(1));
+  }
+  return c;
+}
+
+// Bayesian information criterion of a clustering, as in X-means
+static double bic(const clustering_t& c, size_t npoints)
+{
+  double r = npoints, k = c.centroids.size(), d = PROJECTED_DIMS;
+  double variance = npoints > c.centroids.size() ? c.distortion / (r - k) : 0;
+  variance = std::max(variance, 1e-12);
+
+  std::vector<size_t> sizes(c.centroids.size());
+  for (auto j : c.cluster)
+    sizes[j]++;
+
+  const double pi = std::acos(-1.0);
+  double likelihood = 0;
+  for (auto size : sizes) {
+    if (size == 0)
+      continue;
+    double n = size;
+    likelihood += -n / 2 * std::log(2 * pi) - n * d / 2 * std::log(variance)
+                  - (n - k) / 2 + n * std::log(n) - n * std::log(r);
+  }
+  double params = (k - 1) + k * d + 1;
+  return likelihood - params / 2.0 * std::log(r);
+}
+
+std::vector<simpoint_t> pick_simpoints(const std::vector<bbv_t>& intervals, size_t max_k)
+{
+  std::vector<simpoint_t> res;
+  if (intervals.empty() || max_k == 0)
+    return res;
+
+  std::vector<point_t> points;
+  for (auto& bbv : intervals) {
+    point_t p(PROJECTED_DIMS);
+    uint64_t total = 0;
+    for (auto& block : bbv)
+      total += block.second;
+    for (auto& block : bbv)
+      for (size_t d = 0; total && d < PROJECTED_DIMS; d++)
+        p[d] += double(block.second) / total * projection(block.first, d);
+    points.push_back(p);
+  }
+
+  // SimPoint's rule: the fewest clusters scoring at least 90% of the way
+  // from the worst to the best BIC
+  std::vector<clustering_t> candidates;
+  std::vector<double> scores;
+  for (size_t k = 1; k <= std::min(max_k, points.size()); k++) {
+    clustering_t best;
+    for (int seed = 0; seed < KMEANS_SEEDS; seed++) {
+      clustering_t c = kmeans(points, k, seed);
+      if (seed == 0 || c.distortion < best.distortion)
+        best = c;
+    }
+    candidates.push_back(best);
+    scores.push_back(bic(best, points.size()));
+  }
+  double lo = *std::min_element(scores.begin(), scores.end());
+  double hi = *std::max_element(scores.begin(), scores.end());
+  size_t chosen = 0;
+  while (scores[chosen] < lo + 0.9 * (hi - lo))
+    chosen++;
+
+  // each cluster is represented by the interval nearest its centroid
+  const clustering_t& c = candidates[chosen];
+  for (size_t j = 0; j < c.centroids.size(); j++) {
+    size_t size = 0, nearest = 0;
+    double nearest_d = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < points.size(); i++) {
+      if (c.cluster[i] != j)
+        continue;
+      size++;
+      double d = distance2(points[i], c.centroids[j]);
+      if (d < nearest_d)
+        nearest = i, nearest_d = d;
+    }
+    if (size)
+      res.push_back({nearest, double(size) / points.size()});
+  }
+  std::sort(res.begin(), res.end(),
+            [](const simpoint_t& a, const simpoint_t& b) { return a.interval < b.interval; });
+  return res;
+}
+
+simpoint_sampler_t::simpoint_sampler_t(const std::string& path, reg_t interval, reg_t warmup)
+  : interval(interval), warmup(warmup), next(0), tracing(true), measuring(false)
+{
+  std::ifstream simpoints(path + ".simpoints"), weights(path + ".weights");
+  if (!simpoints.good() || !weights.good())
+    throw std::runtime_error("could not read simulation points for " + path);
+
+  std::map<size_t, reg_t> starts;
+  size_t point, cluster;
+  while (simpoints >> point >> cluster)
+    starts[cluster] = point * interval;
+  double weight;
+  while (weights >> weight >> cluster) {
+    auto it = starts.find(cluster);
+    if (it != starts.end())
+      samples.push_back({it->second, weight, 0, {}, {}});
+  }
+  if (samples.empty())
+    throw std::runtime_error("no simulation points for " + path);
+
+  std::sort(samples.begin(), samples.end(),
+            [](const sample_t& a, const sample_t& b) { return a.start < b.start; });
+}
+
+void simpoint_sampler_t::add_tracer(cache_memtracer_t* tracer)
+{
+  tracers.push_back(tracer);
+  caches.push_back(tracer->get_cache());
+}
+
+void simpoint_sampler_t::add_cache(cache_sim_t* cache)
+{
+  caches.push_back(cache);
+}
+
+void simpoint_sampler_t::set_tracing(bool value, const std::vector<processor_t*>& procs)
+{
+  if (tracing == value)
+    return;
+  tracing = value;
+  for (auto t : tracers)
+    t->set_enabled(value);
+  for (auto p : procs)
+    p->get_mmu()->flush_tlb();
+}
+
+void simpoint_sampler_t::snapshot(std::vector<uint64_t>& accesses, std::vector<uint64_t>& misses,
+                                  reg_t& instructions, const std::vector<processor_t*>& procs)
+{
+  accesses.clear();
+  misses.clear();
+  for (auto c : caches) {
+    accesses.push_back(c->get_accesses());
+    misses.push_back(c->get_misses());
+  }
+  instructions = 0;
+  for (auto p : procs)
+    instructions += p->get_state()->minstret;
+}
+
+bool simpoint_sampler_t::end_of_round(reg_t steps, const std::vector<processor_t*>& procs)
+{
+  while (next < samples.size()) {
+    sample_t& s = samples[next];
+
+    if (!measuring) {
+      if (steps >= s.start + interval) {
+        // skipped over, e.g. by --idle-skip; its weight is dropped
+        next++;
+        continue;
+      }
+      reg_t warmup_start = s.start > warmup ? s.start - warmup : 0;
+      set_tracing(steps >= warmup_start, procs);
+      if (steps < s.start)
+        return false;
+      snapshot(s.accesses, s.misses, s.instructions, procs);
+      measuring = true;
+    }
+
+    if (steps < s.start + interval)
+      return false;
+
+    std::vector<uint64_t> accesses, misses;
+    reg_t instructions;
+    snapshot(accesses, misses, instructions, procs);
+    for (size_t i = 0; i < caches.size(); i++) {
+      s.accesses[i] = accesses[i] - s.accesses[i];
+      s.misses[i] = misses[i] - s.misses[i];
+    }
+    s.instructions = instructions - s.instructions;
+    measuring = false;
+    next++;
+  }
+
+  set_tracing(false, procs);
+  return true;
+}
+
+void simpoint_sampler_t::print_stats()
+{
+  double total_weight = 0, measured_weight = 0, instructions = 0;
+  std::vector<double> accesses(caches.size()), misses(caches.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    const sample_t& s = samples[i];
+    total_weight += s.weight;
+    if (i >= next || s.instructions == 0)
+      continue;
+    measured_weight += s.weight;
+    instructions += s.weight * s.instructions;
+    for (size_t j = 0; j < caches.size(); j++) {
+      accesses[j] += s.weight * s.accesses[j];
+      misses[j] += s.weight * s.misses[j];
+    }
+  }
+
+  std::cout << std::setprecision(3) << std::fixed;
+  std::cout << "SimPoint Weight Measured:  " << 100 * measured_weight / total_weight << '%' << std::endl;
+  if (measured_weight == 0)
+    return;
+  for (size_t j = 0; j < caches.size(); j++) {
+    const std::string& name = caches[j]->get_name();
+    std::cout << name << " ";
+    std::cout << "Estimated Miss Rate:   " << (accesses[j] ? 100 * misses[j] / accesses[j] : 0) << '%' << std::endl;
+    std::cout << name << " ";
+    std::cout << "Estimated MPKI:        " << 1000 * misses[j] / instructions << std::endl;
+    std::cout << name << " ";
+    std::cout << "Estimated Accesses/KI: " << 1000 * accesses[j] / instructions << std::endl;
+  }
+}
@@ -0,0 +1,130 @@
+// See LICENSE for license details.
+#ifndef _RISCV_SIMPOINT_H
+#define _RISCV_SIMPOINT_H
+
+#include "decode.h"
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class cache_sim_t;
+class cache_memtracer_t;
+class processor_t;
+
+// Counts the instructions a hart retires in each basic block, identified
+// by the PC it was entered at.  The fetch loop reports each block it
+// enters, along with the hart's running instruction count.
+class bbv_profiler_t
+{
+ public:
+  bbv_profiler_t() : block_pc(0), block_start(0), in_block(false) {}
+
+  void enter_block(reg_t pc, reg_t retired)
+  {
+    if (in_block && retired > block_start)
+      counts[block_pc] += retired - block_start;
+    block_pc = pc;
+    block_start = retired;
+    in_block = true;
+  }
+
+  // hand over the counts gathered since the last call
+  void take_counts(std::unordered_map<reg_t, uint64_t>& out) { out.swap(counts); counts.clear(); }
+
+ private:
+  std::unordered_map<reg_t, uint64_t> counts;
+  reg_t block_pc;
+  reg_t block_start;
+  bool in_block;
+};
+
+// A basic-block vector: the instructions retired in each block during one
+// interval, by block number.
+typedef std::vector<std::pair<size_t, uint64_t>> bbv_t;
+
+// Writes a basic-block vector for every interval of the run in SimPoint's
+// .bb format, and at the end clusters them to pick simulation points,
+// which are written as <path>.simpoints and <path>.weights.  Installs a
+// profiler in each hart.
+class bbv_recorder_t
+{
+ public:
+  bbv_recorder_t(const std::string& path, size_t max_k, const std::vector<processor_t*>& procs);
+  ~bbv_recorder_t();
+
+  // merge the harts' counts into the vector of the interval just ended
+  void end_interval();
+  // close the last interval and write the simulation points
+  void finish();
+
+ private:
+  bbv_t collect();
+  void record(const bbv_t& bbv);
+
+  std::string path;
+  FILE* file;
+  size_t max_k;
+  std::vector<std::unique_ptr<bbv_profiler_t>> profilers;
+  std::unordered_map<reg_t, size_t> block_ids;
+  std::vector<bbv_t> intervals;
+};
+
+// Simulation points picked by clustering: for each cluster, the interval
+// that represents it and the fraction of all intervals it stands for.
+struct simpoint_t
+{
+  size_t interval;
+  double weight;
+};
+
+// Cluster intervals with k-means after projecting their normalized vectors
+// to a few dimensions, choosing the number of clusters, up to max_k, by the
+// Bayesian information criterion as SimPoint does.
+std::vector<simpoint_t> pick_simpoints(const std::vector<bbv_t>& intervals, size_t max_k);
+
+// Runs the cache models only around the simulation points: each point's
+// interval is preceded by a warmup window in which the models see accesses
+// but aren't measured.  Estimates for the whole program weight each
+// point's statistics by its cluster's share of the run.
+class simpoint_sampler_t
+{
+ public:
+  simpoint_sampler_t(const std::string& path, reg_t interval, reg_t warmup);
+
+  void add_tracer(cache_memtracer_t* tracer);
+  // a cache reached only through another's miss handler
+  void add_cache(cache_sim_t* cache);
+
+  // Called between rounds of the scheduler; steps is the number of
+  // instructions each hart has been stepped.  Returns true once the last
+  // point has been measured.
+  bool end_of_round(reg_t steps, const std::vector<processor_t*>& procs);
+  void print_stats();
+
+ private:
+  struct sample_t {
+    reg_t start;
+    double weight;
+    reg_t instructions;
+    std::vector<uint64_t> accesses;
+    std::vector<uint64_t> misses;
+  };
+
+  void set_tracing(bool value, const std::vector<processor_t*>& procs);
+  void snapshot(std::vector<uint64_t>& accesses, std::vector<uint64_t>& misses, reg_t& instructions,
+                const std::vector<processor_t*>& procs);
+
+  reg_t interval;
+  reg_t warmup;
+  std::vector<cache_memtracer_t*> tracers;
+  std::vector<cache_sim_t*> caches;
+  std::vector<sample_t> samples; // sorted by start
+  size_t next;                   // sample being warmed up or measured
+  bool tracing;
+  bool measuring;
+};
+
+#endif
@@ -0,0 +1,172 @@
+// See LICENSE for license details.
+
+#include "threaded.h"
+#include "processor.h"
+#include "mmu.h"
+
+#define THREADED_INSNS(_) \
+  _(lui) _(auipc) \
+  _(add) _(sub) _(and) _(or) _(xor) _(sll) _(srl) _(sra) _(slt) _(sltu) \
+  _(addw) _(subw) \
+  _(addi) _(andi) _(ori) _(xori) _(slti) _(sltiu) _(slli) _(srli) _(srai) \
+  _(addiw) _(slliw) _(srliw) _(sraiw) \
+  _(lb) _(lbu) _(lh) _(lhu) _(lw) _(lwu) _(ld) \
+  _(sb) _(sh) _(sw) _(sd) \
+  _(beq) _(bne) _(blt) _(bge) _(bltu) _(bgeu) \
+  _(jal) _(jalr) \
+  _(c_addi) _(c_jal) _(c_li) _(c_lui) _(c_addi4spn) _(c_mv) _(c_add) \
+  _(c_sub) _(c_and) _(c_or) _(c_xor) _(c_addw) _(c_subw) \
+  _(c_andi) _(c_slli) _(c_srli) _(c_srai) \
+  _(c_lw) _(c_sw) _(c_lwsp) _(c_swsp) _(c_flw) _(c_fsw) _(c_flwsp) _(c_fswsp) \
+  _(c_beqz) _(c_bnez) _(c_j) _(c_jr) _(c_jalr)
+
+#define DECLARE_THREADED_INSN(name) \
+  extern reg_t rv64_##name(processor_t*, insn_t, reg_t);
+THREADED_INSNS(DECLARE_THREADED_INSN)
+#undef DECLARE_THREADED_INSN
+
+static insn_uop_t make_uop(uop_t op, int len, reg_t rd, reg_t rs1, reg_t rs2, reg_t imm)
+{
+  insn_uop_t uop = {(uint8_t)op, (uint8_t)len, (uint8_t)rd, (uint8_t)rs1, (uint8_t)rs2, imm};
+  return uop;
+}
+
+// Only RV64 instructions are lowered; the rv64_* handlers are what
+// decode_insn hands out whenever xlen is 64.  Compressed forms are lowered
+// only while misa.C is set, since a misa write flushes the icache.
+// Encodings whose handler would raise an illegal-instruction trap are left
+// to that handler.
+insn_uop_t decode_uop(processor_t* p, const insn_fetch_t& fetch, reg_t pc)
+{
+  insn_t insn = fetch.insn;
+  insn_func_t f = fetch.func;
+  int len = insn_length(insn.bits());
+
+  #define R_UOP(op) make_uop(UOP_##op, len, insn.rd(), insn.rs1(), insn.rs2(), 0)
+  #define I_UOP(op, imm) make_uop(UOP_##op, len, insn.rd(), insn.rs1(), 0, imm)
+  #define S_UOP(op) make_uop(UOP_##op, len, 0, insn.rs1(), insn.rs2(), insn.s_imm())
+  #define B_UOP(op) make_uop(UOP_##op, len, 0, insn.rs1(), insn.rs2(), pc + insn.sb_imm())
+
+  if (f == rv64_lui) return I_UOP(LI, insn.u_imm());
+  if (f == rv64_auipc) return I_UOP(LI, pc + insn.u_imm());
+  if (f == rv64_add) return R_UOP(ADD);
+  if (f == rv64_sub) return R_UOP(SUB);
+  if (f == rv64_and) return R_UOP(AND);
+  if (f == rv64_or) return R_UOP(OR);
+  if (f == rv64_xor) return R_UOP(XOR);
+  if (f == rv64_sll) return R_UOP(SLL);
+  if (f == rv64_srl) return R_UOP(SRL);
+  if (f == rv64_sra) return R_UOP(SRA);
+  if (f == rv64_slt) return R_UOP(SLT);
+  if (f == rv64_sltu) return R_UOP(SLTU);
+  if (f == rv64_addw) return R_UOP(ADDW);
+  if (f == rv64_subw) return R_UOP(SUBW);
+  if (f == rv64_addi) return I_UOP(ADDI, insn.i_imm());
+  if (f == rv64_andi) return I_UOP(ANDI, insn.i_imm());
+  if (f == rv64_ori) return I_UOP(ORI, insn.i_imm());
+  if (f == rv64_xori) return I_UOP(XORI, insn.i_imm());
+  if (f == rv64_slti) return I_UOP(SLTI, insn.i_imm());
+  if (f == rv64_sltiu) return I_UOP(SLTIU, insn.i_imm());
+  if (f == rv64_slli) return I_UOP(SLLI, insn.i_imm() & 0x3F);
+  if (f == rv64_srli) return I_UOP(SRLI, insn.i_imm() & 0x3F);
+  if (f == rv64_srai) return I_UOP(SRAI, insn.i_imm() & 0x3F);
+  if (f == rv64_addiw) return I_UOP(ADDIW, insn.i_imm());
+  if (f == rv64_slliw) return I_UOP(SLLIW, insn.i_imm() & 0x3F);
+  if (f == rv64_srliw) return I_UOP(SRLIW, insn.i_imm() & 0x3F);
+  if (f == rv64_sraiw) return I_UOP(SRAIW, insn.i_imm() & 0x3F);
+  if (f == rv64_lb) return I_UOP(LB, insn.i_imm());
+  if (f == rv64_lbu) return I_UOP(LBU, insn.i_imm());
+  if (f == rv64_lh) return I_UOP(LH, insn.i_imm());
+  if (f == rv64_lhu) return I_UOP(LHU, insn.i_imm());
+  if (f == rv64_lw) return I_UOP(LW, insn.i_imm());
+  if (f == rv64_lwu) return I_UOP(LWU, insn.i_imm());
+  if (f == rv64_ld) return I_UOP(LD, insn.i_imm());
+  if (f == rv64_sb) return S_UOP(SB);
+  if (f == rv64_sh) return S_UOP(SH);
+  if (f == rv64_sw) return S_UOP(SW);
+  if (f == rv64_sd) return S_UOP(SD);
+  if (f == rv64_beq) return B_UOP(BEQ);
+  if (f == rv64_bne) return B_UOP(BNE);
+  if (f == rv64_blt) return B_UOP(BLT);
+  if (f == rv64_bge) return B_UOP(BGE);
+  if (f == rv64_bltu) return B_UOP(BLTU);
+  if (f == rv64_bgeu) return B_UOP(BGEU);
+  if (f == rv64_jal) return I_UOP(JAL, pc + insn.uj_imm());
+  if (f == rv64_jalr) return I_UOP(JALR, insn.i_imm());
+
+  #undef R_UOP
+  #undef I_UOP
+  #undef S_UOP
+  #undef B_UOP
+
+  if (!p->supports_extension('C'))
+    return make_uop(UOP_FUNC, len, 0, 0, 0, 0);
+
+  reg_t rd = insn.rvc_rd(), rs2 = insn.rvc_rs2();
+  reg_t rs1s = insn.rvc_rs1s(), rs2s = insn.rvc_rs2s();
+
+  if (f == rv64_c_addi)
+    return make_uop(UOP_ADDI, len, rd, rd, 0, insn.rvc_imm());
+  if (f == rv64_c_jal && rd != 0) // c.addiw
+    return make_uop(UOP_ADDIW, len, rd, rd, 0, insn.rvc_imm());
+  if (f == rv64_c_li)
+    return make_uop(UOP_LI, len, rd, 0, 0, insn.rvc_imm());
+  if (f == rv64_c_lui && rd == X_SP && insn.rvc_addi16sp_imm() != 0)
+    return make_uop(UOP_ADDI, len, X_SP, X_SP, 0, insn.rvc_addi16sp_imm());
+  if (f == rv64_c_lui && rd != X_SP && insn.rvc_imm() != 0)
+    return make_uop(UOP_LI, len, rd, 0, 0, insn.rvc_imm() << 12);
+  if (f == rv64_c_addi4spn && insn.rvc_addi4spn_imm() != 0)
+    return make_uop(UOP_ADDI, len, rs2s, X_SP, 0, insn.rvc_addi4spn_imm());
+  if (f == rv64_c_mv && rs2 != 0)
+    return make_uop(UOP_ADD, len, rd, 0, rs2, 0);
+  if (f == rv64_c_add && rs2 != 0)
+    return make_uop(UOP_ADD, len, rd, rd, rs2, 0);
+  if (f == rv64_c_sub)
+    return make_uop(UOP_SUB, len, rs1s, rs1s, rs2s, 0);
+  if (f == rv64_c_and)
+    return make_uop(UOP_AND, len, rs1s, rs1s, rs2s, 0);
+  if (f == rv64_c_or)
+    return make_uop(UOP_OR, len, rs1s, rs1s, rs2s, 0);
+  if (f == rv64_c_xor)
+    return make_uop(UOP_XOR, len, rs1s, rs1s, rs2s, 0);
+  if (f == rv64_c_addw)
+    return make_uop(UOP_ADDW, len, rs1s, rs1s, rs2s, 0);
+  if (f == rv64_c_subw)
+    return make_uop(UOP_SUBW, len, rs1s, rs1s, rs2s, 0);
+  if (f == rv64_c_andi)
+    return make_uop(UOP_ANDI, len, rs1s, rs1s, 0, insn.rvc_imm());
+  if (f == rv64_c_slli)
+    return make_uop(UOP_SLLI, len, rd, rd, 0, insn.rvc_zimm());
+  if (f == rv64_c_srli)
+    return make_uop(UOP_SRLI, len, rs1s, rs1s, 0, insn.rvc_zimm());
+  if (f == rv64_c_srai)
+    return make_uop(UOP_SRAI, len, rs1s, rs1s, 0, insn.rvc_zimm());
+  if (f == rv64_c_lw)
+    return make_uop(UOP_LW, len, rs2s, rs1s, 0, insn.rvc_lw_imm());
+  if (f == rv64_c_sw)
+    return make_uop(UOP_SW, len, 0, rs1s, rs2s, insn.rvc_lw_imm());
+  if (f == rv64_c_lwsp && rd != 0)
+    return make_uop(UOP_LW, len, rd, X_SP, 0, insn.rvc_lwsp_imm());
+  if (f == rv64_c_swsp)
+    return make_uop(UOP_SW, len, 0, X_SP, rs2, insn.rvc_swsp_imm());
+  if (f == rv64_c_flw) // c.ld
+    return make_uop(UOP_LD, len, rs2s, rs1s, 0, insn.rvc_ld_imm());
+  if (f == rv64_c_fsw) // c.sd
+    return make_uop(UOP_SD, len, 0, rs1s, rs2s, insn.rvc_ld_imm());
+  if (f == rv64_c_flwsp && rd != 0) // c.ldsp
+    return make_uop(UOP_LD, len, rd, X_SP, 0, insn.rvc_ldsp_imm());
+  if (f == rv64_c_fswsp) // c.sdsp
+    return make_uop(UOP_SD, len, 0, X_SP, rs2, insn.rvc_sdsp_imm());
+  if (f == rv64_c_beqz)
+    return make_uop(UOP_BEQ, len, 0, rs1s, 0, pc + insn.rvc_b_imm());
+  if (f == rv64_c_bnez)
+    return make_uop(UOP_BNE, len, 0, rs1s, 0, pc + insn.rvc_b_imm());
+  if (f == rv64_c_j)
+    return make_uop(UOP_JAL, len, 0, 0, 0, pc + insn.rvc_j_imm());
+  if (f == rv64_c_jr && rd != 0)
+    return make_uop(UOP_JALR, len, 0, rd, 0, 0);
+  if (f == rv64_c_jalr && rd != 0)
+    return make_uop(UOP_JALR, len, X_RA, rd, 0, 0);
+
+  return make_uop(UOP_FUNC, len, 0, 0, 0, 0);
+}
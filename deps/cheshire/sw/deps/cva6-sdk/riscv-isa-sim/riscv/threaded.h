@@ -0,0 +1,45 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_THREADED_H
+#define _RISCV_THREADED_H
+
+#include "decode.h"
+
+class processor_t;
+struct insn_fetch_t;
+
+// Operations the threaded engine executes inline.  Anything else is run
+// through its insn_func_t as UOP_FUNC.
+#define UOP_LIST(_) \
+  _(FUNC) \
+  _(LI) \
+  _(ADD) _(SUB) _(AND) _(OR) _(XOR) _(SLL) _(SRL) _(SRA) _(SLT) _(SLTU) \
+  _(ADDW) _(SUBW) \
+  _(ADDI) _(ANDI) _(ORI) _(XORI) _(SLTI) _(SLTIU) _(SLLI) _(SRLI) _(SRAI) \
+  _(ADDIW) _(SLLIW) _(SRLIW) _(SRAIW) \
+  _(LB) _(LBU) _(LH) _(LHU) _(LW) _(LWU) _(LD) \
+  _(SB) _(SH) _(SW) _(SD) \
+  _(BEQ) _(BNE) _(BLT) _(BGE) _(BLTU) _(BGEU) \
+  _(JAL) _(JALR)
+
+enum uop_t {
+#define DEFINE_UOP(name) UOP_##name,
+  UOP_LIST(DEFINE_UOP)
+#undef DEFINE_UOP
+};
+
+// An instruction with its operand fields extracted at decode time.  imm
+// holds the sign-extended immediate, the shift amount, or for PC-relative
+// operations (auipc, branches, jal) the absolute result.
+struct insn_uop_t {
+  uint8_t op;
+  uint8_t len;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  reg_t imm;
+};
+
+insn_uop_t decode_uop(processor_t* p, const insn_fetch_t& fetch, reg_t pc);
+
+#endif
@@ -0,0 +1,504 @@
+// See LICENSE for license details.
+
+#include "virtio.h"
+#include "checkpoint.h"
+#include "sim.h"
+#include <fesvr/byteorder.h>
+#include <cstring>
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// registers of the MMIO transport
+#define VIRTIO_MMIO_MAGIC_VALUE          0x000
+#define VIRTIO_MMIO_VERSION              0x004
+#define VIRTIO_MMIO_DEVICE_ID            0x008
+#define VIRTIO_MMIO_VENDOR_ID            0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES      0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL  0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES      0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL  0x024
+#define VIRTIO_MMIO_QUEUE_SEL            0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX        0x034
+#define VIRTIO_MMIO_QUEUE_NUM            0x038
+#define VIRTIO_MMIO_QUEUE_READY          0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY         0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS     0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK        0x064
+#define VIRTIO_MMIO_STATUS               0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW       0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH      0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW     0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH    0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW     0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH    0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION    0x0fc
+#define VIRTIO_MMIO_CONFIG               0x100
+
+#define VIRTIO_MAGIC            0x74726976 // "virt"
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_F_VERSION_1      (uint64_t(1) << 32)
+#define VIRTIO_INT_USED_RING    1
+
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2
+
+#define VIRTIO_QUEUE_SIZE       256
+
+virtio_device_t::virtio_device_t(uint32_t device_id, size_t num_queues)
+  : sim(NULL), irq(0), device_id(device_id), queues(num_queues), kicked(num_queues),
+    kick_event()
+{
+  reset();
+}
+
+void virtio_device_t::attach(sim_t* sim, uint32_t irq)
+{
+  this->sim = sim;
+  this->irq = irq;
+}
+
+void virtio_device_t::reset()
+{
+  driver_features = 0;
+  device_features_sel = 0;
+  driver_features_sel = 0;
+  queue_sel = 0;
+  interrupt_status = 0;
+  status = 0;
+  for (auto& q : queues)
+    q = queue_t();
+  for (size_t i = 0; i < kicked.size(); i++)
+    kicked[i] = false;
+  device_reset();
+}
+
+bool virtio_device_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if (addr >= VIRTIO_MMIO_CONFIG) {
+    memset(bytes, 0, len);
+    config_load(addr - VIRTIO_MMIO_CONFIG, len, bytes);
+    return true;
+  }
+  if (len != 4 || addr % 4 != 0)
+    return false;
+
+  uint32_t val = 0;
+  switch (addr) {
+    case VIRTIO_MMIO_MAGIC_VALUE: val = VIRTIO_MAGIC; break;
+    case VIRTIO_MMIO_VERSION: val = 2; break;
+    case VIRTIO_MMIO_DEVICE_ID: val = device_id; break;
+    case VIRTIO_MMIO_VENDOR_ID: val = 0; break;
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+      if (device_features_sel < 2)
+        val = (device_features() | VIRTIO_F_VERSION_1) >> (32 * device_features_sel);
+      break;
+    case VIRTIO_MMIO_QUEUE_NUM_MAX: val = queue_sel < queues.size() ? VIRTIO_QUEUE_SIZE : 0; break;
+    case VIRTIO_MMIO_QUEUE_READY: val = queue_sel < queues.size() && queues[queue_sel].ready; break;
+    case VIRTIO_MMIO_INTERRUPT_STATUS: val = interrupt_status; break;
+    case VIRTIO_MMIO_STATUS: val = status; break;
+    case VIRTIO_MMIO_CONFIG_GENERATION: val = 0; break;
+  }
+  val = to_le(val);
+  memcpy(bytes, &val, 4);
+  return true;
+}
+
+bool virtio_device_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  if (addr >= VIRTIO_MMIO_CONFIG)
+    return true; // no device has writable configuration
+  if (len != 4 || addr % 4 != 0)
+    return false;
+
+  uint32_t val;
+  memcpy(&val, bytes, 4);
+  val = from_le(val);
+
+  queue_t* q = queue_sel < queues.size() ? &queues[queue_sel] : NULL;
+  switch (addr) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL: device_features_sel = val; break;
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+      if (driver_features_sel < 2) {
+        driver_features &= ~(uint64_t(0xffffffff) << (32 * driver_features_sel));
+        driver_features |= uint64_t(val) << (32 * driver_features_sel);
+      }
+      break;
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL: driver_features_sel = val; break;
+    case VIRTIO_MMIO_QUEUE_SEL: queue_sel = val; break;
+    case VIRTIO_MMIO_QUEUE_NUM:
+      if (q && val <= VIRTIO_QUEUE_SIZE)
+        q->num = val;
+      break;
+    case VIRTIO_MMIO_QUEUE_READY: if (q) q->ready = val & 1; break;
+    case VIRTIO_MMIO_QUEUE_DESC_LOW: if (q) q->desc = (q->desc & ~reg_t(0xffffffff)) | val; break;
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH: if (q) q->desc = (q->desc & 0xffffffff) | (reg_t(val) << 32); break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW: if (q) q->driver = (q->driver & ~reg_t(0xffffffff)) | val; break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH: if (q) q->driver = (q->driver & 0xffffffff) | (reg_t(val) << 32); break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW: if (q) q->device = (q->device & ~reg_t(0xffffffff)) | val; break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH: if (q) q->device = (q->device & 0xffffffff) | (reg_t(val) << 32); break;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+      // The queue is processed once the harts stop at the end of the
+      // round, which also keeps device work off the hart threads.
+      if (val < queues.size()) {
+        kicked[val] = true;
+        if (kick_event == event_queue_t::event_id_t())
+          kick_event = events().schedule(now(), [this](reg_t) { process_kicks(); });
+      }
+      break;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+      interrupt_status &= ~val;
+      update_interrupt();
+      break;
+    case VIRTIO_MMIO_STATUS:
+      if (val == 0) {
+        reset();
+        update_interrupt();
+      } else {
+        status = val;
+      }
+      break;
+  }
+  return true;
+}
+
+void virtio_device_t::process_kicks()
+{
+  kick_event = event_queue_t::event_id_t();
+  for (size_t i = 0; i < queues.size(); i++) {
+    if (kicked[i]) {
+      kicked[i] = false;
+      if (queue_ready(i))
+        queue_notify(i);
+    }
+  }
+}
+
+bool virtio_device_t::queue_ready(size_t queue) const
+{
+  const queue_t& q = queues[queue];
+  return (status & VIRTIO_STATUS_DRIVER_OK) && q.ready && q.num != 0;
+}
+
+char* virtio_device_t::guest_ptr(reg_t addr, size_t len)
+{
+  if (len == 0 || addr + len - 1 < addr)
+    return NULL;
+  char* first = sim->addr_to_mem(addr);
+  char* last = sim->addr_to_mem(addr + len - 1);
+  return first && last == first + (len - 1) ? first : NULL;
+}
+
+event_queue_t& virtio_device_t::events()
+{
+  return sim->events;
+}
+
+reg_t virtio_device_t::now()
+{
+  return sim->steps_per_hart;
+}
+
+template<typename T> static bool guest_load(char* p, T& value)
+{
+  if (!p)
+    return false;
+  memcpy(&value, p, sizeof(T));
+  value = from_le(value);
+  return true;
+}
+
+bool virtio_device_t::pop_chain(size_t queue, uint16_t& head, std::vector<desc_t>& chain)
+{
+  queue_t& q = queues[queue];
+  chain.clear();
+
+  uint16_t avail_idx;
+  if (!guest_load(guest_ptr(q.driver + 2, 2), avail_idx) || avail_idx == q.last_avail)
+    return false;
+
+  if (!guest_load(guest_ptr(q.driver + 4 + 2 * (q.last_avail % q.num), 2), head))
+    return false;
+  q.last_avail++;
+
+  // a chain can't be longer than the ring, which also stops loops
+  uint16_t i = head;
+  for (size_t n = 0; n < q.num; n++) {
+    char* p = guest_ptr(q.desc + 16 * (i % q.num), 16);
+    if (!p)
+      return false;
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags, next;
+    memcpy(&addr, p, 8);
+    memcpy(&len, p + 8, 4);
+    memcpy(&flags, p + 12, 2);
+    memcpy(&next, p + 14, 2);
+    chain.push_back({from_le(addr), from_le(len), (from_le(flags) & VIRTQ_DESC_F_WRITE) != 0});
+    if (!(from_le(flags) & VIRTQ_DESC_F_NEXT))
+      break;
+    i = from_le(next);
+  }
+  return true;
+}
+
+void virtio_device_t::push_chain(size_t queue, uint16_t head, uint32_t written)
+{
+  queue_t& q = queues[queue];
+  uint16_t used_idx;
+  if (!guest_load(guest_ptr(q.device + 2, 2), used_idx))
+    return;
+
+  char* elem = guest_ptr(q.device + 4 + 8 * (used_idx % q.num), 8);
+  char* idx = guest_ptr(q.device + 2, 2);
+  if (!elem)
+    return;
+  uint32_t id = to_le(uint32_t(head));
+  written = to_le(written);
+  memcpy(elem, &id, 4);
+  memcpy(elem + 4, &written, 4);
+  used_idx = to_le(uint16_t(used_idx + 1));
+  memcpy(idx, &used_idx, 2);
+
+  interrupt_status |= VIRTIO_INT_USED_RING;
+  update_interrupt();
+}
+
+void virtio_device_t::update_interrupt()
+{
+  if (sim->plic)
+    sim->plic->set_interrupt_level(irq, interrupt_status != 0);
+}
+
+void virtio_device_t::save(checkpoint_section_t& cp)
+{
+  cp.put("driver_features", driver_features);
+  cp.put("device_features_sel", device_features_sel);
+  cp.put("driver_features_sel", driver_features_sel);
+  cp.put("queue_sel", queue_sel);
+  cp.put("interrupt_status", interrupt_status);
+  cp.put("status", status);
+  cp.put_bytes("queues", queues.data(), queues.size() * sizeof(queue_t));
+}
+
+void virtio_device_t::restore(const checkpoint_section_t& cp)
+{
+  cp.get("driver_features", driver_features);
+  cp.get("device_features_sel", device_features_sel);
+  cp.get("driver_features_sel", driver_features_sel);
+  cp.get("queue_sel", queue_sel);
+  cp.get("interrupt_status", interrupt_status);
+  cp.get("status", status);
+  cp.get_bytes("queues", queues.data(), queues.size() * sizeof(queue_t));
+}
+
+// block device
+
+#define VIRTIO_ID_BLOCK         2
+#define VIRTIO_BLK_F_RO         (uint64_t(1) << 5)
+#define VIRTIO_BLK_F_FLUSH      (uint64_t(1) << 9)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_GET_ID     8
+
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define SECTOR_SIZE             512
+
+virtio_blk_t::virtio_blk_t(const std::string& path)
+  : virtio_device_t(VIRTIO_ID_BLOCK, 1), read_only(false)
+{
+  fd = open(path.c_str(), O_RDWR);
+  if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+    fd = open(path.c_str(), O_RDONLY);
+    read_only = true;
+  }
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    throw std::runtime_error("could not open disk image " + path + ": " + strerror(errno));
+  capacity = st.st_size / SECTOR_SIZE;
+}
+
+virtio_blk_t::~virtio_blk_t()
+{
+  close(fd);
+}
+
+uint64_t virtio_blk_t::device_features()
+{
+  return VIRTIO_BLK_F_FLUSH | (read_only ? VIRTIO_BLK_F_RO : 0);
+}
+
+void virtio_blk_t::config_load(reg_t offset, size_t len, uint8_t* bytes)
+{
+  // only the capacity; the features that give the rest meaning aren't offered
+  uint64_t config = to_le(capacity);
+  if (offset < sizeof(config))
+    memcpy(bytes, (uint8_t*)&config + offset, std::min(len, size_t(sizeof(config) - offset)));
+}
+
+void virtio_blk_t::queue_notify(size_t queue)
+{
+  uint16_t head;
+  std::vector<desc_t> chain;
+  while (pop_chain(queue, head, chain)) {
+    uint32_t written = 0;
+    uint8_t status = serve(chain, written);
+    if (chain.size() >= 2 && chain.back().write && chain.back().len >= 1) {
+      if (char* p = guest_ptr(chain.back().addr, 1)) {
+        *p = status;
+        written++;
+      }
+    }
+    push_chain(queue, head, written);
+  }
+}
+
+uint8_t virtio_blk_t::serve(const std::vector<desc_t>& chain, uint32_t& written)
+{
+  if (chain.size() < 2 || chain[0].write || chain[0].len < 16)
+    return VIRTIO_BLK_S_IOERR;
+  char* hdr = guest_ptr(chain[0].addr, 16);
+  if (!hdr)
+    return VIRTIO_BLK_S_IOERR;
+  uint32_t type;
+  uint64_t sector;
+  memcpy(&type, hdr, 4);
+  memcpy(&sector, hdr + 8, 8);
+  type = from_le(type);
+  sector = from_le(sector);
+
+  // the buffers between the header and the status byte
+  size_t first = 1, last = chain.size() - 1;
+
+  switch (type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT: {
+      if (type == VIRTIO_BLK_T_OUT && read_only)
+        return VIRTIO_BLK_S_IOERR;
+      uint64_t offset = sector * SECTOR_SIZE;
+      for (size_t i = first; i < last; i++) {
+        const desc_t& d = chain[i];
+        char* p = guest_ptr(d.addr, d.len);
+        if (!p || d.write != (type == VIRTIO_BLK_T_IN) ||
+            offset + d.len > capacity * SECTOR_SIZE)
+          return VIRTIO_BLK_S_IOERR;
+        // straight between the image and guest RAM
+        ssize_t n = type == VIRTIO_BLK_T_IN ? pread(fd, p, d.len, offset)
+                                            : pwrite(fd, p, d.len, offset);
+        if (n != ssize_t(d.len))
+          return VIRTIO_BLK_S_IOERR;
+        if (type == VIRTIO_BLK_T_IN)
+          written += d.len;
+        offset += d.len;
+      }
+      return VIRTIO_BLK_S_OK;
+    }
+    case VIRTIO_BLK_T_FLUSH:
+      return fsync(fd) == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+    case VIRTIO_BLK_T_GET_ID: {
+      static const char id[20] = "spike-virtio-blk";
+      if (first == last || !chain[first].write)
+        return VIRTIO_BLK_S_IOERR;
+      size_t n = std::min(size_t(chain[first].len), sizeof(id));
+      char* p = guest_ptr(chain[first].addr, n);
+      if (!p)
+        return VIRTIO_BLK_S_IOERR;
+      memcpy(p, id, n);
+      written += n;
+      return VIRTIO_BLK_S_OK;
+    }
+  }
+  return VIRTIO_BLK_S_UNSUPP;
+}
+
+// console
+
+#define VIRTIO_ID_CONSOLE       3
+#define CONSOLE_RX              0
+#define CONSOLE_TX              1
+#define CONSOLE_POLL_INTERVAL   1000000 // instructions between polls of stdin
+
+virtio_console_t::virtio_console_t()
+  : virtio_device_t(VIRTIO_ID_CONSOLE, 2), poll_event()
+{
+}
+
+uint64_t virtio_console_t::device_features()
+{
+  return 0;
+}
+
+void virtio_console_t::config_load(reg_t offset, size_t len, uint8_t* bytes)
+{
+  // cols, rows and max_nr_ports, which the features offered don't use
+}
+
+void virtio_console_t::device_reset()
+{
+  if (sim)
+    events().cancel(poll_event);
+  poll_event = event_queue_t::event_id_t();
+}
+
+void virtio_console_t::start_polling()
+{
+  if (poll_event == event_queue_t::event_id_t())
+    poll_event = events().schedule(now(), [this](reg_t now) { poll(now); });
+}
+
+void virtio_console_t::queue_notify(size_t queue)
+{
+  if (queue == CONSOLE_RX) {
+    // the driver has given buffers for input
+    start_polling();
+    return;
+  }
+
+  uint16_t head;
+  std::vector<desc_t> chain;
+  while (pop_chain(queue, head, chain)) {
+    for (auto& d : chain) {
+      char* p = guest_ptr(d.addr, d.len);
+      if (p && !d.write)
+        fwrite(p, 1, d.len, stdout);
+    }
+    push_chain(queue, head, 0);
+  }
+  fflush(stdout);
+}
+
+void virtio_console_t::restore(const checkpoint_section_t& cp)
+{
+  virtio_device_t::restore(cp);
+  start_polling();
+}
+
+void virtio_console_t::poll(reg_t now)
+{
+  poll_event = event_queue_t::event_id_t();
+  if (!queue_ready(CONSOLE_RX))
+    return;
+
+  struct pollfd pfd = {0, POLLIN, 0};
+  while (::poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLIN | POLLHUP))) {
+    uint16_t head;
+    std::vector<desc_t> chain;
+    if (!pop_chain(CONSOLE_RX, head, chain))
+      break;
+    char* p = chain.empty() || !chain[0].write ? NULL : guest_ptr(chain[0].addr, chain[0].len);
+    ssize_t n = p ? read(0, p, chain[0].len) : 0;
+    push_chain(CONSOLE_RX, head, n > 0 ? n : 0);
+    if (n <= 0)
+      return; // end of input
+  }
+
+  poll_event = events().schedule(now + CONSOLE_POLL_INTERVAL, [this](reg_t now) { poll(now); });
+}
@@ -0,0 +1,128 @@
+// See LICENSE for license details.
+#ifndef _RISCV_VIRTIO_H
+#define _RISCV_VIRTIO_H
+
+#include "abstract_device.h"
+#include "event_queue.h"
+#include <string>
+#include <vector>
+
+class sim_t;
+
+// A device behind the virtio-mmio transport (version 2 of the register
+// layout, as in the virtio 1.1 specification).  Buffers in guest RAM are
+// accessed through host pointers into the simulator's memory, so request
+// data moves with a single copy or none.  Queues are processed when the
+// round of the scheduler in which the driver notified the device ends.
+class virtio_device_t : public abstract_device_t {
+ public:
+  virtio_device_t(uint32_t device_id, size_t num_queues);
+
+  bool load(reg_t addr, size_t len, uint8_t* bytes) override;
+  bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
+  void save(checkpoint_section_t& cp) override;
+  void restore(const checkpoint_section_t& cp) override;
+
+  // the device drives the given interrupt source of the simulator's PLIC
+  void attach(sim_t* sim, uint32_t irq);
+
+ protected:
+  struct desc_t {
+    reg_t addr;
+    uint32_t len;
+    bool write; // device writes the buffer
+  };
+
+  virtual uint64_t device_features() = 0;
+  virtual void config_load(reg_t offset, size_t len, uint8_t* bytes) = 0;
+  // process the queue's available buffers
+  virtual void queue_notify(size_t queue) = 0;
+  virtual void device_reset() {}
+
+  bool queue_ready(size_t queue) const;
+  // Take the next chain of buffers the driver made available on the
+  // queue, returning false if there is none.  head identifies the chain
+  // when it's returned with push_chain.
+  bool pop_chain(size_t queue, uint16_t& head, std::vector<desc_t>& chain);
+  // return a chain to the driver with the bytes written into it, and
+  // interrupt it
+  void push_chain(size_t queue, uint16_t head, uint32_t written);
+
+  // a host pointer to len bytes of guest RAM, or NULL if they aren't in
+  // one RAM region
+  char* guest_ptr(reg_t addr, size_t len);
+
+  // the simulator's event queue and current time
+  event_queue_t& events();
+  reg_t now();
+
+  sim_t* sim;
+  uint32_t irq;
+
+ private:
+  struct queue_t {
+    uint32_t num;
+    uint32_t ready;
+    reg_t desc;
+    reg_t driver;
+    reg_t device;
+    uint16_t last_avail;
+  };
+
+  void reset();
+  void process_kicks();
+  void update_interrupt();
+
+  uint32_t device_id;
+  uint64_t driver_features;
+  uint32_t device_features_sel;
+  uint32_t driver_features_sel;
+  uint32_t queue_sel;
+  uint32_t interrupt_status;
+  uint32_t status;
+  std::vector<queue_t> queues;
+  std::vector<bool> kicked; // notified since the queues were last processed
+  event_queue_t::event_id_t kick_event;
+};
+
+// A disk backed by a host image file.  Requests are served with pread and
+// pwrite straight into and out of guest RAM.
+class virtio_blk_t : public virtio_device_t {
+ public:
+  virtio_blk_t(const std::string& path);
+  ~virtio_blk_t();
+
+ protected:
+  uint64_t device_features() override;
+  void config_load(reg_t offset, size_t len, uint8_t* bytes) override;
+  void queue_notify(size_t queue) override;
+
+ private:
+  uint8_t serve(const std::vector<desc_t>& chain, uint32_t& written);
+
+  int fd;
+  bool read_only;
+  uint64_t capacity; // in 512-byte sectors
+};
+
+// A console on the simulator's standard input and output.  Input is
+// polled from the event queue.
+class virtio_console_t : public virtio_device_t {
+ public:
+  virtio_console_t();
+  void restore(const checkpoint_section_t& cp) override;
+
+ protected:
+  uint64_t device_features() override;
+  void config_load(reg_t offset, size_t len, uint8_t* bytes) override;
+  void queue_notify(size_t queue) override;
+  void device_reset() override;
+
+ private:
+  void start_polling();
+  void poll(reg_t now);
+
+  event_queue_t::event_id_t poll_event;
+};
+
+#endif
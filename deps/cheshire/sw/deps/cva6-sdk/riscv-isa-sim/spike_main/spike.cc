@@ -4,8 +4,14 @@
 #include "mmu.h"
 #include "remote_bitbang.h"
 #include "cachesim.h"
+#include "llc.h"
+#include "hyperram.h"
+#include "coalescer.h"
+#include "axi_perf.h"
 #include "extension.h"
+#include "virtio.h"
 #include <dlfcn.h>
+#include <inttypes.h>
 #include <fesvr/option_parser.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,8 +30,21 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  -m<n>                 Provide <n> MiB of target memory [default 2048]\n");
   fprintf(stderr, "  -m<a:m,b:n,...>       Provide memory regions of size m and n bytes\n");
   fprintf(stderr, "                          at base addresses a and b (with 4 KiB alignment)\n");
+  fprintf(stderr, "  --thp                 Back target memory with transparent huge pages\n");
+  fprintf(stderr, "  --mem-stats           Print resident target memory on exit\n");
+  fprintf(stderr, "  --map-elf             Map the program's segments from its file instead of\n");
+  fprintf(stderr, "                          copying them; the file must not be changed in place\n");
+  fprintf(stderr, "                          while spike runs\n");
+  fprintf(stderr, "  --checkpoint=<n>:<dir> Save a checkpoint to <dir> once every hart has run\n");
+  fprintf(stderr, "                          <n> instructions, then exit\n");
+  fprintf(stderr, "  --restore=<dir>       Restore the checkpoint in <dir>; the program and options\n");
+  fprintf(stderr, "                          must be those it was saved with\n");
   fprintf(stderr, "  -d                    Interactive debug mode\n");
   fprintf(stderr, "  -g                    Track histogram of PCs\n");
+  fprintf(stderr, "  --tlb-stats           Print software TLB statistics on exit\n");
+  fprintf(stderr, "  --idle-skip           Stall harts in wfi and skip ahead in time when all are idle\n");
+  fprintf(stderr, "  --tlb=<S>:<W>         Second-level TLB with S sets (a power of 2) of W ways [default 256:4]\n");
+  fprintf(stderr, "                          0:0 disables it\n");
   fprintf(stderr, "  -l                    Generate a log of execution\n");
   fprintf(stderr, "  -h, --help            Print this help message\n");
   fprintf(stderr, "  -H                    Start halted, allowing a debugger to connect\n");
@@ -34,16 +53,62 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  --varch=<name>        RISC-V Vector uArch string [default %s]\n", DEFAULT_VARCH);
   fprintf(stderr, "  --pc=<address>        Override ELF entry point\n");
   fprintf(stderr, "  --hartids=<a,b,...>   Explicitly specify hartids, default is 0,1,...\n");
-  fprintf(stderr, "  --ic=<S>:<W>:<B>      Instantiate a cache model with S sets,\n");
-  fprintf(stderr, "  --dc=<S>:<W>:<B>        W ways, and B-byte blocks (with S and\n");
-  fprintf(stderr, "  --l2=<S>:<W>:<B>        B both powers of 2).\n");
+  fprintf(stderr, "  --ic=<S>:<W>:<B>[:<P>][:<H>:<M>]\n");
+  fprintf(stderr, "  --dc=<S>:<W>:<B>[:<P>][:<H>:<M>]\n");
+  fprintf(stderr, "  --l2=<S>:<W>:<B>[:<P>][:<H>:<M>]\n");
+  fprintf(stderr, "                        Instantiate a cache model with S sets, W ways, and\n");
+  fprintf(stderr, "                          B-byte blocks (with S and B both powers of 2),\n");
+  fprintf(stderr, "                          replacing lines by policy P: lru, plru, fifo, srrip,\n");
+  fprintf(stderr, "                          brrip or random [default random]; a hit takes H\n");
+  fprintf(stderr, "                          cycles and a miss M plus the refill [default 0:0]\n");
+  fprintf(stderr, "  --llc=<S>:<W>:<B>[:<H>:<M>]\n");
+  fprintf(stderr, "                        Model Cheshire's LLC with S sets, W ways and B-byte\n");
+  fprintf(stderr, "                          blocks, its registers at 0x%x, serving the misses\n", LLC_BASE);
+  fprintf(stderr, "                          of the caches above; a hit takes H cycles [default 4]\n");
+  fprintf(stderr, "                          and a miss M [default 8] plus the refill; unless -m\n");
+  fprintf(stderr, "                          covers it, memory for all W ways backs the scratchpad\n");
+  fprintf(stderr, "                          at 0x%x, and around the caches at 0x%x\n",
+          (unsigned)llc_sim_t::SPM_BASE, (unsigned)llc_sim_t::SPM_UNCACHED_BASE);
+  fprintf(stderr, "  --hyperram=<P>:<C>[:<L>[:<B>]]\n");
+  fprintf(stderr, "                        Time the accesses that miss every cache model, or all\n");
+  fprintf(stderr, "                          of them with no I$ or D$, as HyperBus transactions to\n");
+  fprintf(stderr, "                          C HyperRAMs on each of P PHYs, with an access latency\n");
+  fprintf(stderr, "                          of L cycles [default 6] and bursts of at most B cycles\n");
+  fprintf(stderr, "                          [default 350], counting the stalls in mcycle; the RAMs\n");
+  fprintf(stderr, "                          fill the memory from 0x%x, and accesses elsewhere\n", DRAM_BASE);
+  fprintf(stderr, "                          take no time\n");
+  fprintf(stderr, "  --coalesce=<D>[:<W>[:<R>[:<N>]]]\n");
+  fprintf(stderr, "                        Put a coalescing buffer above the HyperRAM, gathering\n");
+  fprintf(stderr, "                          writes in D entries of W bytes [default 256], reading\n");
+  fprintf(stderr, "                          through a buffer of R bytes [default 512, 0 for none]\n");
+  fprintf(stderr, "                          and writing an entry out N transactions after it was\n");
+  fprintf(stderr, "                          opened [default 16, 0 for only when full or evicted]\n");
+  fprintf(stderr, "  --perf-counters       Count the AXI traffic to memory as Cheshire's perf\n");
+  fprintf(stderr, "                          counters do, with their registers for the DRAM, LLC\n");
+  fprintf(stderr, "                          and core ports at 0x%x, 0x%x and 0x%x\n",
+          PERF_COUNTER_BASE, PERF_COUNTER_BASE + PERF_COUNTER_SIZE, PERF_COUNTER_BASE + 2 * PERF_COUNTER_SIZE);
+  fprintf(stderr, "  --cpi=<n>             Time mcycle and rdcycle, charging each instruction <n>\n");
+  fprintf(stderr, "                          cycles, to a thousandth, on top of the stalls of the\n");
+  fprintf(stderr, "                          memory models, and print each hart's cycles on exit\n");
   fprintf(stderr, "  --device=<P,B,A>      Attach MMIO plugin device from an --extlib library\n");
   fprintf(stderr, "                          P -- Name of the MMIO plugin\n");
   fprintf(stderr, "                          B -- Base memory address of the device\n");
   fprintf(stderr, "                          A -- String arguments to pass to the plugin\n");
   fprintf(stderr, "                          This flag can be used multiple times.\n");
   fprintf(stderr, "                          The extlib flag for the library must come first.\n");
+  fprintf(stderr, "  --virtio-blk=<file>   Attach a virtio block device backed by the image <file>\n");
+  fprintf(stderr, "                          This flag can be used multiple times.\n");
+  fprintf(stderr, "  --virtio-console      Attach a virtio console on standard input and output\n");
   fprintf(stderr, "  --log-cache-miss      Generate a log of cache miss\n");
+  fprintf(stderr, "  --bbv=<n>:<file>      Write basic-block vectors of <n>-instruction intervals to\n");
+  fprintf(stderr, "                          <file>, and simulation points to <file>.simpoints\n");
+  fprintf(stderr, "                          and <file>.weights\n");
+  fprintf(stderr, "  --simpoints=<k>       Pick at most <k> simulation points [default 10]\n");
+  fprintf(stderr, "  --sample=<n>:<file>   Run the cache models only on the simulation points\n");
+  fprintf(stderr, "                          picked by --bbv=<n>:<file>, print weighted\n");
+  fprintf(stderr, "                          estimates, and exit after the last point\n");
+  fprintf(stderr, "  --sample-warmup=<n>   Warm the cache models for <n> instructions before\n");
+  fprintf(stderr, "                          each point [default a tenth of an interval]\n");
   fprintf(stderr, "  --extension=<name>    Specify RoCC Extension\n");
   fprintf(stderr, "                          This flag can be used multiple times.\n");
   fprintf(stderr, "  --extlib=<name>       Shared library to load\n");
@@ -55,6 +120,12 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  --initrd=<path>       Load kernel initrd into memory\n");
   fprintf(stderr, "  --bootargs=<args>     Provide custom bootargs for kernel [default: console=hvc0 earlycon=sbi]\n");
   fprintf(stderr, "  --real-time-clint     Increment clint time at real-time rate\n");
+  fprintf(stderr, "  --parallel=<n>[:det]  Run each hart on its own host thread, synchronizing\n");
+  fprintf(stderr, "                          every <n> instructions (not with cache models); an SC\n");
+  fprintf(stderr, "                          succeeds if memory still holds what its LR read, even\n");
+  fprintf(stderr, "                          if other harts wrote it in between.  With :det, run\n");
+  fprintf(stderr, "                          the harts in turn on one thread instead, with exact\n");
+  fprintf(stderr, "                          LR/SC and any memory models, the same on every run\n");
   fprintf(stderr, "  --dm-progsize=<words> Progsize for the debug module [default 2]\n");
   fprintf(stderr, "  --dm-sba=<bits>       Debug bus master supports up to "
       "<bits> wide accesses [default 0]\n");
@@ -202,16 +273,73 @@ static unsigned long atoul_nonzero_safe(const char* s)
   return res;
 }
 
+static void parse_tlb_size(const char* s, size_t* sets, size_t* ways)
+{
+  const char* colon = strchr(s, ':');
+  if (!colon)
+    help();
+  *sets = atoul_safe(std::string(s, colon).c_str());
+  *ways = atoul_safe(colon + 1);
+  if ((*sets & (*sets - 1)) != 0 || (*sets == 0) != (*ways == 0))
+    help();
+}
+
+static reg_t parse_cpi(const char* s)
+{
+  char* e;
+  double cpi = strtod(s, &e);
+  if (*e || !(cpi >= 0.001 && cpi <= 1000))
+    help();
+  return reg_t(cpi * 1000 + 0.5);
+}
+
+static void parse_parallel(const char* s, size_t* quantum, bool* deterministic)
+{
+  const char* colon = strchr(s, ':');
+  *deterministic = colon != NULL;
+  if (colon && strcmp(colon + 1, "det") != 0)
+    help();
+  *quantum = atoul_nonzero_safe(colon ? std::string(s, colon).c_str() : s);
+}
+
+static void parse_steps_and_path(const char* s, reg_t* steps, std::string* path)
+{
+  const char* colon = strchr(s, ':');
+  if (!colon || !colon[1])
+    help();
+  *steps = atoul_nonzero_safe(std::string(s, colon).c_str());
+  *path = colon + 1;
+}
+
 int main(int argc, char** argv)
 {
   bool debug = false;
   bool halted = false;
   bool histogram = false;
+  bool tlb_stats = false;
+  bool idle_skip = false;
+  reg_t cpi = 0;
+  bool huge_pages = false;
+  bool mem_stats = false;
+  bool map_elf = false;
+  reg_t checkpoint_steps = 0;
+  std::string checkpoint_dir;
+  std::string restore_dir;
+  reg_t bbv_interval = 0;
+  std::string bbv_path;
+  size_t max_simpoints = 10;
+  reg_t sample_interval = 0;
+  std::string sample_path;
+  reg_t sample_warmup = -1;
+  size_t tlb_sets = mmu_t::STLB_DEFAULT_SETS;
+  size_t tlb_ways = mmu_t::STLB_DEFAULT_WAYS;
   bool log = false;
   bool dump_dts = false;
   bool dtb_enabled = true;
   bool real_time_clint = false;
   size_t nprocs = 1;
+  size_t parallel_quantum = 0;
+  bool parallel_deterministic = false;
   const char* kernel = NULL;
   reg_t kernel_offset, kernel_size;
   size_t initrd_size;
@@ -223,6 +351,12 @@ int main(int argc, char** argv)
   std::unique_ptr<icache_sim_t> ic;
   std::unique_ptr<dcache_sim_t> dc;
   std::unique_ptr<cache_sim_t> l2;
+  std::unique_ptr<llc_sim_t> llc;
+  std::unique_ptr<hyperram_t> hyperram;
+  std::unique_ptr<coalescer_t> coalescer;
+  std::unique_ptr<axi_port_t> core_port;
+  bool perf_counters = false;
+  std::unique_ptr<uncached_memtracer_t> uncached;
   bool log_cache = false;
   bool log_commits = false;
   const char *log_path = nullptr;
@@ -302,14 +436,32 @@ int main(int argc, char** argv)
     plugin_devices.emplace_back(base, new mmio_plugin_device_t(name, args));
   };
 
+  // virtio devices take consecutive slots
+  size_t virtio_slots = 0;
+  auto const add_virtio = [&](virtio_device_t* dev) {
+    plugin_devices.emplace_back(VIRTIO_BASE + VIRTIO_SIZE * virtio_slots++, dev);
+  };
+
   option_parser_t parser;
   parser.help(&suggest_help);
   parser.option('h', "help", 0, [&](const char* s){help(0);});
   parser.option('d', 0, 0, [&](const char* s){debug = true;});
   parser.option('g', 0, 0, [&](const char* s){histogram = true;});
+  parser.option(0, "tlb-stats", 0, [&](const char* s){tlb_stats = true;});
+  parser.option(0, "idle-skip", 0, [&](const char* s){idle_skip = true;});
+  parser.option(0, "tlb", 1, [&](const char* s){parse_tlb_size(s, &tlb_sets, &tlb_ways);});
   parser.option('l', 0, 0, [&](const char* s){log = true;});
   parser.option('p', 0, 1, [&](const char* s){nprocs = atoul_nonzero_safe(s);});
   parser.option('m', 0, 1, [&](const char* s){mems = make_mems(s);});
+  parser.option(0, "thp", 0, [&](const char* s){huge_pages = true;});
+  parser.option(0, "mem-stats", 0, [&](const char* s){mem_stats = true;});
+  parser.option(0, "map-elf", 0, [&](const char* s){map_elf = true;});
+  parser.option(0, "checkpoint", 1, [&](const char* s){parse_steps_and_path(s, &checkpoint_steps, &checkpoint_dir);});
+  parser.option(0, "restore", 1, [&](const char* s){restore_dir = s;});
+  parser.option(0, "bbv", 1, [&](const char* s){parse_steps_and_path(s, &bbv_interval, &bbv_path);});
+  parser.option(0, "simpoints", 1, [&](const char* s){max_simpoints = atoul_nonzero_safe(s);});
+  parser.option(0, "sample", 1, [&](const char* s){parse_steps_and_path(s, &sample_interval, &sample_path);});
+  parser.option(0, "sample-warmup", 1, [&](const char* s){sample_warmup = atoul_safe(s);});
   // I wanted to use --halted, but for some reason that doesn't work.
   parser.option('H', 0, 0, [&](const char* s){halted = true;});
   parser.option(0, "rbb-port", 1, [&](const char* s){use_rbb = true; rbb_port = atoul_safe(s);});
@@ -318,11 +470,21 @@ int main(int argc, char** argv)
   parser.option(0, "ic", 1, [&](const char* s){ic.reset(new icache_sim_t(s));});
   parser.option(0, "dc", 1, [&](const char* s){dc.reset(new dcache_sim_t(s));});
   parser.option(0, "l2", 1, [&](const char* s){l2.reset(cache_sim_t::construct(s, "L2$"));});
+  parser.option(0, "llc", 1, [&](const char* s){
+    llc.reset(llc_sim_t::construct(s));
+    plugin_devices.emplace_back(LLC_BASE, new llc_regs_t(&*llc));
+  });
+  parser.option(0, "hyperram", 1, [&](const char* s){hyperram.reset(hyperram_t::construct(s));});
+  parser.option(0, "coalesce", 1, [&](const char* s){coalescer.reset(coalescer_t::construct(s));});
+  parser.option(0, "perf-counters", 0, [&](const char* s){perf_counters = true;});
+  parser.option(0, "cpi", 1, [&](const char* s){cpi = parse_cpi(s);});
   parser.option(0, "log-cache-miss", 0, [&](const char* s){log_cache = true;});
   parser.option(0, "isa", 1, [&](const char* s){isa = s;});
   parser.option(0, "priv", 1, [&](const char* s){priv = s;});
   parser.option(0, "varch", 1, [&](const char* s){varch = s;});
   parser.option(0, "device", 1, device_parser);
+  parser.option(0, "virtio-blk", 1, [&](const char* s){add_virtio(new virtio_blk_t(s));});
+  parser.option(0, "virtio-console", 0, [&](const char* s){add_virtio(new virtio_console_t());});
   parser.option(0, "extension", 1, [&](const char* s){extensions.push_back(find_extension(s));});
   parser.option(0, "dump-dts", 0, [&](const char *s){dump_dts = true;});
   parser.option(0, "disable-dtb", 0, [&](const char *s){dtb_enabled = false;});
@@ -331,6 +493,7 @@ int main(int argc, char** argv)
   parser.option(0, "initrd", 1, [&](const char* s){initrd = s;});
   parser.option(0, "bootargs", 1, [&](const char* s){bootargs = s;});
   parser.option(0, "real-time-clint", 0, [&](const char *s){real_time_clint = true;});
+  parser.option(0, "parallel", 1, [&](const char *s){parse_parallel(s, &parallel_quantum, &parallel_deterministic);});
   parser.option(0, "extlib", 1, [&](const char *s){
     void *lib = dlopen(s, RTLD_NOW | RTLD_GLOBAL);
     if (lib == NULL) {
@@ -365,10 +528,65 @@ int main(int argc, char** argv)
   std::vector<std::string> htif_args(argv1, (const char*const*)argv + argc);
   if (mems.empty())
     mems = make_mems("2048");
+  if (huge_pages)
+    for (auto& mem : mems)
+      mem.second->set_huge_pages(true);
+
+  // Back the LLC's scratchpad, for all the ways software may commit to it,
+  // unless -m already does, and alias it at its uncached base unless -m
+  // puts memory there too.
+  if (llc) {
+    mem_t* spm = NULL;
+    reg_t spm_offset = 0;
+    bool alias_backed = false;
+    for (auto& mem : mems) {
+      if (llc_sim_t::SPM_BASE - mem.first < mem.second->size()) {
+        spm = mem.second;
+        spm_offset = llc_sim_t::SPM_BASE - mem.first;
+      }
+      if (llc_sim_t::SPM_UNCACHED_BASE - mem.first < mem.second->size())
+        alias_backed = true;
+    }
+    if (!spm) {
+      spm = new mem_t((llc->max_spm_size() + PGSIZE - 1) & PGMASK);
+      plugin_devices.emplace_back(reg_t(llc_sim_t::SPM_BASE), spm);
+    }
+    if (!alias_backed)
+      plugin_devices.emplace_back(reg_t(llc_sim_t::SPM_UNCACHED_BASE),
+                                  new llc_spm_alias_t(spm, spm_offset));
+  }
 
   if (!*argv1)
     help();
 
+  // the cache models are shared between harts
+  if (parallel_quantum && !parallel_deterministic && (ic || dc || l2 || llc || hyperram || coalescer || perf_counters))
+    help();
+
+  // The DRAM port is the one into the HyperBus controller, below the LLC.
+  // Ports that aren't modelled see what the core's does.
+  if (perf_counters) {
+    core_port.reset(new axi_port_t("Core"));
+    const axi_counters_t* core = &core_port->get_counters();
+    const axi_counters_t* to_llc = llc ? &llc->get_in_counters() : core;
+    const axi_counters_t* to_dram = coalescer ? &coalescer->get_counters()
+                                    : llc ? &llc->get_out_counters() : core;
+    plugin_devices.emplace_back(PERF_COUNTER_BASE, new axi_perf_counters_t(to_dram));
+    plugin_devices.emplace_back(PERF_COUNTER_BASE + PERF_COUNTER_SIZE, new axi_perf_counters_t(to_llc));
+    plugin_devices.emplace_back(PERF_COUNTER_BASE + 2 * PERF_COUNTER_SIZE, new axi_perf_counters_t(core));
+  }
+
+  std::unique_ptr<simpoint_sampler_t> sampler;
+  if (sample_interval) {
+    if (sample_warmup == reg_t(-1))
+      sample_warmup = sample_interval / 10;
+    sampler.reset(new simpoint_sampler_t(sample_path, sample_interval, sample_warmup));
+    if (ic) sampler->add_tracer(&*ic);
+    if (dc) sampler->add_tracer(&*dc);
+    if (l2) sampler->add_cache(&*l2);
+    if (llc) sampler->add_cache(&*llc);
+  }
+
   if (kernel && check_file_exists(kernel)) {
     kernel_size = get_file_size(kernel);
     if (isa[2] == '6' && isa[3] == '4')
@@ -411,14 +629,34 @@ int main(int argc, char** argv)
     return 0;
   }
 
-  if (ic && l2) ic->set_miss_handler(&*l2);
-  if (dc && l2) dc->set_miss_handler(&*l2);
+  // each level's misses go to the next one configured
+  mem_model_t* below = hyperram.get();
+  if (coalescer) {
+    if (below) coalescer->set_miss_handler(below);
+    below = &*coalescer;
+  }
+  if (llc) {
+    if (below) llc->set_miss_handler(below);
+    below = &*llc;
+  }
+  if (l2) {
+    if (below) l2->set_miss_handler(below);
+    below = &*l2;
+  }
+  if (core_port) {
+    core_port->set_next(below);
+    below = &*core_port;
+  }
+  if (ic && below) ic->set_miss_handler(below);
+  if (dc && below) dc->set_miss_handler(below);
+  if (!ic && !dc && below) uncached.reset(new uncached_memtracer_t(below));
   if (ic) ic->set_log(log_cache);
   if (dc) dc->set_log(log_cache);
   for (size_t i = 0; i < nprocs; i++)
   {
     if (ic) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
     if (dc) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
+    if (uncached) s.get_core(i)->get_mmu()->register_memtracer(&*uncached);
     for (auto e : extensions)
       s.get_core(i)->register_extension(e());
   }
@@ -426,9 +664,33 @@ int main(int argc, char** argv)
   s.set_debug(debug);
   s.configure_log(log, log_commits);
   s.set_histogram(histogram);
+  s.set_tlb_stats(tlb_stats);
+  s.set_tlb_size(tlb_sets, tlb_ways);
+  s.set_idle_skip(idle_skip);
+  s.set_map_elf(map_elf);
+  s.set_cpi(cpi);
+  s.set_parallel(parallel_quantum, parallel_deterministic);
+  if (checkpoint_steps)
+    s.set_checkpoint(checkpoint_steps, checkpoint_dir);
+  if (!restore_dir.empty())
+    s.set_restore(restore_dir);
+  if (bbv_interval)
+    s.set_bbv(bbv_interval, bbv_path, max_simpoints);
+  if (sampler)
+    s.set_sampler(&*sampler);
 
   auto return_code = s.run();
 
+  if (sampler)
+    sampler->print_stats();
+
+  if (mem_stats) {
+    for (auto& mem : mems) {
+      fprintf(stderr, "mem 0x%" PRIx64 ": %" PRIu64 " KiB of %" PRIu64 " KiB resident\n",
+              mem.first, mem.second->resident_size() >> 10, mem.second->size() >> 10);
+    }
+  }
+
   for (auto& mem : mems)
     delete mem.second;
 
@@ -0,0 +1,45 @@
+#!/usr/bin/python
+
+import re
+import testlib
+import unittest
+
+def read_stats(path):
+    """Return the D$ statistics and hart 0's cycles from a spike log."""
+    stats = {}
+    for line in open(path):
+        m = re.match(r"D\$ (.*):\s+(\d+)$", line)
+        if m:
+            stats[m.group(1)] = int(m.group(2))
+        m = re.match(r"core\s+0: cycles:\s+(\d+)", line)
+        if m:
+            stats["cycles"] = int(m.group(1))
+    return stats
+
+class CacheLatencyTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("cachelat.s")
+
+    def run_spike(self, dc):
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--cpi=1", "--dc=" + dc])
+        self.assertEqual(spike.wait(), 0)
+        return read_stats("spike.log")
+
+    def test_latency(self):
+        """Make sure that the D$ charges its hit and miss latencies."""
+        base = self.run_spike("64:4:64:lru")
+        timed = self.run_spike("64:4:64:lru:2:20")
+        accesses = timed["Read Accesses"] + timed["Write Accesses"]
+        misses = timed["Read Misses"] + timed["Write Misses"]
+        self.assertGreater(accesses - misses, misses)
+        self.assertEqual(timed["cycles"] - base["cycles"],
+                2 * (accesses - misses) + 20 * misses)
+
+    def test_default(self):
+        """Make sure that a D$ without latencies stalls for nothing."""
+        base = self.run_spike("64:4:64")
+        self.assertEqual(base, self.run_spike("64:4:64:0:0"))
+
+if __name__ == '__main__':
+    unittest.main()
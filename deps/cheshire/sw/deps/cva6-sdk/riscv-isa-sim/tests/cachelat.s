@@ -0,0 +1,26 @@
+        # Loads of a few lines, each hitting after its first miss.
+        .text
+        .global _start
+_start:
+        li      t1, 32
+1:      la      t0, data
+        ld      t2, 0(t0)
+        ld      t2, 64(t0)
+        ld      t2, 128(t0)
+        addi    t1, t1, -1
+        bnez    t1, 1b
+
+        li      a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  6
+data:   .space  192
+
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
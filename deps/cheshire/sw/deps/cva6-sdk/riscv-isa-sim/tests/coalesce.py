@@ -0,0 +1,35 @@
+#!/usr/bin/python
+
+import re
+import testlib
+import unittest
+
+def read_stats(path):
+    """Return the coalescing buffer's statistics from a spike log."""
+    stats = {}
+    for line in open(path):
+        m = re.match(r"CoalBuf (.*):\s+(\d+)", line)
+        if m:
+            stats[m.group(1)] = int(m.group(2))
+    return stats
+
+class CoalescerTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("coalesce.s")
+
+    def test_write_drops_read_buffer(self):
+        """Make sure that a read after a write to the burst in the read buffer
+        misses it."""
+        # 8-byte entries, so that every store goes out at once
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--coalesce=1:8:4096:0"])
+        result = spike.wait()
+        self.assertEqual(result, 0)
+        stats = read_stats("spike.log")
+        self.assertEqual(stats["Bursts Written"], 17)
+        # the fetch after each burst goes out must refill the read buffer
+        misses = stats["Reads"] - stats["Read Buffer Hits"] - stats["Forwarded Reads"]
+        self.assertGreaterEqual(misses, stats["Bursts Written"])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,24 @@
+        # Everything here fits in one 4 KiB read burst.
+        .text
+        .global _start
+_start:
+        la      t0, data
+        li      t1, 16
+1:      sd      t1, 0(t0)
+        addi    t1, t1, -1
+        bnez    t1, 1b
+
+        li      a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  3
+data:   .dword  0
+
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
@@ -0,0 +1,29 @@
+#!/usr/bin/python
+
+import testlib
+import unittest
+
+class FetchFaultTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("fetchfault.s")
+
+    def test_fault(self):
+        """Make sure that a fetch page fault traps to the faulting PC."""
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False)
+        result = spike.wait()
+        self.assertEqual(result, 0)
+
+    def test_log(self):
+        """Make sure that the instruction log doesn't show an instruction for
+        a fetch that faulted."""
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["-l"])
+        result = spike.wait()
+        self.assertEqual(result, 0)
+        log = open("spike.log").read()
+        self.assertIn("0x0000000080000000", log)
+        self.assertNotIn("0x00000000c0000000 (", log)
+
+if __name__ == '__main__':
+    unittest.main()
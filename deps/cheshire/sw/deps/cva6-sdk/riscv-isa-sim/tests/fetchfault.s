@@ -0,0 +1,62 @@
+        .equ    FAULT_ADDR, 0xc0000000
+        .equ    CAUSE_FETCH_PAGE_FAULT, 12
+        .equ    MSTATUS_MPP_S, 0x800
+        .equ    SATP_SV39, 8
+
+        .text
+        .global _start
+_start:
+        la      t0, trap
+        csrw    mtvec, t0
+
+        # Map the gigapage at 0x80000000 onto itself; nothing else.
+        la      t0, root
+        li      t1, 0x80000000 >> 2
+        ori     t1, t1, 0xcf    # V R W X A D
+        sd      t1, 16(t0)
+        srli    t0, t0, 12
+        li      t1, SATP_SV39
+        slli    t1, t1, 60
+        or      t0, t0, t1
+        csrw    satp, t0
+        sfence.vma
+
+        li      t0, MSTATUS_MPP_S
+        csrs    mstatus, t0
+        la      t0, supervisor
+        csrw    mepc, t0
+        mret
+
+supervisor:
+        li      t0, FAULT_ADDR
+        jr      t0
+
+trap:
+        li      t1, FAULT_ADDR
+        csrr    t0, mcause
+        li      t2, CAUSE_FETCH_PAGE_FAULT
+        li      a0, 2
+        bne     t0, t2, exit
+        csrr    t0, mepc
+        li      a0, 3
+        bne     t0, t1, exit
+        csrr    t0, mtval
+        li      a0, 4
+        bne     t0, t1, exit
+        li      a0, 0
+exit:
+        slli    a0, a0, 1
+        ori     a0, a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  12
+root:   .space  4096
+
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
@@ -0,0 +1,33 @@
+#!/usr/bin/python
+
+import re
+import testlib
+import unittest
+
+def read_stats(path):
+    """Return the HyperRAM's statistics from a spike log."""
+    stats = {}
+    for line in open(path):
+        m = re.match(r"HyperRAM (.*):\s+(\d+)$", line)
+        if m:
+            stats[m.group(1)] = int(m.group(2))
+    return stats
+
+class HyperRamTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("hyperram.s")
+
+    def test_window(self):
+        """Make sure that only accesses to the DRAM window reach the
+        HyperRAM."""
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--hyperram=1:2",
+                    "-m0x10000000:0x1000,0x80000000:0x100000"])
+        self.assertEqual(spike.wait(), 0)
+        stats = read_stats("spike.log")
+        # the store to tohost
+        self.assertEqual(stats["Writes"], 1)
+        self.assertEqual(stats["Bytes Written"], 8)
+
+if __name__ == '__main__':
+    unittest.main()
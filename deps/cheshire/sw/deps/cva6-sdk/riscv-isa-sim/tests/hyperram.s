@@ -0,0 +1,25 @@
+        .equ    OTHER_BASE, 0x10000000
+
+        # Stores to memory outside the DRAM window, which the HyperRAM
+        # must not see.
+        .text
+        .global _start
+_start:
+        li      t0, OTHER_BASE
+        li      t1, 16
+1:      sd      t1, 0(t0)
+        addi    t0, t0, 8
+        addi    t1, t1, -1
+        bnez    t1, 1b
+
+        li      a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
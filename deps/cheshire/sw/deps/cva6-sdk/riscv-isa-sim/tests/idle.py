@@ -0,0 +1,41 @@
+#!/usr/bin/python
+
+import os
+import shutil
+import testlib
+import unittest
+import tempfile
+
+def read_checkpoint(path):
+    """Return the values in a checkpoint section as little-endian integers."""
+    values = {}
+    for line in open(path):
+        name, value = line.split()
+        digits = [value[i:i+2] for i in range(0, len(value), 2)]
+        values[name] = int("".join(reversed(digits)), 16)
+    return values
+
+class IdleSkipTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("idle.s")
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_nothing_pending(self):
+        """Make sure that time goes on as usual when idle harts can't wake."""
+        steps = 1000000
+        checkpoint = os.path.join(self.dir, "cp")
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--idle-skip",
+                    "--checkpoint=%d:%s" % (steps, checkpoint)])
+        spike.wait()
+        machine = read_checkpoint(os.path.join(checkpoint, "machine"))
+        clint = read_checkpoint(os.path.join(checkpoint, "clint"))
+        self.assertGreaterEqual(machine["steps_per_hart"], steps)
+        self.assertLess(machine["steps_per_hart"], 2 * steps)
+        self.assertEqual(clint["mtime"], machine["steps_per_hart"] // 100)
+
+if __name__ == '__main__':
+    unittest.main()
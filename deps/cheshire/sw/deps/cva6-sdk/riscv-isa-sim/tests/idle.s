@@ -0,0 +1,13 @@
+        .text
+        .global _start
+_start:
+        # No interrupt is enabled, so nothing can ever wake the hart.
+        csrw    mie, zero
+1:      wfi
+        j       1b
+
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
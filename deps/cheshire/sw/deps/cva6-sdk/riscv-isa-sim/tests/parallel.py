@@ -0,0 +1,34 @@
+#!/usr/bin/python
+
+import testlib
+import unittest
+
+class ParallelTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("parallel.s")
+
+    def run_spike(self, parallel, signature=None):
+        args = ["-p4", "--parallel=" + parallel]
+        if signature:
+            args.append("+signature=" + signature)
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=30,
+                with_pk=False, args=args)
+        return spike.wait()
+
+    def test_atomics(self):
+        """Make sure that AMOs and LR/SC stay atomic with harts on their own
+        threads."""
+        self.assertEqual(self.run_spike("100"), 0)
+
+    def test_deterministic(self):
+        """Make sure that deterministic runs interleave the harts the same
+        way every time."""
+        self.assertEqual(self.run_spike("100:det", "order1.sig"), 0)
+        self.assertEqual(self.run_spike("100:det", "order2.sig"), 0)
+        order = open("order1.sig").read()
+        self.assertEqual(order, open("order2.sig").read())
+        # the harts took turns
+        self.assertGreater(len(set(order.split())), 1)
+
+if __name__ == '__main__':
+    unittest.main()
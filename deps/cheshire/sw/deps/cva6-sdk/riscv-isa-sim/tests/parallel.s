@@ -0,0 +1,70 @@
+        .equ    NHARTS, 4
+        .equ    ITERS, 1000
+
+        # Every hart bumps one counter with amoadd and another with an LR/SC
+        # loop, noting its hart ID in the order it finishes each iteration.
+        .text
+        .global _start
+_start:
+        csrr    s0, mhartid
+        la      s1, amo_count
+        la      s2, lrsc_count
+        la      s3, order
+        la      s4, next
+        li      s5, ITERS
+1:      li      t0, 1
+        amoadd.d zero, t0, (s1)
+2:      lr.d    t0, (s2)
+        addi    t0, t0, 1
+        sc.d    t1, t0, (s2)
+        bnez    t1, 2b
+        li      t0, 1
+        amoadd.d t0, t0, (s4)
+        add     t0, t0, s3
+        sb      s0, 0(t0)
+        addi    s5, s5, -1
+        bnez    s5, 1b
+
+        la      t0, done
+        li      t1, 1
+        amoadd.d zero, t1, (t0)
+        beqz    s0, 3f
+park:   wfi
+        j       park
+
+        # Hart 0 checks the counters once every hart is done.
+3:      li      t1, NHARTS
+4:      ld      t2, 0(t0)
+        bne     t2, t1, 4b
+        li      t1, NHARTS * ITERS
+        ld      t2, 0(s1)
+        li      a0, 2
+        bne     t2, t1, exit
+        ld      t2, 0(s2)
+        li      a0, 3
+        bne     t2, t1, exit
+        li      a0, 0
+exit:
+        slli    a0, a0, 1
+        ori     a0, a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  3
+amo_count:  .dword 0
+lrsc_count: .dword 0
+next:   .dword  0
+done:   .dword  0
+        .global begin_signature
+begin_signature:
+order:  .space  NHARTS * ITERS
+        .global end_signature
+end_signature:
+
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
@@ -0,0 +1,22 @@
+#!/usr/bin/python
+
+import testlib
+import unittest
+import tempfile
+
+class SeipTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("seip.s")
+        self.disk = tempfile.NamedTemporaryFile()
+        self.disk.write(b"\0" * 1024)
+        self.disk.flush()
+
+    def test_rmw(self):
+        """Make sure that a csrs of mip doesn't latch the PLIC's SEIP line."""
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--virtio-blk=" + self.disk.name])
+        result = spike.wait()
+        self.assertEqual(result, 0)
+
+if __name__ == '__main__':
+    unittest.main()
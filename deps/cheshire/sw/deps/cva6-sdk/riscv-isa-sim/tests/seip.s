@@ -0,0 +1,147 @@
+        .equ    PLIC_BASE, 0x0c000000
+        .equ    VIRTIO_BASE, 0x18000000
+        .equ    MIP_SSIP, 0x002
+        .equ    MIP_SEIP, 0x200
+
+        .text
+        .global _start
+_start:
+        li      s0, VIRTIO_BASE
+        li      s1, PLIC_BASE
+
+        # Route source 1 (the virtio-blk device) to hart 0's S-mode context.
+        li      t0, 1
+        sw      t0, 4(s1)
+        li      t0, 0x2080
+        add     t0, t0, s1
+        li      t1, 2
+        sw      t1, 0(t0)
+
+        # Bring up the device with one 8-entry queue.
+        li      t0, 3
+        sw      t0, 0x70(s0)
+        li      t0, 1
+        sw      t0, 0x24(s0)
+        sw      t0, 0x20(s0)
+        li      t0, 11
+        sw      t0, 0x70(s0)
+        sw      zero, 0x30(s0)
+        li      t0, 8
+        sw      t0, 0x38(s0)
+        la      t0, desc
+        sw      t0, 0x80(s0)
+        sw      zero, 0x84(s0)
+        la      t0, avail
+        sw      t0, 0x90(s0)
+        sw      zero, 0x94(s0)
+        la      t0, used
+        sw      t0, 0xa0(s0)
+        sw      zero, 0xa4(s0)
+        li      t0, 1
+        sw      t0, 0x44(s0)
+        li      t0, 15
+        sw      t0, 0x70(s0)
+
+        # Read sector 1: header, data and status descriptors.
+        la      t0, desc
+        la      t1, hdr
+        sd      t1, 0(t0)
+        li      t1, 16
+        sw      t1, 8(t0)
+        li      t1, 1
+        sh      t1, 12(t0)
+        sh      t1, 14(t0)
+        la      t1, data
+        sd      t1, 16(t0)
+        li      t1, 512
+        sw      t1, 24(t0)
+        li      t1, 3
+        sh      t1, 28(t0)
+        li      t1, 2
+        sh      t1, 30(t0)
+        la      t1, status
+        sd      t1, 32(t0)
+        li      t1, 1
+        sw      t1, 40(t0)
+        li      t1, 2
+        sh      t1, 44(t0)
+        la      t0, avail
+        li      t1, 1
+        sh      t1, 2(t0)
+        sw      zero, 0x50(s0)
+
+        la      t0, used
+        li      t2, 100000
+1:      lhu     t1, 2(t0)
+        bnez    t1, 2f
+        addi    t2, t2, -1
+        bnez    t2, 1b
+        li      a0, 2
+        j       exit
+
+        # The completion raises SEIP through the PLIC.
+2:      li      t3, MIP_SEIP
+        csrr    t1, mip
+        and     t1, t1, t3
+        li      a0, 3
+        beqz    t1, exit
+
+        # A read-modify-write of mip while the line is high...
+        csrsi   mip, MIP_SSIP
+
+        # ...must not keep SEIP raised once the interrupt is completed.
+        li      t0, 1
+        sw      t0, 0x64(s0)
+        li      t0, 0x201004
+        add     t0, t0, s1
+        lw      t1, 0(t0)
+        li      a0, 4
+        li      t2, 1
+        bne     t1, t2, exit
+        sw      t1, 0(t0)
+        csrr    t1, mip
+        and     t2, t1, t3
+        li      a0, 5
+        bnez    t2, exit
+        andi    t2, t1, MIP_SSIP
+        li      a0, 6
+        beqz    t2, exit
+
+        # Software can still raise and clear SEIP itself.
+        csrs    mip, t3
+        csrr    t1, mip
+        and     t1, t1, t3
+        li      a0, 7
+        beqz    t1, exit
+        csrc    mip, t3
+        csrr    t1, mip
+        and     t1, t1, t3
+        li      a0, 8
+        bnez    t1, exit
+
+        li      a0, 0
+exit:
+        slli    a0, a0, 1
+        ori     a0, a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  4
+hdr:    .dword  0
+        .dword  1
+status: .dword  255
+        .align  4
+desc:   .space  128
+avail:  .space  64
+        .align  2
+used:   .space  128
+        .align  4
+data:   .space  512
+
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
@@ -0,0 +1,25 @@
+#!/usr/bin/python
+
+import testlib
+import unittest
+
+class SpmTest(unittest.TestCase):
+    def setUp(self):
+        self.binary = testlib.compile_bare("spm.s")
+
+    def test_backed(self):
+        """Make sure that --llc brings memory for the scratchpad and its
+        uncached alias."""
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--llc=256:8:64"])
+        self.assertEqual(spike.wait(), 0)
+
+    def test_user_memory(self):
+        """Make sure that the uncached alias reaches memory given with -m."""
+        spike = testlib.Spike(self.binary, with_gdb=False, timeout=10,
+                with_pk=False, args=["--llc=256:8:64",
+                    "-m0x10000000:0x100000,0x80000000:0x100000"])
+        self.assertEqual(spike.wait(), 0)
+
+if __name__ == '__main__':
+    unittest.main()
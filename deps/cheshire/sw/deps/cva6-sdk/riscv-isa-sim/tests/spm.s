@@ -0,0 +1,34 @@
+        .equ    SPM_BASE, 0x10000000
+        .equ    SPM_UNCACHED_BASE, 0x14000000
+
+        # Write the scratchpad through one window and read it back through
+        # the other.
+        .text
+        .global _start
+_start:
+        li      s0, SPM_BASE
+        li      s1, SPM_UNCACHED_BASE
+        li      t0, 0x12345678
+        sd      t0, 64(s0)
+        ld      t1, 64(s1)
+        li      a0, 2
+        bne     t0, t1, exit
+        not     t0, t0
+        sd      t0, 128(s1)
+        ld      t1, 128(s0)
+        li      a0, 3
+        bne     t0, t1, exit
+        li      a0, 0
+exit:
+        slli    a0, a0, 1
+        ori     a0, a0, 1
+        la      t0, tohost
+        sd      a0, 0(t0)
+1:      j       1b
+
+        .data
+        .align  6
+        .global tohost
+tohost: .dword  0
+        .global fromhost
+fromhost: .dword 0
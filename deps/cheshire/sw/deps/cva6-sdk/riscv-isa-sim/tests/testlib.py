@@ -31,6 +31,12 @@ def compile(*args):
     assert result == 0, "%r failed" % cmd
     return dst
 
+def compile_bare(*args):
+    """Compile a program that runs on spike without pk, starting at _start in
+    the default memory region."""
+    return compile(args[0], "-nostdlib", "-nostartfiles",
+            "-Wl,-N,-Ttext=0x80000000", *args[1:])
+
 def unused_port():
     # http://stackoverflow.com/questions/2838244/get-open-tcp-port-in-python/2838309#2838309
     import socket
@@ -41,7 +47,8 @@ def unused_port():
     return port
 
 class Spike(object):
-    def __init__(self, binary, halted=False, with_gdb=True, timeout=None):
+    def __init__(self, binary, halted=False, with_gdb=True, timeout=None,
+            with_pk=True, args=()):
         """Launch spike. Return tuple of its process and the port it's running on."""
         cmd = []
         if timeout:
@@ -53,7 +60,9 @@ class Spike(object):
         if with_gdb:
             self.port = unused_port()
             cmd += ['--gdb-port', str(self.port)]
-        cmd.append('pk')
+        cmd += list(args)
+        if with_pk:
+            cmd.append('pk')
         if binary:
             cmd.append(binary)
         logfile = open("spike.log", "w")